@@ -1,6 +1,7 @@
 #include <string>
 #include <cmath>
 #include <cstdlib>
+#include <stdexcept>
 #include <limits>
 
 #include "itkImage.h"
@@ -8,6 +9,8 @@
 #include "itkImageFileWriter.h"
 #include "itkPasteImageFilter.h"
 #include "itkSubtractImageFilter.h"
+#include "RegistrationOptions.h"
+#include "TranslationLocalizer.h"
 
 inline double deg2rad(double angle)
 {
@@ -16,9 +19,21 @@ inline double deg2rad(double angle)
 
 int main( int argc, char * argv[] )
 {
-    if( argc < 4 ) {
+    // locateShrink must be a whole number of at least 1
+    uint32_t locateShrink = 8;
+    bool validShrink = true;
+    if (argc > 5) {
+        try {
+            validShrink = parseItem(std::string(argv[5]), locateShrink) && locateShrink >= 1;
+        } catch (const std::exception&) {
+            validShrink = false;
+        }
+    }
+    if( argc < 5 || !validShrink ) {
         std::cerr << "Usage: " << std::endl;
-        std::cerr << argv[0] << " fixed moving newimage tmpimage" << std::endl;
+        std::cerr << argv[0] << " fixed moving newimage tmpimage [locateShrink]" << std::endl;
+        std::cerr << "The moving image is pasted where FFT correlation at 1/locateShrink resolution"
+                  << " (default 8, at least 1) finds it in the fixed image" << std::endl;
         return EXIT_FAILURE;
     }
 
@@ -51,12 +66,17 @@ int main( int argc, char * argv[] )
     // Configure region where we will paste it
     movingReader->Update();
     fixedReader->Update();
-    auto movingSize = movingReader->GetOutput()->GetLargestPossibleRegion().GetSize();
-    auto fixedSize = fixedReader->GetOutput()->GetLargestPossibleRegion().GetSize();
+    const auto fixed  = fixedReader->GetOutput();
+    const auto moving = movingReader->GetOutput();
+    double correlation = 0.0;
+    const auto fixedLocalizer  = localizerImage(fixed, fixed->GetSpacing() * double(locateShrink));
+    const auto movingLocalizer = localizerImage(moving, fixedLocalizer->GetSpacing());
+    const auto offset = locateTranslation(fixedLocalizer, movingLocalizer, 0.9, correlation);
+    TImage::PointType movingStart;
+    moving->TransformIndexToPhysicalPoint(moving->GetLargestPossibleRegion().GetIndex(), movingStart);
     TImage::IndexType start;
-    start[0] = uint32_t(floor((fixedSize[0] * 0.45 - movingSize[0]/2)));
-    start[1] = uint32_t(floor((fixedSize[1] * 0.55 - movingSize[1]/2)));
-    start[2] = 107;
+    fixed->TransformPhysicalPointToIndex(movingStart + offset, start);
+    std::cout << "Pasting at " << start << " (correlation " << correlation << ")" << std::endl;
 
     // Paste image region onto new image
     auto pasteFilter = itk::PasteImageFilter<TImage, TImage>::New();
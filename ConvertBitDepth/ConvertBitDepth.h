@@ -2,6 +2,7 @@
 #include "itkImageFileReader.h"
 #include "itkImageFileWriter.h"
 #include "itkRescaleIntensityImageFilter.h"
+#include "MappedImage.h"
 
 template <typename InPixel, typename OutPixel>
 const bool convertBitDepth(const std::string infile, const std::string outfile)
@@ -26,13 +27,21 @@ const bool convertBitDepth(const std::string infile, const std::string outfile)
     const uint32_t outBits = sizeof(OutPixel) * 8;
     rescaler->SetOutputMinimum(0);
     rescaler->SetOutputMaximum((1 << outBits) - 1);
-    rescaler->SetInput(reader->GetOutput());
 
     // Connect writer to the rescaler
     writer->SetInput(rescaler->GetOutput());
 
-    // Run the pipeline
+    // Run the pipeline. An uncompressed MetaImage is mapped and converted in place rather than
+    // read into memory first; the rescaler passes over it twice (range, then rescale).
     try {
+        const auto mapped = mapMetaImage<InputPixelType>(infile, MappedAccess::Whole);
+        if (mapped) {
+            // The mapping is read-only; with equal bit depths the rescaler would work in place
+            rescaler->InPlaceOff();
+            rescaler->SetInput(mapped);
+        } else {
+            rescaler->SetInput(reader->GetOutput());
+        }
         writer->Update();
     } catch (itk::ExceptionObject& ex) {
         std::cerr << "[error]: ExceptionObject caught" << std::endl;
@@ -5,6 +5,7 @@
 #include "itkImageFileReader.h"
 #include "itkImageSeriesWriter.h"
 #include "itkNumericSeriesFileNames.h"
+#include "MappedImage.h"
 
 
 const uint32_t MhdDimension = 3;
@@ -13,20 +14,11 @@ const uint32_t SliceDimension = 2;
 template <typename PixelType>
 bool doConvert(std::string inputFile, std::string outputDir)
 {
-    // Create reader
-    auto reader = itk::ImageFileReader< itk::Image<PixelType, MhdDimension> >::New();
-    reader->SetFileName(inputFile);
-
-    // Create writer, connect to reader
-    auto writer = itk::ImageSeriesWriter<
-        itk::Image<PixelType, MhdDimension>,
-        itk::Image<PixelType, SliceDimension>
-    >::New();
-    writer->SetInput(reader->GetOutput());
-
-    // Execute read
+    // Execute read. An uncompressed MetaImage is mapped rather than read, and the slices are
+    // written straight from the mapping, front to back.
+    typename itk::Image<PixelType, MhdDimension>::Pointer image;
     try {
-        reader->Update();
+        image = readImage< itk::Image<PixelType, MhdDimension> >(inputFile, MappedAccess::Sequential);
     }
     catch (itk::ExceptionObject& excp) {
         std::cerr << "Exception thrown while reading the image" << std::endl;
@@ -34,8 +26,15 @@ bool doConvert(std::string inputFile, std::string outputDir)
         return false;
     }
 
+    // Create writer, connect to the read image
+    auto writer = itk::ImageSeriesWriter<
+        itk::Image<PixelType, MhdDimension>,
+        itk::Image<PixelType, SliceDimension>
+    >::New();
+    writer->SetInput(image);
+
     // Get slice start/end from read image
-    const auto region = reader->GetOutput()->GetLargestPossibleRegion();
+    const auto region = image->GetLargestPossibleRegion();
     const auto start = region.GetIndex();
     const auto size = region.GetSize();
     const uint32_t firstSlice = start[2];
@@ -0,0 +1,230 @@
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include "itkImage.h"
+#include "itkSpatialObject.h"
+
+
+// Binary mask at one bit per voxel, e.g. of the thresholded volume extractSandGrainCentroids
+// writes. Any nonzero voxel of the image it is made from is inside. Lookups are plain inline
+// functions, so the kernels can test it per sample.
+class BitMask
+{
+    public:
+        typedef itk::Point<double, 3> PointType;
+        typedef itk::Index<3> IndexType;
+        typedef itk::Size<3> SizeType;
+
+        template <typename TImage>
+        explicit BitMask(const TImage* image)
+            : m_Index(image->GetBufferedRegion().GetIndex()), m_Size(image->GetBufferedRegion().GetSize()),
+              m_NumberOfInsideVoxels(0)
+        {
+            const auto& pointToIndex = image->GetPhysicalPointToIndex();
+            for (int i = 0; i < 3; ++i) {
+                m_Origin[i] = image->GetOrigin()[i];
+                for (int j = 0; j < 3; ++j) {
+                    m_PointToIndex[i][j] = pointToIndex[i][j];
+                }
+            }
+            const uint64_t numberOfVoxels = image->GetBufferedRegion().GetNumberOfPixels();
+            m_Words.assign((numberOfVoxels + 31) / 32, 0u);
+            const auto buffer = image->GetBufferPointer();
+            for (uint64_t v = 0; v < numberOfVoxels; ++v) {
+                if (buffer[v] != 0) {
+                    m_Words[v >> 5] |= 1u << (v & 31);
+                    m_NumberOfInsideVoxels++;
+                }
+            }
+        }
+
+        // Voxel at 'offset' in memory order
+        bool Test(const uint64_t offset) const
+        {
+            return (m_Words[offset >> 5] >> (offset & 31)) & 1u;
+        }
+
+        // Whether the voxel nearest to 'point' is inside. Points off the mask's grid are outside.
+        bool IsInside(const PointType& point) const
+        {
+            uint64_t offset = 0, stride = 1;
+            for (int i = 0; i < 3; ++i) {
+                double c = 0.0;
+                for (int j = 0; j < 3; ++j) {
+                    c += m_PointToIndex[i][j] * (point[j] - m_Origin[j]);
+                }
+                const int64_t index = int64_t(std::floor(c + 0.5)) - m_Index[i];
+                if (index < 0 || index >= int64_t(m_Size[i])) {
+                    return false;
+                }
+                offset += uint64_t(index) * stride;
+                stride *= m_Size[i];
+            }
+            return Test(offset);
+        }
+
+        // Whether the mask has one voxel per voxel of 'image', so both can share offsets
+        template <typename TImage>
+        bool SharesGridWith(const TImage* image) const
+        {
+            return image->GetBufferedRegion().GetIndex() == m_Index && image->GetBufferedRegion().GetSize() == m_Size;
+        }
+
+        // Where the voxels of an image grid land in the mask's continuous index space: voxel
+        // (x, y, z) of the grid at base + x step[0] + y step[1] + z step[2]
+        struct GridMapping {
+            double base[3];
+            double step[3][3];
+            uint64_t size[3];
+        };
+
+        template <typename TImage>
+        GridMapping MapGrid(const TImage* image) const
+        {
+            const auto region = image->GetLargestPossibleRegion();
+            typename TImage::PointType corner, neighbour;
+            const auto index = region.GetIndex();
+            image->TransformIndexToPhysicalPoint(index, corner);
+            GridMapping grid;
+            for (int i = 0; i < 3; ++i) {
+                grid.size[i] = region.GetSize()[i];
+                grid.base[i] = 0.0;
+                for (int j = 0; j < 3; ++j) {
+                    grid.base[i] += m_PointToIndex[i][j] * (corner[j] - m_Origin[j]);
+                }
+            }
+            for (int k = 0; k < 3; ++k) {
+                auto next = index;
+                next[k] += 1;
+                image->TransformIndexToPhysicalPoint(next, neighbour);
+                for (int i = 0; i < 3; ++i) {
+                    grid.step[k][i] = 0.0;
+                    for (int j = 0; j < 3; ++j) {
+                        grid.step[k][i] += m_PointToIndex[i][j] * (neighbour[j] - corner[j]);
+                    }
+                }
+            }
+            return grid;
+        }
+
+        // Whether the mask voxel nearest to the center of the grid's voxel at 'offset' (in memory
+        // order) is inside. Like IsInside(), but in index space; CountInside() and the metric
+        // sampling both decide with this, so they always agree.
+        bool IsInside(const GridMapping& grid, const uint64_t offset) const
+        {
+            const double x = double(offset % grid.size[0]);
+            const double y = double((offset / grid.size[0]) % grid.size[1]);
+            const double z = double(offset / (grid.size[0] * grid.size[1]));
+            uint64_t maskOffset = 0, stride = 1;
+            for (int i = 0; i < 3; ++i) {
+                const double c = grid.base[i] + x * grid.step[0][i] + y * grid.step[1][i] + z * grid.step[2][i];
+                const int64_t voxel = int64_t(std::floor(c + 0.5)) - m_Index[i];
+                if (voxel < 0 || voxel >= int64_t(m_Size[i])) {
+                    return false;
+                }
+                maskOffset += uint64_t(voxel) * stride;
+                stride *= m_Size[i];
+            }
+            return Test(maskOffset);
+        }
+
+        // Number of voxels of 'image' inside, as IsInside(MapGrid(image), offset) decides. The
+        // count is remembered per image grid, so every level, stage and start on the same grid
+        // reuses it.
+        template <typename TImage>
+        uint64_t CountInside(const TImage* image) const
+        {
+            const auto region = image->GetLargestPossibleRegion();
+            std::vector<double> key;
+            for (int i = 0; i < 3; ++i) {
+                key.push_back(double(region.GetIndex()[i]));
+                key.push_back(double(region.GetSize()[i]));
+                key.push_back(image->GetOrigin()[i]);
+                key.push_back(image->GetSpacing()[i]);
+                for (int j = 0; j < 3; ++j) {
+                    key.push_back(image->GetDirection()[i][j]);
+                }
+            }
+            {
+                std::lock_guard<std::mutex> lock(m_CountsMutex);
+                for (const auto& counted : m_Counts) {
+                    if (counted.first == key) {
+                        return counted.second;
+                    }
+                }
+            }
+
+            const auto grid = MapGrid(image);
+            const uint64_t numberOfVoxels = region.GetNumberOfPixels();
+            uint64_t inside = 0;
+            for (uint64_t v = 0; v < numberOfVoxels; ++v) {
+                inside += IsInside(grid, v) ? 1 : 0;
+            }
+
+            std::lock_guard<std::mutex> lock(m_CountsMutex);
+            m_Counts.emplace_back(key, inside);
+            return inside;
+        }
+
+        // The bits, 32 voxels per word starting at the least significant bit
+        const uint32_t* GetWords() const { return m_Words.data(); }
+        const SizeType& GetSize() const { return m_Size; }
+        uint64_t GetNumberOfInsideVoxels() const { return m_NumberOfInsideVoxels; }
+
+    private:
+        IndexType m_Index;
+        SizeType m_Size;
+        double m_Origin[3];
+        double m_PointToIndex[3][3];
+        std::vector<uint32_t> m_Words;
+        uint64_t m_NumberOfInsideVoxels;
+        // CountInside() results so far, by image grid
+        mutable std::mutex m_CountsMutex;
+        mutable std::vector<std::pair<std::vector<double>, uint64_t>> m_Counts;
+};
+
+// Hands a BitMask to ITK's metrics as a moving image mask. SimilarityMeanSquaresMetric
+// recognizes it and tests the bits in its own kernels instead.
+class BitMaskSpatialObject : public itk::SpatialObject<3>
+{
+    public:
+        typedef BitMaskSpatialObject Self;
+        typedef itk::SpatialObject<3> Superclass;
+        typedef itk::SmartPointer<Self> Pointer;
+        typedef itk::SmartPointer<const Self> ConstPointer;
+        itkNewMacro(Self);
+        itkTypeMacro(BitMaskSpatialObject, SpatialObject);
+
+        void SetMask(std::shared_ptr<const BitMask> mask)
+        {
+            m_Mask = mask;
+            this->Modified();
+        }
+        const BitMask* GetMask() const { return m_Mask.get(); }
+
+        bool IsInside(const PointType& point, unsigned int, char*) const ITK_OVERRIDE
+        {
+            return m_Mask->IsInside(point);
+        }
+        bool IsEvaluableAt(const PointType& point, unsigned int, char*) const ITK_OVERRIDE
+        {
+            return m_Mask->IsInside(point);
+        }
+        bool ValueAt(const PointType& point, double& value, unsigned int, char*) const ITK_OVERRIDE
+        {
+            value = m_Mask->IsInside(point) ? 1.0 : 0.0;
+            return true;
+        }
+
+    protected:
+        BitMaskSpatialObject() {};
+
+    private:
+        std::shared_ptr<const BitMask> m_Mask;
+};
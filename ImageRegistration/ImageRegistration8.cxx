@@ -28,109 +28,228 @@
 //    OUTPUTS: {ImageRegistration8RegisteredSlice.png}
 //  Software Guide : EndCommandLineArgs
 
-// Software Guide : BeginLatex
-//
-// This example illustrates the use of the \doxygen{VersorRigid3DTransform}
-// class for performing registration of two $3D$ images.
-// The class \doxygen{CenteredTransformInitializer} is used to initialize the
-// center and translation of the transform.  The case of rigid registration of
-// 3D images is probably one of the most common uses of image registration.
-//
-// \index{itk::Versor\-Rigid3D\-Transform}
-// \index{itk::Centered\-Transform\-Initializer!In 3D}
-//
-// Software Guide : EndLatex
-
-#include "itkImageRegistrationMethodv4.h"
-#include "itkMeanSquaresImageToImageMetricv4.h"
-
-//  Software Guide : BeginLatex
-//
-//  The following are the most relevant headers of this example.
-//
-//  \index{itk::Versor\-Rigid3D\-Transform!header}
-//  \index{itk::Centered\-Transform\-Initializer!header}
-//
-//  Software Guide : EndLatex
-
-// Software Guide : BeginCodeSnippet
-#include "itkVersorRigid3DTransform.h"
-#include "itkCenteredTransformInitializer.h"
-// Software Guide : EndCodeSnippet
-
-//  Software Guide : BeginLatex
-//
-//  The parameter space of the \code{VersorRigid3DTransform} is not a vector
-//  space, because addition is not a closed operation in the space
-//  of versor components. Hence, we need to use Versor composition operation to
-//  update the first three components of the parameter array (rotation parameters),
-//  and Vector addition for updating the last three components of the parameters
-//  array (translation parameters)~\cite{Hamilton1866,Joly1905}.
-//
-//  In the previous version of ITK, a special optimizer, \doxygen{VersorRigid3DTransformOptimizer}
-//  was needed for registration to deal with versor computations.
-//  Fortunately in ITKv4, the \doxygen{RegularStepGradientDescentOptimizerv4}
-//  can be used for both vector and versor transform optimizations because, in the new
-//  registration framework, the task of updating parameters is delegated to the
-//  moving transform itself. The \code{UpdateTransformParameters} method is implemented
-//  in the \doxygen{Transform} class as a virtual function, and all the derived transform
-//  classes can have their own implementations of this function. Due to this
-//  fact, the updating function is re-implemented for versor transforms
-//  so it can handle versor composition of the rotation parameters.
-//
-//  Software Guide : EndLatex
-
-// Software Guide : BeginCodeSnippet
-#include "itkRegularStepGradientDescentOptimizerv4.h"
-// Software Guide : EndCodeSnippet
+// This example registers two 3D volumes with the rigidreg library that also
+// runs 'register': a rigid transform (a Similarity3DTransform with its scale
+// held at 1) started with the centers of both volumes lined up, optimized by
+// regular step gradient descent on the mean
+// squares metric, with the scales estimated from physical shifts. Only
+// reading the volumes and writing the results is done here.
+
+#include <atomic>
+#include <cmath>
+#include <limits>
+#include <mutex>
+#include <thread>
 
 #include "itkImageFileReader.h"
 #include "itkImageFileWriter.h"
 #include "itkResampleImageFilter.h"
+#include "itkMultiThreader.h"
 
 // Intermediate computations require casting to floats. Might get rid of this later.
 #include "itkCastImageFilter.h"
 
 // Used in final comparisons. Rest are helper classes.
-#include "itkSubtractImageFilter.h"
-#include "itkRescaleIntensityImageFilter.h"
+#include "itkIntensityWindowingImageFilter.h"
 #include "itkExtractImageFilter.h"
+#include "itkIdentityTransform.h"
 
-//  The following section of code implements a Command observer
-//  that will monitor the evolution of the registration process.
-//
-// Observer class that prints out the optimizer's state.
-#include "itkCommand.h"
-class CommandIterationUpdate : public itk::Command
+// The registration itself, and the row interpolator the outputs are resampled with
+#include "RigidRegistration.h"
+#include "FixedPointInterpolator.h"
+
+typedef TFixedImage< float >            VolumeType;
+typedef itk::Image< unsigned char, 3 >  ByteVolumeType;
+typedef itk::Image< unsigned char, 2 >  ByteSliceType;
+
+// What ResampleRegisteredOutputs() fills in. The difference volumes are
+// skipped if left null.
+struct RegisteredOutputs
+{
+  ByteVolumeType::Pointer registered;        // moving volume on the fixed grid
+  VolumeType::Pointer     differenceBefore;  // fixed minus moving, before registration
+  VolumeType::Pointer     differenceAfter;   // and after it
+  float minimumBefore, maximumBefore;
+  float minimumAfter,  maximumAfter;
+};
+
+// Resamples the moving volume onto the fixed grid with and without 'transform'
+// in one pass, threaded over slices, and fills in all of 'outputs' from it.
+// Outside the moving volume the registered volume is 100, and the difference
+// volumes take the moving volume to be 1. Each row is interpolated in one go,
+// which an 8 or 16-bit moving volume does in fixed point, 8 voxels at a time.
+template< typename TMovingImage >
+void ResampleRegisteredOutputs( const VolumeType * fixed, const TMovingImage * moving,
+                                const TTransform * transform, RegisteredOutputs & outputs )
 {
-public:
-  typedef  CommandIterationUpdate   Self;
-  typedef  itk::Command             Superclass;
-  typedef itk::SmartPointer<Self>   Pointer;
-  itkNewMacro( Self );
-
-protected:
-  CommandIterationUpdate() {};
-
-public:
-  typedef itk::RegularStepGradientDescentOptimizerv4<double>  OptimizerType;
-  typedef   const OptimizerType *                             OptimizerPointer;
-  void Execute(itk::Object *caller, const itk::EventObject & event)
+  typedef TLinearInterpolator< TMovingImage > InterpolatorType;
+  typedef typename InterpolatorType::ContinuousIndexType ContinuousIndexType;
+  typename InterpolatorType::Pointer interpolator = InterpolatorType::New();
+  interpolator->SetInputImage( moving );
+
+  const VolumeType::RegionType region = fixed->GetBufferedRegion();
+  outputs.registered->CopyInformation( fixed );
+  outputs.registered->SetRegions( region );
+  outputs.registered->Allocate();
+  VolumeType * differences[2] = { outputs.differenceBefore, outputs.differenceAfter };
+  for( VolumeType * difference : differences )
     {
-    Execute( (const itk::Object *)caller, event);
+    if( difference )
+      {
+      difference->CopyInformation( fixed );
+      difference->SetRegions( region );
+      difference->Allocate();
+      }
     }
-  void Execute(const itk::Object * object, const itk::EventObject & event)
+  outputs.minimumBefore = outputs.minimumAfter = std::numeric_limits< float >::max();
+  outputs.maximumBefore = outputs.maximumAfter = std::numeric_limits< float >::lowest();
+
+  const itk::SizeValueType rowSize = region.GetSize()[0];
+  const uint64_t sliceSize = uint64_t( rowSize ) * region.GetSize()[1];
+  std::mutex rangeMutex;
+  std::atomic< itk::SizeValueType > next( 0 );
+  auto worker = [&]()
     {
-    OptimizerPointer optimizer = static_cast< OptimizerPointer >( object );
-    if( ! itk::IterationEvent().CheckEvent( &event ) )
+    float minimumBefore = std::numeric_limits< float >::max();
+    float maximumBefore = std::numeric_limits< float >::lowest();
+    float minimumAfter  = minimumBefore;
+    float maximumAfter  = maximumBefore;
+
+    // Moving volume values along one row of fixed points (mapped by
+    // 'transform' or not), NaN where it doesn't reach
+    std::vector< VolumeType::PointType > rowPoints( rowSize );
+    std::vector< ContinuousIndexType > rowIndices( rowSize );
+    std::vector< itk::SizeValueType > rowInside( rowSize );
+    std::vector< typename InterpolatorType::OutputType > insideValues( rowSize );
+    auto sampleRow = [&]( const bool mapped, std::vector< double > & values )
+      {
+      itk::SizeValueType numberInside = 0;
+      for( itk::SizeValueType x = 0; x < rowSize; ++x )
+        {
+        const VolumeType::PointType point =
+          mapped ? transform->TransformPoint( rowPoints[x] ) : rowPoints[x];
+        moving->TransformPhysicalPointToContinuousIndex( point, rowIndices[numberInside] );
+        if( interpolator->IsInsideBuffer( rowIndices[numberInside] ) )
+          {
+          rowInside[numberInside++] = x;
+          }
+        }
+      evaluateAtContinuousIndices( interpolator.GetPointer(), rowIndices.data(), numberInside,
+                                   insideValues.data() );
+      values.assign( rowSize, std::numeric_limits< double >::quiet_NaN() );
+      for( itk::SizeValueType i = 0; i < numberInside; ++i )
+        {
+        values[rowInside[i]] = double( insideValues[i] );
+        }
+      };
+    std::vector< double > after, before;
+
+    for( itk::SizeValueType z = next++; z < region.GetSize()[2]; z = next++ )
       {
-      return;
+      VolumeType::IndexType index = region.GetIndex();
+      index[2] += z;
+      uint64_t offset = z * sliceSize;
+      for( itk::SizeValueType y = 0; y < region.GetSize()[1]; ++y, offset += rowSize )
+        {
+        index[1] = region.GetIndex()[1] + y;
+        for( itk::SizeValueType x = 0; x < rowSize; ++x )
+          {
+          index[0] = region.GetIndex()[0] + x;
+          fixed->TransformIndexToPhysicalPoint( index, rowPoints[x] );
+          }
+        sampleRow( true, after );
+        if( outputs.differenceBefore )
+          {
+          sampleRow( false, before );
+          }
+
+        const float * fixedRow = fixed->GetBufferPointer() + offset;
+        unsigned char * registeredRow = outputs.registered->GetBufferPointer() + offset;
+        for( itk::SizeValueType x = 0; x < rowSize; ++x )
+          {
+          registeredRow[x] = static_cast< unsigned char >( std::isnan( after[x] ) ? 100.0 : after[x] );
+          }
+        if( outputs.differenceAfter )
+          {
+          float * differenceRow = outputs.differenceAfter->GetBufferPointer() + offset;
+          for( itk::SizeValueType x = 0; x < rowSize; ++x )
+            {
+            differenceRow[x] = fixedRow[x] - float( std::isnan( after[x] ) ? 1.0 : after[x] );
+            minimumAfter = std::min( minimumAfter, differenceRow[x] );
+            maximumAfter = std::max( maximumAfter, differenceRow[x] );
+            }
+          }
+        if( outputs.differenceBefore )
+          {
+          float * differenceRow = outputs.differenceBefore->GetBufferPointer() + offset;
+          for( itk::SizeValueType x = 0; x < rowSize; ++x )
+            {
+            differenceRow[x] = fixedRow[x] - float( std::isnan( before[x] ) ? 1.0 : before[x] );
+            minimumBefore = std::min( minimumBefore, differenceRow[x] );
+            maximumBefore = std::max( maximumBefore, differenceRow[x] );
+            }
+          }
+        }
       }
-    std::cout << optimizer->GetCurrentIteration() << "   ";
-    std::cout << optimizer->GetValue() << "   ";
-    std::cout << optimizer->GetCurrentPosition() << std::endl;
+    std::lock_guard< std::mutex > lock( rangeMutex );
+    outputs.minimumBefore = std::min( outputs.minimumBefore, minimumBefore );
+    outputs.maximumBefore = std::max( outputs.maximumBefore, maximumBefore );
+    outputs.minimumAfter  = std::min( outputs.minimumAfter,  minimumAfter );
+    outputs.maximumAfter  = std::max( outputs.maximumAfter,  maximumAfter );
+    };
+
+  std::vector< std::thread > threads;
+  const unsigned int numberOfThreads = itk::MultiThreader::GetGlobalDefaultNumberOfThreads();
+  for( unsigned int t = 0; t < numberOfThreads; ++t )
+    {
+    threads.emplace_back( worker );
     }
-};
+  for( auto & thread : threads )
+    {
+    thread.join();
+    }
+}
+
+// Plane 'sliceIndex' (along z) of 'volume' as a 2D image
+ByteSliceType::Pointer ExtractSlice( ByteVolumeType * volume, const itk::IndexValueType sliceIndex )
+{
+  typedef itk::ExtractImageFilter< ByteVolumeType, ByteSliceType > ExtractFilterType;
+  ExtractFilterType::Pointer extractor = ExtractFilterType::New();
+  extractor->SetDirectionCollapseToSubmatrix();
+  extractor->SetInput( volume );
+
+  volume->UpdateOutputInformation();
+  ByteVolumeType::RegionType desiredRegion = volume->GetLargestPossibleRegion();
+  desiredRegion.SetIndex( 2, sliceIndex );
+  desiredRegion.SetSize(  2, 0 );
+  extractor->SetExtractionRegion( desiredRegion );
+  extractor->Update();
+  return extractor->GetOutput();
+}
+
+// Plane 'sliceIndex' (along z) of the fixed grid with the moving volume
+// resampled onto it by 'transform'. Only that plane is resampled.
+ByteSliceType::Pointer ResampleSlice( const VolumeType * fixed, const VolumeType * moving,
+                                      const itk::Transform< double, 3, 3 > * transform,
+                                      const itk::IndexValueType sliceIndex )
+{
+  typedef itk::ResampleImageFilter< VolumeType, VolumeType > ResampleFilterType;
+  ResampleFilterType::Pointer resampler = ResampleFilterType::New();
+  resampler->SetInput( moving );
+  resampler->SetTransform( transform );
+  resampler->SetOutputParametersFromImage( fixed );
+  VolumeType::RegionType plane = fixed->GetLargestPossibleRegion();
+  plane.SetIndex( 2, sliceIndex );
+  plane.SetSize(  2, 1 );
+  resampler->SetOutputStartIndex( plane.GetIndex() );
+  resampler->SetSize( plane.GetSize() );
+  resampler->SetDefaultPixelValue( 1 );
+
+  typedef itk::CastImageFilter< VolumeType, ByteVolumeType > CastFilterType;
+  CastFilterType::Pointer caster = CastFilterType::New();
+  caster->SetInput( resampler->GetOutput() );
+  return ExtractSlice( caster->GetOutput(), sliceIndex );
+}
 
 int main( int argc, char *argv[] )
 {
@@ -148,54 +267,10 @@ int main( int argc, char *argv[] )
     return EXIT_FAILURE;
     }
   const unsigned int                          Dimension = 3;
-  // Might have to revisit this number later and change to a short int
   typedef  float                              PixelType;
-  typedef itk::Image< PixelType, Dimension >  FixedImageType;
-  typedef itk::Image< PixelType, Dimension >  MovingImageType;
-
-  //  Software Guide : BeginLatex
-  //
-  //  The Transform class is instantiated using the code below. The only
-  //  template parameter to this class is the representation type of the
-  //  space coordinates.
-  //
-  //  \index{itk::Versor\-Rigid3D\-Transform!Instantiation}
-  //
-  //  Software Guide : EndLatex
-
-  // Software Guide : BeginCodeSnippet
-  typedef itk::VersorRigid3DTransform< double > TransformType;
-  // Software Guide : EndCodeSnippet
-
-  typedef itk::RegularStepGradientDescentOptimizerv4<double>    OptimizerType;
-  typedef itk::MeanSquaresImageToImageMetricv4<
-                                            FixedImageType,
-                                            MovingImageType >   MetricType;
-  typedef itk::ImageRegistrationMethodv4<
-                                      FixedImageType,
-                                      MovingImageType,
-                                      TransformType >           RegistrationType;
-
-  MetricType::Pointer         metric        = MetricType::New();
-  OptimizerType::Pointer      optimizer     = OptimizerType::New();
-  RegistrationType::Pointer   registration  = RegistrationType::New();
-
-  registration->SetMetric(        metric        );
-  registration->SetOptimizer(     optimizer     );
-
-  //  Software Guide : BeginLatex
-  //
-  //  The initial transform object is constructed below. This transform will be initialized,
-  //  and its initial parameters will be used when
-  //  the registration process starts.
-  //
-  //  \index{itk::Versor\-Rigid3D\-Transform!Pointer}
-  //
-  //  Software Guide : EndLatex
-
-  // Software Guide : BeginCodeSnippet
-  TransformType::Pointer  initialTransform = TransformType::New();
-  // Software Guide : EndCodeSnippet
+  typedef TFixedImage< PixelType >            FixedImageType;
+  typedef TMovingImage< PixelType >           MovingImageType;
+  typedef TTransform                          TransformType;
 
   typedef itk::ImageFileReader< FixedImageType  > FixedImageReaderType;
   typedef itk::ImageFileReader< MovingImageType > MovingImageReaderType;
@@ -205,168 +280,22 @@ int main( int argc, char *argv[] )
   fixedImageReader->SetFileName(  argv[1] );
   movingImageReader->SetFileName( argv[2] );
 
-  registration->SetFixedImage(    fixedImageReader->GetOutput()    );
-  registration->SetMovingImage(   movingImageReader->GetOutput()   );
-
-
-  //  Software Guide : BeginLatex
-  //
-  //  The input images are taken from readers. It is not necessary here to
-  //  explicitly call \code{Update()} on the readers since the
-  //  \doxygen{CenteredTransformInitializer} will do it as part of its
-  //  computations. The following code instantiates the type of the
-  //  initializer. This class is templated over the fixed and moving image types
-  //  as well as the transform type. An initializer is then constructed by
-  //  calling the \code{New()} method and assigning the result to a smart
-  //  pointer.
-  //
-  // \index{itk::Centered\-Transform\-Initializer!Instantiation}
-  // \index{itk::Centered\-Transform\-Initializer!New()}
-  // \index{itk::Centered\-Transform\-Initializer!SmartPointer}
-  //
-  //  Software Guide : EndLatex
-
-
-  // Software Guide : BeginCodeSnippet
-  typedef itk::CenteredTransformInitializer<
-    TransformType,
-    FixedImageType,
-    MovingImageType >  TransformInitializerType;
-  TransformInitializerType::Pointer initializer =
-    TransformInitializerType::New();
-  // Software Guide : EndCodeSnippet
-
-
-  //  Software Guide : BeginLatex
-  //
-  //  The initializer is now connected to the transform and to the fixed and
-  //  moving images.
-  //
-  //  Software Guide : EndLatex
-
-  // Software Guide : BeginCodeSnippet
-  initializer->SetTransform(   initialTransform );
-  initializer->SetFixedImage(  fixedImageReader->GetOutput() );
-  initializer->SetMovingImage( movingImageReader->GetOutput() );
-  // Software Guide : EndCodeSnippet
-
-
-  //  Software Guide : BeginLatex
-  //
-  //  The use of the geometrical centers is selected by calling
-  //  \code{GeometryOn()} while the use of center of mass is selected by
-  //  calling \code{MomentsOn()}.  Below we select the center of mass mode.
-  //
-  //  \index{Centered\-Transform\-Initializer!MomentsOn()}
-  //  \index{Centered\-Transform\-Initializer!GeometryOn()}
-  //
-  //  Software Guide : EndLatex
-
-  // Software Guide : BeginCodeSnippet
-  // Decide to use this if we have the time to or not
-  initializer->GeometryOn();
-  // Software Guide : EndCodeSnippet
-
-  //  Software Guide : BeginLatex
-  //
-  //  Finally, the computation of the center and translation is triggered by
-  //  the \code{InitializeTransform()} method. The resulting values will be
-  //  passed directly to the transform.
-  //
-  //  Software Guide : EndLatex
-
-  // Software Guide : BeginCodeSnippet
-  initializer->InitializeTransform();
-  // Software Guide : EndCodeSnippet
-
-
-  //  Software Guide : BeginLatex
-  //
-  //  The rotation part of the transform is initialized using a
-  //  \doxygen{Versor} which is simply a unit quaternion.  The
-  //  \code{VersorType} can be obtained from the transform traits. The versor
-  //  itself defines the type of the vector used to indicate the rotation axis.
-  //  This trait can be extracted as \code{VectorType}. The following lines
-  //  create a versor object and initialize its parameters by passing a
-  //  rotation axis and an angle.
-  //
-  //  Software Guide : EndLatex
-
-  // Software Guide : BeginCodeSnippet
-  typedef TransformType::VersorType  VersorType;
-  typedef VersorType::VectorType     VectorType;
-  VersorType     rotation;
-  VectorType     axis;
-  axis[0] = 0.0;
-  axis[1] = 0.0;
-  axis[2] = 1.0;
-  const double angle = 0;
-  rotation.Set(  axis, angle  );
-  initialTransform->SetRotation( rotation );
-  // Software Guide : EndCodeSnippet
-
-  //  Software Guide : BeginLatex
-  //
-  //  Now the current initialized transform will be set
-  //  to the registration method, so its initial parameters can be used to initialize
-  //  the registration process.
-  //
-  //  Software Guide : EndLatex
-
-  // Software Guide : BeginCodeSnippet
-  registration->SetInitialTransform( initialTransform );
-  // Software Guide : EndCodeSnippet
-
-  typedef OptimizerType::ScalesType       OptimizerScalesType;
-  OptimizerScalesType optimizerScales( initialTransform->GetNumberOfParameters() );
-  const double translationScale = 1.0 / 1000.0;
-  optimizerScales[0] = 1.0;
-  optimizerScales[1] = 1.0;
-  optimizerScales[2] = 1.0;
-  optimizerScales[3] = translationScale;
-  optimizerScales[4] = translationScale;
-  optimizerScales[5] = translationScale;
-  optimizer->SetScales( optimizerScales );
-  optimizer->SetNumberOfIterations( 200 );
-  optimizer->SetLearningRate( 0.2 );
-  // Think of in terms of mm (at what point do you not care about continuing registration)
-  // Stop threshold
-  optimizer->SetMinimumStepLength( 0.001 );
-  // While optimizer is testing points, it may have found a good point, but then tests another one
-  // The last value is not necessarily the best one
-  // If we found another value, keep the best one
-  optimizer->SetReturnBestParametersAndValue(true);
-
-  // Create the Command observer and register it with the optimizer.
-  // Connects observer to optimizer
-  CommandIterationUpdate::Pointer observer = CommandIterationUpdate::New();
-  optimizer->AddObserver( itk::IterationEvent(), observer );
-
-  // One level registration process without shrinking and smoothing.
-  // Pyramid scheme of registration
-  const unsigned int numberOfLevels = 1;
-
-  RegistrationType::ShrinkFactorsArrayType shrinkFactorsPerLevel;
-  shrinkFactorsPerLevel.SetSize( 1 );
-  shrinkFactorsPerLevel[0] = 1;
-
-  // Need to smooth the image before you subsample it
-  RegistrationType::SmoothingSigmasArrayType smoothingSigmasPerLevel;
-  smoothingSigmasPerLevel.SetSize( 1 );
-  smoothingSigmasPerLevel[0] = 0;
-
-  // Parameters of the pyramid scheme
-  registration->SetNumberOfLevels( numberOfLevels );
-  registration->SetSmoothingSigmasPerLevel( smoothingSigmasPerLevel );
-  registration->SetShrinkFactorsPerLevel( shrinkFactorsPerLevel );
+  // One full resolution level: at most 200 iterations, a first step of at
+  // most 0.2 mm and a minimum step of 0.001
+  RegistrationOptions opts;
+  opts.levels.push_back( { 1, 0.0, 200, 0.2, 0.001, 0, 0.0 } );
+  opts.scalesMode = ScalesMode::PhysicalShift;
+  opts.fitScale = false;
+  opts.maximumStepSize = 0.2;
+  opts.telemetry = std::make_shared< TelemetryLog >();
 
+  RegistrationResult result;
   try
     {
-    // Run the registration
-    registration->Update();
-    std::cout << "Optimizer stop condition: "
-              << registration->GetOptimizer()->GetStopConditionDescription()
-              << std::endl;
+    fixedImageReader->Update();
+    movingImageReader->Update();
+    result = registerImages< PixelType >( fixedImageReader->GetOutput(),
+                                          movingImageReader->GetOutput(), opts );
     }
   catch( itk::ExceptionObject & err )
     {
@@ -376,119 +305,27 @@ int main( int argc, char *argv[] )
     }
 
   const TransformType::ParametersType finalParameters =
-                            registration->GetOutput()->Get()->GetParameters();
-
-  const double versorX              = finalParameters[0];
-  const double versorY              = finalParameters[1];
-  const double versorZ              = finalParameters[2];
-  const double finalTranslationX    = finalParameters[3];
-  const double finalTranslationY    = finalParameters[4];
-  const double finalTranslationZ    = finalParameters[5];
-  const unsigned int numberOfIterations = optimizer->GetCurrentIteration();
-  const double bestValue = optimizer->GetValue();
-
-  // Print out results
-  //
+                                        result.transform->GetParameters();
+
   std::cout << std::endl << std::endl;
   std::cout << "Result = " << std::endl;
-  std::cout << " versor X      = " << versorX  << std::endl;
-  std::cout << " versor Y      = " << versorY  << std::endl;
-  std::cout << " versor Z      = " << versorZ  << std::endl;
-  std::cout << " Translation X = " << finalTranslationX  << std::endl;
-  std::cout << " Translation Y = " << finalTranslationY  << std::endl;
-  std::cout << " Translation Z = " << finalTranslationZ  << std::endl;
-  std::cout << " Iterations    = " << numberOfIterations << std::endl;
-  std::cout << " Metric value  = " << bestValue          << std::endl;
-
-  //  Software Guide : BeginLatex
-  //
-  //  Let's execute this example over some of the images available in the
-  //  following website
-  //
-  //  \url{http://public.kitware.com/pub/itk/Data/BrainWeb}.
-  //
-  //  Note that the images in this website are compressed in \code{.tgz} files.
-  //  You should download these files and decompress them in your local system.
-  //  After decompressing and extracting the files you could take a pair of
-  //  volumes, for example the pair:
-  //
-  //  \begin{itemize}
-  //  \item \code{brainweb1e1a10f20.mha}
-  //  \item \code{brainweb1e1a10f20Rot10Tx15.mha}
-  //  \end{itemize}
-  //
-  //  The second image is the result of intentionally rotating the first image
-  //  by $10$ degrees around the origin and shifting it $15mm$ in $X$.
-  //
-  //  Also, instead of doing the above steps manually, you can turn on the
-  //  following flag in your build environment:
-  //
-  //  \code{ITK\_USE\_BRAINWEB\_DATA}
-  //
-  //  Then, the above data will be loaded to your local ITK build directory.
-  //
-  //  The registration takes $21$ iterations and produces:
-  //
-  //  \begin{center}
-  //  \begin{verbatim}
-  //  [7.2295e-05, -7.20626e-05, -0.0872168, 2.64765, -17.4626, -0.00147153]
-  //  \end{verbatim}
-  //  \end{center}
-  //
-  //  That are interpreted as
-  //
-  //  \begin{itemize}
-  //  \item Versor        = $(7.2295e-05, -7.20626e-05, -0.0872168)$
-  //  \item Translation   = $(2.64765,  -17.4626,  -0.00147153)$ millimeters
-  //  \end{itemize}
-  //
-  //  This Versor is equivalent to a rotation of $9.98$ degrees around the $Z$
-  //  axis.
-  //
-  //  Note that the reported translation is not the translation of $(15.0,0.0,0.0)$
-  //  that we may be naively expecting. The reason is that the
-  //  \code{VersorRigid3DTransform} is applying the rotation around the center
-  //  found by the \code{CenteredTransformInitializer} and then adding the
-  //  translation vector shown above.
-  //
-  //  It is more illustrative in this case to take a look at the actual
-  //  rotation matrix and offset resulting from the $6$ parameters.
-  //
-  //  Software Guide : EndLatex
-
-  TransformType::Pointer finalTransform = TransformType::New();
+  std::cout << " versor X        = " << finalParameters[0] << std::endl;
+  std::cout << " versor Y        = " << finalParameters[1] << std::endl;
+  std::cout << " versor Z        = " << finalParameters[2] << std::endl;
+  std::cout << " Translation X   = " << finalParameters[3] << std::endl;
+  std::cout << " Translation Y   = " << finalParameters[4] << std::endl;
+  std::cout << " Translation Z   = " << finalParameters[5] << std::endl;
+  std::cout << " Isotropic Scale = " << finalParameters[6] << std::endl;
+  std::cout << " Iterations      = " << result.iterations  << std::endl;
+  std::cout << " Metric value    = " << result.value       << std::endl;
+  std::cout << " Seconds         = " << result.seconds     << std::endl;
+
+  TransformType::Pointer finalTransform = result.transform;
 
-  finalTransform->SetFixedParameters( registration->GetOutput()->Get()->GetFixedParameters() );
-  finalTransform->SetParameters( finalParameters );
-
-  // Software Guide : BeginCodeSnippet
   TransformType::MatrixType matrix = finalTransform->GetMatrix();
   TransformType::OffsetType offset = finalTransform->GetOffset();
   std::cout << "Matrix = " << std::endl << matrix << std::endl;
   std::cout << "Offset = " << std::endl << offset << std::endl;
-  // Software Guide : EndCodeSnippet
-
-  //  Software Guide : BeginLatex
-  //
-  //  The output of this print statements is
-  //
-  //  \begin{center}
-  //  \begin{verbatim}
-  //  Matrix =
-  //      0.984786 0.173769 -0.000156187
-  //      -0.173769 0.984786 -0.000131469
-  //      0.000130965 0.000156609 1
-  //
-  //  Offset =
-  //      [-15, 0.0189186, -0.0305439]
-  //  \end{verbatim}
-  //  \end{center}
-  //
-  //  From the rotation matrix it is possible to deduce that the rotation is
-  //  happening in the X,Y plane and that the angle is on the order of
-  //  $\arcsin{(0.173769)}$ which is very close to 10 degrees, as we expected.
-  //
-  //  Software Guide : EndLatex
 
   //  Software Guide : BeginLatex
   //
@@ -565,133 +402,122 @@ int main( int argc, char *argv[] )
   //
   //  Software Guide : EndLatex
 
-  typedef itk::ResampleImageFilter<
-                            MovingImageType,
-                            FixedImageType >    ResampleFilterType;
-
-  ResampleFilterType::Pointer resampler = ResampleFilterType::New();
-
-  resampler->SetTransform( finalTransform );
-  resampler->SetInput( movingImageReader->GetOutput() );
-
-  FixedImageType::Pointer fixedImage = fixedImageReader->GetOutput();
-
-  resampler->SetSize(    fixedImage->GetLargestPossibleRegion().GetSize() );
-  resampler->SetOutputOrigin(  fixedImage->GetOrigin() );
-  resampler->SetOutputSpacing( fixedImage->GetSpacing() );
-  resampler->SetOutputDirection( fixedImage->GetDirection() );
-  resampler->SetDefaultPixelValue( 100 );
+  typedef ByteVolumeType                         OutputImageType;
+  typedef ByteSliceType                          OutputSliceType;
 
-  typedef  unsigned char                                          OutputPixelType;
-  typedef itk::Image< OutputPixelType, Dimension >                OutputImageType;
-  typedef itk::CastImageFilter< FixedImageType, OutputImageType > CastFilterType;
-  typedef itk::ImageFileWriter< OutputImageType >                 WriterType;
-
-  WriterType::Pointer      writer =  WriterType::New();
-  CastFilterType::Pointer  caster =  CastFilterType::New();
-
-  writer->SetFileName( argv[3] );
-
-  caster->SetInput( resampler->GetOutput() );
-  writer->SetInput( caster->GetOutput()   );
-  writer->Update();
-
-  typedef itk::SubtractImageFilter<
-                                  FixedImageType,
-                                  FixedImageType,
-                                  FixedImageType > DifferenceFilterType;
-  DifferenceFilterType::Pointer difference = DifferenceFilterType::New();
-
-  typedef itk::RescaleIntensityImageFilter<
-                                  FixedImageType,
-                                  OutputImageType >   RescalerType;
-  RescalerType::Pointer intensityRescaler = RescalerType::New();
-
-  intensityRescaler->SetInput( difference->GetOutput() );
-  intensityRescaler->SetOutputMinimum(   0 );
-  intensityRescaler->SetOutputMaximum( 255 );
-
-  difference->SetInput1( fixedImageReader->GetOutput() );
-  difference->SetInput2( resampler->GetOutput() );
-
-  resampler->SetDefaultPixelValue( 1 );
-
-  WriterType::Pointer writer2 = WriterType::New();
-  writer2->SetInput( intensityRescaler->GetOutput() );
-
-  // Compute the difference image between the
-  // fixed and resampled moving image.
-  if( argc > 5 )
-    {
-    writer2->SetFileName( argv[5] );
-    writer2->Update();
-    }
+  FixedImageType::ConstPointer  fixedImage  = fixedImageReader->GetOutput();
+  MovingImageType::ConstPointer movingImage = movingImageReader->GetOutput();
 
   typedef itk::IdentityTransform< double, Dimension > IdentityTransformType;
   IdentityTransformType::Pointer identity = IdentityTransformType::New();
-  // Compute the difference image between the
-  // fixed and moving image before registration.
+
+  //  The registered volume and both difference volumes come out of one pass
+  //  over the fixed grid. The difference volumes are only made if asked for.
+  RegisteredOutputs outputs;
+  outputs.registered = OutputImageType::New();
   if( argc > 4 )
     {
-    resampler->SetTransform( identity );
-    writer2->SetFileName( argv[4] );
-    writer2->Update();
+    outputs.differenceBefore = FixedImageType::New();
     }
-  //
-  //  Here we extract slices from the input volume, and the difference volumes
-  //  produced before and after the registration.  These slices are presented as
-  //  figures in the Software Guide.
-  //
-  //
-  typedef itk::Image< OutputPixelType, 2 > OutputSliceType;
-  typedef itk::ExtractImageFilter<
-                          OutputImageType,
-                          OutputSliceType > ExtractFilterType;
-  ExtractFilterType::Pointer extractor = ExtractFilterType::New();
-  extractor->SetDirectionCollapseToSubmatrix();
-  extractor->InPlaceOn();
-
-  FixedImageType::RegionType inputRegion =
-                               fixedImage->GetLargestPossibleRegion();
-  FixedImageType::SizeType  size  = inputRegion.GetSize();
-  FixedImageType::IndexType start = inputRegion.GetIndex();
-
-  // Select one slice as output
-  size[2]  =  0;
-  start[2] = 90;
-  FixedImageType::RegionType desiredRegion;
-  desiredRegion.SetSize(  size  );
-  desiredRegion.SetIndex( start );
-  extractor->SetExtractionRegion( desiredRegion );
-  typedef itk::ImageFileWriter< OutputSliceType > SliceWriterType;
-  SliceWriterType::Pointer sliceWriter = SliceWriterType::New();
-  sliceWriter->SetInput( extractor->GetOutput() );
-  if( argc > 6 )
+  if( argc > 5 )
     {
-    extractor->SetInput( caster->GetOutput() );
-    resampler->SetTransform( identity );
-    sliceWriter->SetFileName( argv[6] );
-    sliceWriter->Update();
+    outputs.differenceAfter = FixedImageType::New();
     }
-  if( argc > 7 )
+  //  The float moving volume that was registered is resampled as it is; a
+  //  copy in its stored pixel type would cost another pass and more memory
+  try
     {
-    extractor->SetInput( intensityRescaler->GetOutput() );
-    resampler->SetTransform( identity );
-    sliceWriter->SetFileName( argv[7] );
-    sliceWriter->Update();
+    ResampleRegisteredOutputs( fixedImage.GetPointer(), movingImage.GetPointer(),
+                               finalTransform, outputs );
     }
-  if( argc > 8 )
+  catch( itk::ExceptionObject & err )
     {
-    resampler->SetTransform( finalTransform );
-    sliceWriter->SetFileName( argv[8] );
-    sliceWriter->Update();
+    std::cerr << "ExceptionObject caught !" << std::endl;
+    std::cerr << err << std::endl;
+    return EXIT_FAILURE;
     }
-  if( argc > 9 )
+
+  typedef itk::ImageFileWriter< OutputImageType > WriterType;
+  WriterType::Pointer writer = WriterType::New();
+  writer->SetFileName( argv[3] );
+  writer->SetInput( outputs.registered );
+
+  // Differences rescaled to [0, 255] over their whole range
+  typedef itk::IntensityWindowingImageFilter<
+                                  FixedImageType,
+                                  OutputImageType > WindowingFilterType;
+  WindowingFilterType::Pointer differenceBefore = WindowingFilterType::New();
+  WindowingFilterType::Pointer differenceAfter  = WindowingFilterType::New();
+  differenceBefore->SetInput( outputs.differenceBefore );
+  differenceBefore->SetWindowMinimum( outputs.minimumBefore );
+  differenceBefore->SetWindowMaximum( outputs.maximumBefore );
+  differenceAfter->SetInput( outputs.differenceAfter );
+  differenceAfter->SetWindowMinimum( outputs.minimumAfter );
+  differenceAfter->SetWindowMaximum( outputs.maximumAfter );
+
+  try
+    {
+    writer->Update();
+
+    // Compute the difference image between the
+    // fixed and resampled moving image.
+    if( argc > 5 )
+      {
+      WriterType::Pointer writer2 = WriterType::New();
+      writer2->SetInput( differenceAfter->GetOutput() );
+      writer2->SetFileName( argv[5] );
+      writer2->Update();
+      }
+
+    // Compute the difference image between the
+    // fixed and moving image before registration.
+    if( argc > 4 )
+      {
+      WriterType::Pointer writer2 = WriterType::New();
+      writer2->SetInput( differenceBefore->GetOutput() );
+      writer2->SetFileName( argv[4] );
+      writer2->Update();
+      }
+
+    //
+    //  Here we extract slices from the input volume, and the difference volumes
+    //  produced before and after the registration.  These slices are presented as
+    //  figures in the Software Guide. Slices of the moving volume are resampled
+    //  on their own; the difference slices are cut from the volumes above.
+    //
+    const itk::IndexValueType sliceIndex = 90;
+    typedef itk::ImageFileWriter< OutputSliceType > SliceWriterType;
+    SliceWriterType::Pointer sliceWriter = SliceWriterType::New();
+    if( argc > 6 )
+      {
+      sliceWriter->SetInput( ResampleSlice( fixedImage, movingImage, identity, sliceIndex ) );
+      sliceWriter->SetFileName( argv[6] );
+      sliceWriter->Update();
+      }
+    if( argc > 7 )
+      {
+      sliceWriter->SetInput( ExtractSlice( differenceBefore->GetOutput(), sliceIndex ) );
+      sliceWriter->SetFileName( argv[7] );
+      sliceWriter->Update();
+      }
+    if( argc > 8 )
+      {
+      sliceWriter->SetInput( ExtractSlice( differenceAfter->GetOutput(), sliceIndex ) );
+      sliceWriter->SetFileName( argv[8] );
+      sliceWriter->Update();
+      }
+    if( argc > 9 )
+      {
+      sliceWriter->SetInput( ResampleSlice( fixedImage, movingImage, finalTransform, sliceIndex ) );
+      sliceWriter->SetFileName( argv[9] );
+      sliceWriter->Update();
+      }
+    }
+  catch( itk::ExceptionObject & err )
     {
-    extractor->SetInput( caster->GetOutput() );
-    resampler->SetTransform( finalTransform );
-    sliceWriter->SetFileName( argv[9] );
-    sliceWriter->Update();
+    std::cerr << "ExceptionObject caught !" << std::endl;
+    std::cerr << err << std::endl;
+    return EXIT_FAILURE;
     }
   return EXIT_SUCCESS;
 }
@@ -0,0 +1,218 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <typeinfo>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define MAPPED_IMAGE_HAS_MMAP 1
+#endif
+
+#include "itkByteSwapper.h"
+#include "itkImage.h"
+#include "itkImageFileReader.h"
+#include "itkImportImageContainer.h"
+#include "itkMetaImageIO.h"
+#include "itksys/SystemTools.hxx"
+
+
+// Zero-copy loading of uncompressed MetaImage volumes (.mhd with a separate .raw, or .mha). The
+// pixel data is mmap()ed from the file and used as the image buffer in place, so reading a volume
+// costs a header parse and pages are only faulted in as they are used; nothing is duplicated
+// between the page cache and the heap. The mapping is read-only, so it costs no commit charge
+// however large the volume, but its buffer must not be written: a filter that could run in place
+// on it (an InPlaceImageFilter with the same input and output type) has to be told InPlaceOff(),
+// which makes it write a buffer of its own instead.
+
+// How a mapped file is going to be read, so the kernel can read ahead accordingly
+enum class MappedAccess {
+    Sparse,       // only parts of it, e.g. a region of interest: pages are read as they are touched
+    Whole,        // all of it, repeatedly and in no particular order: start reading everything in
+    Sequential    // all of it, once, front to back: read ahead aggressively and drop pages behind
+};
+
+// A mapped range of a file, unmapped when the last image using it goes away
+class FileMapping
+{
+    public:
+        // Maps 'length' bytes of 'filename' from 'offset' on. Returns null if that fails.
+        static std::shared_ptr<FileMapping> Open(const std::string& filename, const uint64_t offset,
+                                                 const uint64_t length, const MappedAccess access)
+        {
+#ifdef MAPPED_IMAGE_HAS_MMAP
+            const int fd = ::open(filename.c_str(), O_RDONLY);
+            if (fd < 0) {
+                return nullptr;
+            }
+            // mmap() wants a page aligned file offset
+            const uint64_t page    = uint64_t(::sysconf(_SC_PAGESIZE));
+            const uint64_t aligned = offset - offset % page;
+            const size_t mapped    = size_t(length + (offset - aligned));
+            void* address = ::mmap(nullptr, mapped, PROT_READ, MAP_PRIVATE, fd, off_t(aligned));
+            ::close(fd);
+            if (address == MAP_FAILED) {
+                return nullptr;
+            }
+            if (access != MappedAccess::Sparse) {
+                ::madvise(address, mapped, MADV_WILLNEED);
+            }
+            if (access == MappedAccess::Sequential) {
+                ::madvise(address, mapped, MADV_SEQUENTIAL);
+            }
+            return std::shared_ptr<FileMapping>(
+                new FileMapping(address, mapped, static_cast<char*>(address) + (offset - aligned)));
+#else
+            return nullptr;
+#endif
+        }
+
+        ~FileMapping()
+        {
+#ifdef MAPPED_IMAGE_HAS_MMAP
+            ::munmap(m_Address, m_Length);
+#endif
+        }
+
+        // The first byte of the range asked for. It is mapped read-only.
+        const char* GetData() const { return m_Data; }
+
+    private:
+        FileMapping(void* address, const size_t length, char* data)
+            : m_Address(address), m_Length(length), m_Data(data) {}
+        FileMapping(const FileMapping&) = delete;
+        FileMapping& operator=(const FileMapping&) = delete;
+
+        void* m_Address;
+        size_t m_Length;
+        char* m_Data;
+};
+
+// Pixel container over a FileMapping. It never frees the pixels itself; it keeps the mapping
+// alive instead. ITK has no read-only pixel containers, so the pixels look writable, but writing
+// them faults.
+template <typename TElementIdentifier, typename TElement>
+class MappedImageContainer : public itk::ImportImageContainer<TElementIdentifier, TElement>
+{
+    public:
+        typedef MappedImageContainer Self;
+        typedef itk::ImportImageContainer<TElementIdentifier, TElement> Superclass;
+        typedef itk::SmartPointer<Self> Pointer;
+        itkNewMacro(Self);
+        itkTypeMacro(MappedImageContainer, ImportImageContainer);
+
+        void SetMapping(const std::shared_ptr<FileMapping>& mapping, const TElementIdentifier size)
+        {
+            m_Mapping = mapping;
+            this->SetImportPointer(reinterpret_cast<TElement*>(const_cast<char*>(mapping->GetData())), size, false);
+        }
+
+    protected:
+        MappedImageContainer() {};
+
+    private:
+        std::shared_ptr<FileMapping> m_Mapping;
+};
+
+// 'filename' as a TImage whose buffer is the file's pixel data mapped in place. Returns null if
+// the file isn't an uncompressed, single file MetaImage with TImage's pixel type and the host's
+// byte order; such files have to go through ImageFileReader.
+template <typename TImage>
+typename TImage::Pointer mapMetaImage(const std::string& filename, const MappedAccess access)
+{
+    typedef typename TImage::PixelType TPixel;
+    const unsigned int dimension = TImage::ImageDimension;
+
+    auto io = itk::MetaImageIO::New();
+    if (!io->CanReadFile(filename.c_str())) {
+        return nullptr;
+    }
+    // A header that can't be parsed is left to ImageFileReader to report
+    io->SetFileName(filename);
+    try {
+        io->ReadImageInformation();
+    } catch (itk::ExceptionObject&) {
+        return nullptr;
+    }
+    MetaImage* header = io->GetMetaImagePointer();
+    const std::string dataFile = header->ElementDataFileName() ? header->ElementDataFileName() : "";
+    const auto hostByteOrder = itk::ByteSwapper<uint16_t>::SystemIsBigEndian() ? itk::ImageIOBase::BigEndian
+                                                                               : itk::ImageIOBase::LittleEndian;
+    if (header->CompressedData() || dataFile.empty() || dataFile == "LIST" ||
+        dataFile.find('%') != std::string::npos || io->GetNumberOfDimensions() != dimension ||
+        io->GetNumberOfComponents() != 1 || io->GetComponentTypeInfo() != typeid(TPixel) ||
+        (sizeof(TPixel) > 1 && io->GetByteOrder() != hostByteOrder)) {
+        return nullptr;
+    }
+
+    typename TImage::RegionType region;
+    typename TImage::SpacingType spacing;
+    typename TImage::PointType origin;
+    typename TImage::DirectionType direction;
+    uint64_t numberOfPixels = 1;
+    for (unsigned int d = 0; d < dimension; ++d) {
+        region.SetSize(d, io->GetDimensions(d));
+        spacing[d] = io->GetSpacing(d);
+        origin[d]  = io->GetOrigin(d);
+        for (unsigned int r = 0; r < dimension; ++r) {
+            direction[r][d] = io->GetDirection(d)[r];
+        }
+        numberOfPixels *= io->GetDimensions(d);
+    }
+    const uint64_t dataBytes = numberOfPixels * sizeof(TPixel);
+
+    // The data is either the rest of the header file or a file of its own, in which HeaderSize
+    // bytes are skipped (-1: the data is the end of the file)
+    std::string dataFilename = filename;
+    if (dataFile != "LOCAL") {
+        const auto directory = itksys::SystemTools::GetFilenamePath(filename);
+        dataFilename = itksys::SystemTools::FileIsFullPath(dataFile.c_str()) || directory.empty()
+                           ? dataFile
+                           : directory + "/" + dataFile;
+    }
+    const uint64_t fileBytes = itksys::SystemTools::FileLength(dataFilename);
+    uint64_t offset = 0;
+    if (dataFile == "LOCAL" || header->HeaderSize() == -1) {
+        offset = fileBytes >= dataBytes ? fileBytes - dataBytes : 0;
+    } else if (header->HeaderSize() > 0) {
+        offset = uint64_t(header->HeaderSize());
+    }
+    if (fileBytes < offset + dataBytes || offset % sizeof(TPixel) != 0) {
+        return nullptr;
+    }
+
+    const auto mapping = FileMapping::Open(dataFilename, offset, dataBytes, access);
+    if (!mapping) {
+        return nullptr;
+    }
+    auto pixels = MappedImageContainer<typename TImage::PixelContainer::ElementIdentifier, TPixel>::New();
+    pixels->SetMapping(mapping, numberOfPixels);
+
+    auto image = TImage::New();
+    image->SetRegions(region);
+    image->SetSpacing(spacing);
+    image->SetOrigin(origin);
+    image->SetDirection(direction);
+    image->SetPixelContainer(pixels);
+    return image;
+}
+
+// 'filename' as a TImage: mapped in place if mapMetaImage() can, read into memory otherwise
+template <typename TImage>
+typename TImage::Pointer readImage(const std::string& filename, const MappedAccess access)
+{
+    auto image = mapMetaImage<TImage>(filename, access);
+    if (image) {
+        return image;
+    }
+    auto reader = itk::ImageFileReader<TImage>::New();
+    reader->SetFileName(filename);
+    reader->Update();
+    image = reader->GetOutput();
+    image->DisconnectPipeline();
+    return image;
+}
@@ -0,0 +1,176 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <random>
+
+#include "itkCommand.h"
+#include "itkContinuousIndex.h"
+
+#include "ImageMask.h"
+
+
+// How the metric picks the fixed-image points it evaluates on each iteration
+enum class SamplingStrategy { None, Regular, Random };
+
+// Number of voxels of 'image' whose centers lie inside 'mask', as sampleImageDomain() decides.
+// Only counted the first time for each image grid; see BitMask::CountInside().
+template <typename TImage>
+uint64_t countVoxelsInside(const TImage* image, const BitMask* mask)
+{
+    return mask->CountInside(image);
+}
+
+// Draws 'percentage' of the voxels of 'image' as metric sample points. Regular takes evenly
+// spaced voxel centers in memory order; random takes uniformly distributed voxels, jittered
+// inside the voxel so repeated draws don't all land on the grid. With a 'mask', only the
+// 'insideVoxels' voxels whose centers lie inside it (countVoxelsInside()) are drawn from. Should
+// that count be off anyway, fewer samples are drawn rather than any outside the image or mask.
+template <typename TPointSet, typename TImage>
+typename TPointSet::Pointer sampleImageDomain(const TImage* image, const SamplingStrategy strategy,
+                                              const double percentage, std::mt19937& generator,
+                                              const BitMask* mask = nullptr, const uint64_t insideVoxels = 0)
+{
+    const auto region = image->GetLargestPossibleRegion();
+    const auto start  = region.GetIndex();
+    const auto size   = region.GetSize();
+    const uint64_t numberOfVoxels  = region.GetNumberOfPixels();
+    const uint64_t domainVoxels    = mask != nullptr ? insideVoxels : numberOfVoxels;
+    const uint64_t numberOfSamples = std::max<uint64_t>(1, uint64_t(domainVoxels * percentage));
+
+    auto pointSet = TPointSet::New();
+    auto points   = TPointSet::PointsContainer::New();
+    auto& samples = points->CastToSTLContainer();
+    samples.reserve(numberOfSamples);
+
+    std::uniform_int_distribution<uint64_t> pickVoxel(0, numberOfVoxels - 1);
+    std::uniform_real_distribution<double> jitter(-0.5, 0.5);
+    const double stride = double(domainVoxels) / double(numberOfSamples);
+    if (mask != nullptr && insideVoxels == 0) {
+        pointSet->SetPoints(points);
+        return pointSet;
+    }
+
+    itk::ContinuousIndex<double, TImage::ImageDimension> cindex;
+    typename TPointSet::PointType point;
+    BitMask::GridMapping grid;
+    if (mask != nullptr) {
+        grid = mask->MapGrid(image);
+    }
+    // Rejection sampling takes 1 / (inside fraction) draws per sample on average; this many
+    // failing in a row is as good as impossible unless the inside count is wrong
+    const uint64_t maximumDraws = 64 * (numberOfVoxels / std::max<uint64_t>(1, insideVoxels) + 1);
+    uint64_t voxel = 0, insideSeen = 0;
+    for (uint64_t i = 0; i < numberOfSamples; ++i) {
+        uint64_t offset = 0;
+        bool found = true;
+        if (strategy == SamplingStrategy::Random) {
+            offset = pickVoxel(generator);
+            for (uint64_t draws = 1; mask != nullptr && !mask->IsInside(grid, offset); ++draws) {
+                if (draws == maximumDraws) {
+                    found = false;
+                    break;
+                }
+                offset = pickVoxel(generator);
+            }
+        } else if (mask != nullptr) {
+            // Walk the voxels in memory order up to the next inside voxel that is due
+            const uint64_t due = uint64_t(i * stride);
+            found = false;
+            for (; voxel < numberOfVoxels && !found; ++voxel) {
+                found = mask->IsInside(grid, voxel) && insideSeen++ == due;
+            }
+            offset = voxel - 1;
+        } else {
+            offset = uint64_t(i * stride);
+        }
+        if (!found) {
+            break;
+        }
+        for (uint32_t d = 0; d < TImage::ImageDimension; ++d) {
+            cindex[d] = double(start[d] + int64_t(offset % size[d]));
+            offset /= size[d];
+            if (strategy == SamplingStrategy::Random) {
+                cindex[d] += jitter(generator);
+            }
+        }
+        image->TransformContinuousIndexToPhysicalPoint(cindex, point);
+        samples.push_back(point);
+    }
+    pointSet->SetPoints(points);
+    return pointSet;
+}
+
+// Owns the sample points of one metric. Installed as an iteration observer on the optimizer
+// it draws a fresh random set before every iteration.
+template <typename TMetric>
+class MetricSampleCommand : public itk::Command
+{
+    public:
+        typedef MetricSampleCommand Self;
+        typedef itk::Command Superclass;
+        typedef itk::SmartPointer<Self> Pointer;
+        itkNewMacro(Self);
+
+        typedef typename TMetric::FixedSampledPointSetType PointSetType;
+        typedef typename TMetric::VirtualImageType DomainImageType;
+
+    protected:
+        MetricSampleCommand()
+            : m_Strategy(SamplingStrategy::None), m_Percentage(1.0), m_Mask(nullptr), m_InsideVoxels(0) {};
+
+    public:
+        // With a 'mask', samples are only drawn inside it, and without a sampling strategy every
+        // voxel inside it is a sample
+        void Configure(TMetric* metric, const DomainImageType* domain, const SamplingStrategy strategy,
+                       const double percentage, const uint32_t seed, const BitMask* mask = nullptr)
+        {
+            m_Metric     = metric;
+            m_Domain     = domain;
+            m_Strategy   = strategy;
+            m_Percentage = percentage;
+            m_Generator.seed(seed);
+            m_Mask = mask;
+            if (m_Mask != nullptr) {
+                m_InsideVoxels = countVoxelsInside(domain, mask);
+                if (m_Strategy == SamplingStrategy::None) {
+                    m_Strategy   = SamplingStrategy::Regular;
+                    m_Percentage = 1.0;
+                }
+            }
+        }
+
+        // Hand the metric a new set of sample points. The metric still has to be (re)initialized.
+        void Sample()
+        {
+            if (m_Strategy == SamplingStrategy::None) {
+                m_Metric->SetUseFixedSampledPointSet(false);
+                return;
+            }
+            m_Metric->SetFixedSampledPointSet(sampleImageDomain<PointSetType>(
+                m_Domain.GetPointer(), m_Strategy, m_Percentage, m_Generator, m_Mask, m_InsideVoxels));
+            m_Metric->SetUseFixedSampledPointSet(true);
+        }
+
+        void Execute(itk::Object* caller, const itk::EventObject & event)
+        {
+            Execute((const itk::Object*) caller, event);
+        }
+        void Execute(const itk::Object *, const itk::EventObject & event)
+        {
+            if (!itk::IterationEvent().CheckEvent(&event)) {
+                return;
+            }
+            Sample();
+            m_Metric->Initialize();
+        }
+
+    private:
+        typename TMetric::Pointer m_Metric;
+        typename DomainImageType::ConstPointer m_Domain;
+        SamplingStrategy m_Strategy;
+        double m_Percentage;
+        std::mt19937 m_Generator;
+        const BitMask* m_Mask;
+        uint64_t m_InsideVoxels;
+};
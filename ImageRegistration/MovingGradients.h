@@ -0,0 +1,73 @@
+#pragma once
+
+#include <algorithm>
+
+#include "itkGradientRecursiveGaussianImageFilter.h"
+#include "itkImageToImageFilter.h"
+
+
+// Where the metric gets the moving image gradient from. Central differences are evaluated at
+// every sample on every iteration; the filter (ITK's recursive Gaussian) builds a gradient image
+// on every metric Initialize(); precomputed gradient images are built once per moving volume and
+// smoothing level, optionally cached on disk.
+enum class GradientSource { CentralDifference, Filter, Precomputed };
+
+// Gradient image of 'image' with the settings ITK's metrics use for their default gradient
+// filter: a recursive Gaussian derivative at the largest voxel spacing
+template <typename TImage, typename TGradientImage>
+typename TGradientImage::Pointer computeGradientImage(const TImage* image)
+{
+    const auto spacing = image->GetSpacing();
+    auto gradient = itk::GradientRecursiveGaussianImageFilter<TImage, TGradientImage>::New();
+    gradient->SetInput(image);
+    gradient->SetSigma(*std::max_element(spacing.Begin(), spacing.End()));
+    gradient->SetNormalizeAcrossScale(true);
+    gradient->SetUseImageDirection(true);
+    gradient->Update();
+    typename TGradientImage::Pointer output = gradient->GetOutput();
+    output->DisconnectPipeline();
+    return output;
+}
+
+// Stands in for the metric's moving gradient filter and hands it an already computed gradient
+// image instead of filtering its input
+template <typename TInputImage, typename TGradientImage>
+class PrecomputedGradientFilter : public itk::ImageToImageFilter<TInputImage, TGradientImage>
+{
+    public:
+        typedef PrecomputedGradientFilter Self;
+        typedef itk::ImageToImageFilter<TInputImage, TGradientImage> Superclass;
+        typedef itk::SmartPointer<Self> Pointer;
+        itkNewMacro(Self);
+        itkTypeMacro(PrecomputedGradientFilter, ImageToImageFilter);
+
+        void SetGradientImage(TGradientImage* gradient)
+        {
+            m_GradientImage = gradient;
+            this->Modified();
+        }
+
+    protected:
+        PrecomputedGradientFilter() {};
+
+        void GenerateOutputInformation() ITK_OVERRIDE
+        {
+            this->GetOutput()->CopyInformation(m_GradientImage);
+        }
+
+        // The input is only there because the metric sets it; nothing of it is needed
+        void GenerateInputRequestedRegion() ITK_OVERRIDE {}
+
+        void EnlargeOutputRequestedRegion(itk::DataObject* output) ITK_OVERRIDE
+        {
+            output->SetRequestedRegionToLargestPossibleRegion();
+        }
+
+        void GenerateData() ITK_OVERRIDE
+        {
+            this->GraftOutput(m_GradientImage);
+        }
+
+    private:
+        typename TGradientImage::Pointer m_GradientImage;
+};
@@ -0,0 +1,568 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "MetricSampling.h"
+#include "MovingGradients.h"
+#include "Telemetry.h"
+
+// Similarity measures 'register' can optimize. Mean squares assumes both volumes have the same
+// intensities; mutual information and normalized correlation also work across gain changes.
+enum class MetricType { MeanSquares, MattesMutualInformation, Correlation };
+
+// Where the optimizer scales and initial step length come from. Fixed uses the built-in scales
+// (translation at 1/1000) and --learning-rate; physical shift estimates both at the start of
+// every level from how far each parameter moves the fixed image's points.
+enum class ScalesMode { Fixed, PhysicalShift };
+
+// Per-level settings of the coarse-to-fine pyramid. Level 0 is the coarsest.
+struct LevelSchedule {
+    uint32_t shrinkFactor;
+    double   smoothingSigma;   // physical units
+    uint32_t numberOfIterations;
+    double   learningRate;
+    double   minimumStepLength;
+    // Stop once the slope of the metric values over the last 'convergenceWindow' iterations
+    // (normalized energy profile) drops below 'minimumConvergence'. A window of 0 turns it off.
+    uint32_t convergenceWindow;
+    double   minimumConvergence;
+};
+
+// Everything 'register' can be configured with from the command line
+struct RegistrationOptions {
+    std::string fixedFilename;
+    std::string movingFilename;
+
+    // Pyramid schedule, one entry per level. Defaults to a single full-resolution level
+    // with the same optimizer settings 'register' always used.
+    std::vector<LevelSchedule> levels;
+
+    // Similarity measure, and the number of intensity bins of mutual information's joint histogram
+    MetricType metric = MetricType::MeanSquares;
+    uint32_t histogramBins = 50;
+
+    // Moving image gradients for the metric derivative. Precomputed ones can be kept on disk next
+    // to the moving volume and are then reused by later runs.
+    GradientSource gradientSource = GradientSource::CentralDifference;
+    bool gradientCache = false;
+
+    // Optimizer scales and learning rate. Physical shift estimates them from 'scaleSamples'
+    // random points of each level, for a first step of at most 'maximumStepSize' (physical
+    // units; 0 means the level's smallest voxel spacing).
+    ScalesMode scalesMode = ScalesMode::Fixed;
+    uint32_t scaleSamples = 1000;
+    double maximumStepSize = 0.0;
+
+    // Metric sampling. By default every fixed voxel of the level is evaluated.
+    SamplingStrategy samplingStrategy = SamplingStrategy::None;
+    double samplingPercentage = 1.0;
+    uint32_t samplingSeed = 121212;
+    bool resampleEachIteration = false;
+
+    // Binary masks (nonzero is inside). Fixed samples are only drawn inside the fixed mask;
+    // samples that map outside the moving mask don't count. The moving mask has to be on the
+    // moving volume's grid.
+    std::string fixedMaskFilename;
+    std::string movingMaskFilename;
+
+    // Compare the metric against the generic ITK one at the start of every level
+    bool checkMetric = false;
+
+    // Optimize the isotropic scale of the similarity transform too. Off, the transform stays
+    // rigid: the scale keeps its starting value, which has to be 1.
+    bool fitScale = true;
+
+    // Escalate the transform over the pyramid: translation first, then rigid, and scale (with
+    // fitScale) only at the finest level (see registerPyramid())
+    bool staged = false;
+
+    // Region of the fixed volume to read. Either an explicit index region (x, y, z, sx, sy, sz)
+    // or a margin in voxels around where the moving volume initially lands in the fixed one.
+    // Neither means the whole fixed volume is read.
+    std::vector<int64_t> roi;
+    int64_t roiMargin = -1;
+
+    // Find the moving volume in the fixed one by FFT correlation on copies block averaged by
+    // 'locateShrink' (0 = off) and start from there instead of lining up their centers
+    uint32_t locateShrink = 0;
+
+    // Multi-start rotation search at the coarsest level. searchAngles = 0 disables it.
+    uint32_t searchAngles = 0;
+    uint32_t searchAxes = 1;
+    uint32_t searchKeep = 3;
+
+    // Batch mode: register every moving volume listed in 'manifestFilename' against the fixed
+    // one, 'jobs' at a time, writing one JSON line per volume to 'resultsFilename'
+    std::string manifestFilename;
+    std::string resultsFilename = "results.jsonl";
+    uint32_t jobs = 1;
+
+    // Moving volume resampled into the fixed volume's grid after registration. Written in
+    // 'streamDivisions' pieces so the whole output never has to be in memory.
+    std::string outputFilename;
+    uint32_t streamDivisions = 16;
+    double outputDefaultValue = 0.0;
+
+    // JSON lines telemetry: one record per iteration, per level and per registration. Goes to
+    // standard output for a single registration unless written to a file.
+    std::string telemetryFilename;
+
+    // Set internally: threads each registration may use (0 for ITK's default) and whether to
+    // keep quiet about progress, for when several registrations share the process
+    uint32_t threadsPerRegistration = 0;
+    bool quiet = false;
+    // Where telemetry goes, if anywhere
+    std::shared_ptr<TelemetryLog> telemetry;
+};
+
+// One list entry as an integer: all of 'item' has to be a whole number within T's range, so e.g.
+// "1.5", "8abc" and, for unsigned T, "-2" are rejected. Throws like std::stoll() if it isn't a
+// number at all.
+template <typename T>
+typename std::enable_if<std::is_integral<T>::value, bool>::type parseItem(const std::string& item, T& value)
+{
+    size_t end = 0;
+    if (std::is_unsigned<T>::value) {
+        // std::stoull() would wrap negative numbers around
+        if (item.find('-') != std::string::npos) {
+            return false;
+        }
+        const unsigned long long parsed = std::stoull(item, &end);
+        if (parsed > std::numeric_limits<T>::max()) {
+            return false;
+        }
+        value = T(parsed);
+    } else {
+        const long long parsed = std::stoll(item, &end);
+        if (parsed < std::numeric_limits<T>::lowest() || parsed > std::numeric_limits<T>::max()) {
+            return false;
+        }
+        value = T(parsed);
+    }
+    return end == item.size();
+}
+
+// One list entry as a floating point number, all of 'item'
+template <typename T>
+typename std::enable_if<std::is_floating_point<T>::value, bool>::type parseItem(const std::string& item, T& value)
+{
+    size_t end = 0;
+    value = T(std::stod(item, &end));
+    return end == item.size();
+}
+
+// Splits a comma-separated list like "8,4,1" into its values
+template <typename T>
+bool parseList(const std::string& arg, std::vector<T>& values)
+{
+    values.clear();
+    std::stringstream ss(arg);
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+        try {
+            T value;
+            if (!parseItem(item, value)) {
+                return false;
+            }
+            values.push_back(value);
+        } catch (const std::invalid_argument&) {
+            return false;
+        } catch (const std::out_of_range&) {
+            return false;
+        }
+    }
+    return !values.empty();
+}
+
+// Expands a per-level list to 'numberOfLevels' entries. A single value applies to every level.
+template <typename T>
+bool expandPerLevel(const std::string& name, std::vector<T>& values, const uint32_t numberOfLevels)
+{
+    if (values.size() == 1) {
+        values.assign(numberOfLevels, values[0]);
+    } else if (values.size() != numberOfLevels) {
+        std::cerr << "[error]: " << name << " has " << values.size() << " entries but there are "
+                  << numberOfLevels << " levels" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+inline void printHelp(const char* programName)
+{
+    std::cerr << "Usage: " << std::endl;
+    std::cerr << "    " << programName << " fixedImageFile movingImageFile [options]" << std::endl;
+    std::cerr << "    " << programName << " fixedImageFile --batch manifestFile [options]" << std::endl;
+    std::cerr << "    " << programName << " --self-check    compare the metric with ITK's generic one on" << std::endl;
+    std::cerr << "                            small synthetic volumes" << std::endl;
+    std::cerr << std::endl;
+    std::cerr << "Pyramid options (comma-separated lists, coarsest level first; a single" << std::endl;
+    std::cerr << "value applies to every level):" << std::endl;
+    std::cerr << "    --levels N              number of pyramid levels (default: 1)" << std::endl;
+    std::cerr << "    --shrink f0,f1,...      shrink factor per level (default: 1)" << std::endl;
+    std::cerr << "    --sigmas s0,s1,...      smoothing sigma per level, physical units (default: 0)" << std::endl;
+    std::cerr << "    --iterations n0,n1,...  optimizer iterations per level (default: 200)" << std::endl;
+    std::cerr << "    --rigid                 keep the scale at 1 (default: also optimize an isotropic" << std::endl;
+    std::cerr << "                            scale)" << std::endl;
+    std::cerr << "    --staged                optimize only the translation at the coarsest level (of 3" << std::endl;
+    std::cerr << "                            or more), then rotation too, and unless --rigid the scale" << std::endl;
+    std::cerr << "                            only at the finest level; a level with several stages runs" << std::endl;
+    std::cerr << "                            each with its iterations" << std::endl;
+    std::cerr << "    --learning-rate r0,...  initial step length per level (default: 0.2)" << std::endl;
+    std::cerr << "    --min-step m0,m1,...    minimum step length per level (default: 0.001)" << std::endl;
+    std::cerr << "    --convergence-window w0,..." << std::endl;
+    std::cerr << "                            iterations the metric's convergence slope is fitted over" << std::endl;
+    std::cerr << "                            per level, 0 to stop on iterations and step length only" << std::endl;
+    std::cerr << "                            (default: 10)" << std::endl;
+    std::cerr << "    --convergence c0,c1,... stop a level once its convergence slope drops below this" << std::endl;
+    std::cerr << "                            (default: 1e-6)" << std::endl;
+    std::cerr << std::endl;
+    std::cerr << "Metric options:" << std::endl;
+    std::cerr << "    --metric m              meansquares, mattes (mutual information) or ncc" << std::endl;
+    std::cerr << "                            (normalized correlation) (default: meansquares)" << std::endl;
+    std::cerr << "    --histogram-bins n      joint histogram bins for mattes (default: 50)" << std::endl;
+    std::cerr << "    --gradient g            moving image gradients: central (differences at every" << std::endl;
+    std::cerr << "                            sample), filter (gradient image built whenever the" << std::endl;
+    std::cerr << "                            metric is initialized) or precomputed (built once per" << std::endl;
+    std::cerr << "                            smoothing level) (default: central)" << std::endl;
+    std::cerr << "    --gradient-cache        keep precomputed gradients next to the moving volume" << std::endl;
+    std::cerr << "                            (<name>.gradient-s<sigma>.mha) and reuse them" << std::endl;
+    std::cerr << std::endl;
+    std::cerr << "Optimizer scales:" << std::endl;
+    std::cerr << "    --scales s              fixed (translation at 1/1000, step from --learning-rate)" << std::endl;
+    std::cerr << "                            or physical (scales and first step estimated from" << std::endl;
+    std::cerr << "                            physical shifts at every level) (default: fixed)" << std::endl;
+    std::cerr << "    --scale-samples n       fixed points physical shifts are measured at (default: 1000)" << std::endl;
+    std::cerr << "    --max-step s            largest first step in physical units (default: the" << std::endl;
+    std::cerr << "                            level's smallest voxel spacing)" << std::endl;
+    std::cerr << std::endl;
+    std::cerr << "Metric sampling options:" << std::endl;
+    std::cerr << "    --sampling-strategy s   none, regular or random (default: none)" << std::endl;
+    std::cerr << "    --sampling-percentage p fraction of fixed voxels to sample, (0, 1] (default: 1)" << std::endl;
+    std::cerr << "    --seed n                random sampling seed (default: 121212)" << std::endl;
+    std::cerr << "    --resample-each-iteration" << std::endl;
+    std::cerr << "                            draw new random samples before every iteration" << std::endl;
+    std::cerr << "    --check-metric          compare the metric with ITK's generic one at every level" << std::endl;
+    std::cerr << std::endl;
+    std::cerr << "Masks (nonzero voxels are inside, e.g. the thresholded extractSandGrainCentroids output):" << std::endl;
+    std::cerr << "    --fixed-mask file       only sample fixed voxels inside this mask; sampling" << std::endl;
+    std::cerr << "                            percentages are then of the voxels inside it" << std::endl;
+    std::cerr << "    --moving-mask file      ignore samples that land outside this mask, which has to" << std::endl;
+    std::cerr << "                            have the moving volume's size" << std::endl;
+    std::cerr << std::endl;
+    std::cerr << "Initial placement:" << std::endl;
+    std::cerr << "    --locate f              find the moving volume inside the fixed one by FFT" << std::endl;
+    std::cerr << "                            normalized correlation at 1/f resolution and start" << std::endl;
+    std::cerr << "                            from there (default: 0, line up the volume centers)" << std::endl;
+    std::cerr << std::endl;
+    std::cerr << "Fixed region of interest (only this part of the fixed volume is read):" << std::endl;
+    std::cerr << "    --roi x,y,z,sx,sy,sz    explicit index region of the fixed volume" << std::endl;
+    std::cerr << "    --roi-margin m          region covered by the initially placed moving volume," << std::endl;
+    std::cerr << "                            padded by m voxels" << std::endl;
+    std::cerr << std::endl;
+    std::cerr << "Rotation search (run before the pyramid, at the coarsest level):" << std::endl;
+    std::cerr << "    --search-angles n       try n rotations over a full turn (default: 0, off)" << std::endl;
+    std::cerr << "    --search-axes n         about n axes spread over the sphere instead of only Z" << std::endl;
+    std::cerr << "    --search-keep k         refine the k best rotations (default: 3)" << std::endl;
+    std::cerr << std::endl;
+    std::cerr << "Output:" << std::endl;
+    std::cerr << "    --output file           write the moving volume resampled into the fixed grid" << std::endl;
+    std::cerr << "    --stream-divisions n    write it in n pieces (default: 16); only one piece is" << std::endl;
+    std::cerr << "                            in memory at a time if the format streams (e.g. .mhd)" << std::endl;
+    std::cerr << "    --output-default v      value outside the moving volume (default: 0)" << std::endl;
+    std::cerr << std::endl;
+    std::cerr << "Telemetry:" << std::endl;
+    std::cerr << "    --telemetry file        write per-iteration JSON lines to file instead of" << std::endl;
+    std::cerr << "                            standard output (batch mode only writes them there)" << std::endl;
+    std::cerr << std::endl;
+    std::cerr << "Batch mode (the fixed volume and its pyramid are built once and shared):" << std::endl;
+    std::cerr << "    --batch file            register every moving volume listed in file, one per line" << std::endl;
+    std::cerr << "    --jobs n                number of registrations to run at once (default: 1)" << std::endl;
+    std::cerr << "    --results file          JSON lines output, one per moving volume (default: results.jsonl)"
+              << std::endl;
+    std::cerr << std::endl;
+    std::cerr << "Example, most of the work at 1/8 and 1/4 resolution:" << std::endl;
+    std::cerr << "    " << programName << " fixed.mhd moving.mhd --shrink 8,4,1 --sigmas 4,2,0"
+              << " --iterations 150,50,10" << std::endl;
+}
+
+// Parse argv into 'opts'. Returns false (after printing why) if the arguments are invalid.
+inline bool parseOptions(int argc, char* argv[], RegistrationOptions& opts)
+{
+    if (argc < 3) {
+        std::cerr << "Missing Parameters " << std::endl;
+        printHelp(argv[0]);
+        return false;
+    }
+    // The moving volume is left out in batch mode
+    opts.fixedFilename = std::string(argv[1]);
+    auto firstOption = 2;
+    if (std::string(argv[2]).compare(0, 2, "--") != 0) {
+        opts.movingFilename = std::string(argv[2]);
+        firstOption = 3;
+    }
+
+    uint32_t numberOfLevels = 0;
+    std::vector<uint32_t> shrinkFactors      = { 1 };
+    std::vector<double>   smoothingSigmas    = { 0.0 };
+    std::vector<uint32_t> iterations         = { 200 };
+    std::vector<double>   learningRates      = { 0.2 };
+    std::vector<double>   minimumStepLengths = { 0.001 };
+    std::vector<uint32_t> convergenceWindows = { 10 };
+    std::vector<double>   convergenceValues  = { 1e-6 };
+
+    for (auto i = firstOption; i < argc; ++i) {
+        const auto arg = std::string(argv[i]);
+        if (arg == "-h" || arg == "--help") {
+            printHelp(argv[0]);
+            return false;
+        }
+        // Flags without a value
+        if (arg == "--resample-each-iteration") {
+            opts.resampleEachIteration = true;
+            continue;
+        }
+        if (arg == "--gradient-cache") {
+            opts.gradientCache = true;
+            continue;
+        }
+        if (arg == "--check-metric") {
+            opts.checkMetric = true;
+            continue;
+        }
+        if (arg == "--staged") {
+            opts.staged = true;
+            continue;
+        }
+        if (arg == "--rigid") {
+            opts.fitScale = false;
+            continue;
+        }
+        if (i + 1 >= argc) {
+            std::cerr << "[error]: " << arg << " expects a value" << std::endl;
+            return false;
+        }
+        const auto value = std::string(argv[++i]);
+        bool ok = true;
+        if (arg == "--levels") {
+            std::vector<uint32_t> n;
+            ok = parseList(value, n) && n.size() == 1 && n[0] > 0;
+            numberOfLevels = ok ? n[0] : 0;
+        } else if (arg == "--shrink") {
+            ok = parseList(value, shrinkFactors);
+        } else if (arg == "--sigmas") {
+            ok = parseList(value, smoothingSigmas);
+        } else if (arg == "--iterations") {
+            ok = parseList(value, iterations);
+        } else if (arg == "--learning-rate") {
+            ok = parseList(value, learningRates);
+        } else if (arg == "--min-step") {
+            ok = parseList(value, minimumStepLengths);
+        } else if (arg == "--convergence-window") {
+            ok = parseList(value, convergenceWindows);
+        } else if (arg == "--convergence") {
+            ok = parseList(value, convergenceValues);
+        } else if (arg == "--metric") {
+            if (value == "meansquares") {
+                opts.metric = MetricType::MeanSquares;
+            } else if (value == "mattes") {
+                opts.metric = MetricType::MattesMutualInformation;
+            } else if (value == "ncc") {
+                opts.metric = MetricType::Correlation;
+            } else {
+                ok = false;
+            }
+        } else if (arg == "--histogram-bins") {
+            std::vector<uint32_t> n;
+            ok = parseList(value, n) && n.size() == 1 && n[0] >= 5;
+            opts.histogramBins = ok ? n[0] : 50;
+        } else if (arg == "--gradient") {
+            if (value == "central") {
+                opts.gradientSource = GradientSource::CentralDifference;
+            } else if (value == "filter") {
+                opts.gradientSource = GradientSource::Filter;
+            } else if (value == "precomputed") {
+                opts.gradientSource = GradientSource::Precomputed;
+            } else {
+                ok = false;
+            }
+        } else if (arg == "--scales") {
+            if (value == "fixed") {
+                opts.scalesMode = ScalesMode::Fixed;
+            } else if (value == "physical") {
+                opts.scalesMode = ScalesMode::PhysicalShift;
+            } else {
+                ok = false;
+            }
+        } else if (arg == "--scale-samples") {
+            std::vector<uint32_t> n;
+            ok = parseList(value, n) && n.size() == 1 && n[0] > 0;
+            opts.scaleSamples = ok ? n[0] : 1;
+        } else if (arg == "--max-step") {
+            std::vector<double> m;
+            ok = parseList(value, m) && m.size() == 1 && m[0] > 0.0;
+            opts.maximumStepSize = ok ? m[0] : 0.0;
+        } else if (arg == "--sampling-strategy") {
+            if (value == "none") {
+                opts.samplingStrategy = SamplingStrategy::None;
+            } else if (value == "regular") {
+                opts.samplingStrategy = SamplingStrategy::Regular;
+            } else if (value == "random") {
+                opts.samplingStrategy = SamplingStrategy::Random;
+            } else {
+                ok = false;
+            }
+        } else if (arg == "--sampling-percentage") {
+            std::vector<double> p;
+            ok = parseList(value, p) && p.size() == 1 && p[0] > 0.0 && p[0] <= 1.0;
+            opts.samplingPercentage = ok ? p[0] : 1.0;
+        } else if (arg == "--seed") {
+            std::vector<uint32_t> n;
+            ok = parseList(value, n) && n.size() == 1;
+            opts.samplingSeed = ok ? n[0] : 0;
+        } else if (arg == "--fixed-mask") {
+            opts.fixedMaskFilename = value;
+        } else if (arg == "--moving-mask") {
+            opts.movingMaskFilename = value;
+        } else if (arg == "--roi") {
+            ok = parseList(value, opts.roi) && opts.roi.size() == 6 &&
+                 opts.roi[3] > 0 && opts.roi[4] > 0 && opts.roi[5] > 0;
+        } else if (arg == "--locate") {
+            std::vector<uint32_t> f;
+            ok = parseList(value, f) && f.size() == 1;
+            opts.locateShrink = ok ? f[0] : 0;
+        } else if (arg == "--roi-margin") {
+            std::vector<int64_t> m;
+            ok = parseList(value, m) && m.size() == 1 && m[0] >= 0;
+            opts.roiMargin = ok ? m[0] : -1;
+        } else if (arg == "--search-angles") {
+            std::vector<uint32_t> n;
+            ok = parseList(value, n) && n.size() == 1;
+            opts.searchAngles = ok ? n[0] : 0;
+        } else if (arg == "--search-axes") {
+            std::vector<uint32_t> n;
+            ok = parseList(value, n) && n.size() == 1 && n[0] > 0;
+            opts.searchAxes = ok ? n[0] : 1;
+        } else if (arg == "--search-keep") {
+            std::vector<uint32_t> n;
+            ok = parseList(value, n) && n.size() == 1 && n[0] > 0;
+            opts.searchKeep = ok ? n[0] : 1;
+        } else if (arg == "--telemetry") {
+            opts.telemetryFilename = value;
+        } else if (arg == "--output") {
+            opts.outputFilename = value;
+        } else if (arg == "--stream-divisions") {
+            std::vector<uint32_t> n;
+            ok = parseList(value, n) && n.size() == 1 && n[0] > 0;
+            opts.streamDivisions = ok ? n[0] : 1;
+        } else if (arg == "--output-default") {
+            std::vector<double> v;
+            ok = parseList(value, v) && v.size() == 1;
+            opts.outputDefaultValue = ok ? v[0] : 0.0;
+        } else if (arg == "--batch") {
+            opts.manifestFilename = value;
+        } else if (arg == "--results") {
+            opts.resultsFilename = value;
+        } else if (arg == "--jobs") {
+            std::vector<uint32_t> n;
+            ok = parseList(value, n) && n.size() == 1 && n[0] > 0;
+            opts.jobs = ok ? n[0] : 1;
+        } else {
+            std::cerr << "[error]: unknown option " << arg << std::endl;
+            return false;
+        }
+        if (!ok) {
+            std::cerr << "[error]: invalid value '" << value << "' for " << arg << std::endl;
+            return false;
+        }
+    }
+
+    // Number of levels is either given or taken from the longest per-level list
+    if (numberOfLevels == 0) {
+        numberOfLevels = uint32_t(std::max({ shrinkFactors.size(), smoothingSigmas.size(), iterations.size(),
+                                             learningRates.size(), minimumStepLengths.size(),
+                                             convergenceWindows.size(), convergenceValues.size() }));
+    }
+    if (!expandPerLevel("--shrink", shrinkFactors, numberOfLevels) ||
+        !expandPerLevel("--sigmas", smoothingSigmas, numberOfLevels) ||
+        !expandPerLevel("--iterations", iterations, numberOfLevels) ||
+        !expandPerLevel("--learning-rate", learningRates, numberOfLevels) ||
+        !expandPerLevel("--min-step", minimumStepLengths, numberOfLevels) ||
+        !expandPerLevel("--convergence-window", convergenceWindows, numberOfLevels) ||
+        !expandPerLevel("--convergence", convergenceValues, numberOfLevels)) {
+        return false;
+    }
+
+    // A percentage alone implies random sampling
+    if (opts.samplingStrategy == SamplingStrategy::None && opts.samplingPercentage < 1.0) {
+        opts.samplingStrategy = SamplingStrategy::Random;
+    }
+    if (opts.gradientCache && opts.gradientSource != GradientSource::Precomputed) {
+        std::cerr << "[error]: --gradient-cache needs --gradient precomputed" << std::endl;
+        return false;
+    }
+    if (opts.checkMetric && opts.gradientSource != GradientSource::CentralDifference) {
+        std::cerr << "[error]: --check-metric compares central difference gradients only" << std::endl;
+        return false;
+    }
+    if (opts.checkMetric && opts.metric != MetricType::MeanSquares) {
+        std::cerr << "[error]: --check-metric only applies to --metric meansquares" << std::endl;
+        return false;
+    }
+    if (opts.resampleEachIteration && opts.samplingStrategy != SamplingStrategy::Random) {
+        std::cerr << "[error]: --resample-each-iteration needs --sampling-strategy random" << std::endl;
+        return false;
+    }
+
+    if (opts.movingFilename.empty() == opts.manifestFilename.empty()) {
+        std::cerr << "[error]: give either a moving image or --batch manifestFile" << std::endl;
+        return false;
+    }
+    if (!opts.manifestFilename.empty() && !opts.outputFilename.empty()) {
+        std::cerr << "[error]: --output writes a single volume and can't be used with --batch" << std::endl;
+        return false;
+    }
+    if (!opts.manifestFilename.empty() && !opts.movingMaskFilename.empty()) {
+        std::cerr << "[error]: --moving-mask belongs to a single moving volume and can't be used with --batch"
+                  << std::endl;
+        return false;
+    }
+    if (!opts.manifestFilename.empty() && opts.roiMargin >= 0) {
+        std::cerr << "[error]: --roi-margin depends on the moving volume and can't be used with --batch"
+                  << std::endl;
+        return false;
+    }
+    if (!opts.roi.empty() && opts.roiMargin >= 0) {
+        std::cerr << "[error]: --roi and --roi-margin are mutually exclusive" << std::endl;
+        return false;
+    }
+
+    opts.levels.clear();
+    for (uint32_t l = 0; l < numberOfLevels; ++l) {
+        if (shrinkFactors[l] < 1) {
+            std::cerr << "[error]: shrink factors must be in the range [1, inf)" << std::endl;
+            return false;
+        }
+        if (smoothingSigmas[l] < 0.0) {
+            std::cerr << "[error]: smoothing sigmas must be non-negative" << std::endl;
+            return false;
+        }
+        if (convergenceWindows[l] == 1) {
+            std::cerr << "[error]: a convergence window needs at least 2 iterations" << std::endl;
+            return false;
+        }
+        opts.levels.push_back({ shrinkFactors[l], smoothingSigmas[l], iterations[l],
+                                learningRates[l], minimumStepLengths[l],
+                                convergenceWindows[l], convergenceValues[l] });
+    }
+    return true;
+}
@@ -0,0 +1,131 @@
+#include <chrono>
+#include <cmath>
+#include <limits>
+#include <sstream>
+
+#include "RigidRegistration.h"
+#include "RotationSearch.h"
+
+
+// Optimizer scales of the Similarity3DTransform parameters: versor, translation, scale
+TOptimizer::ScalesType similarityScales()
+{
+    TOptimizer::ScalesType optimizerScales(TTransform::New()->GetNumberOfParameters());
+    const double translationScale = 1.0 / 1000.0;
+    optimizerScales[0] = 1.0;
+    optimizerScales[1] = 1.0;
+    optimizerScales[2] = 1.0;
+    optimizerScales[3] = translationScale;
+    optimizerScales[4] = translationScale;
+    optimizerScales[5] = translationScale;
+    optimizerScales[6] = 1.0;
+    return optimizerScales;
+}
+
+template <typename TPixel>
+RegistrationResult registerImages(const FixedPyramid<TPixel>& fixed, typename TMovingImage<TPixel>::Pointer moving,
+                                  const TTransform* initialTransform, const RegistrationOptions& opts,
+                                  const std::string& movingFilename)
+{
+    if (!opts.fitScale && initialTransform->GetScale() != 1.0) {
+        itkGenericExceptionMacro(<< "the starting transform has a scale of " << initialTransform->GetScale()
+                                 << ", which a rigid registration would keep; fit the scale too (no --rigid)");
+    }
+    const auto start = std::chrono::steady_clock::now();
+    const auto optimizerScales = similarityScales();
+    const auto movingPyramid = buildMovingPyramid<TPixel>(moving, movingFilename, opts);
+
+    std::vector<TTransform::VersorType> startingRotations = { initialTransform->GetVersor() };
+    if (opts.searchAngles > 0) {
+        const auto hypotheses = searchRotations<TPixel>(fixed.levels.front(), movingPyramid.levels.front(),
+                                                        fixed.mask, movingPyramid.mask, initialTransform,
+                                                        rotationGrid(opts.searchAngles, opts.searchAxes),
+                                                        opts.searchKeep, opts);
+        startingRotations.clear();
+        for (const auto& h : hypotheses) {
+            if (!opts.quiet) {
+                std::cout << "Rotation hypothesis " << h.rotation << ": metric value " << h.value << std::endl;
+            }
+            startingRotations.push_back(h.rotation);
+        }
+    }
+    const std::chrono::duration<double> searchTime = std::chrono::steady_clock::now() - start;
+
+    const auto telemetryFields = "\"moving\": \"" + jsonEscape(movingFilename) + "\", ";
+    RegistrationResult result = { nullptr, 0, std::numeric_limits<double>::quiet_NaN(), 0.0,
+                                  searchTime.count(), {}, {} };
+    for (size_t s = 0; s < startingRotations.size(); ++s) {
+        auto candidate = TTransform::New();
+        candidate->SetFixedParameters(initialTransform->GetFixedParameters());
+        candidate->SetParameters(initialTransform->GetParameters());
+        candidate->SetRotation(startingRotations[s]);
+        const auto pyramidResult = registerPyramid<TPixel>(fixed, movingPyramid, candidate, optimizerScales, opts,
+                                                           telemetryFields + "\"start\": " + std::to_string(s) + ", ");
+        result.iterations += pyramidResult.iterations;
+        // A start that ends without valid samples is never kept. The metrics then report the
+        // largest double, not a NaN, so check both.
+        const bool valid = pyramidResult.validPoints > 0 && std::isfinite(pyramidResult.value) &&
+                           pyramidResult.value < std::numeric_limits<double>::max();
+        if (valid && (!result.transform || pyramidResult.value < result.value)) {
+            result.value = pyramidResult.value;
+            result.transform = candidate;
+            result.levelSeconds = pyramidResult.levelSeconds;
+            result.stopConditions = pyramidResult.stopConditions;
+        }
+    }
+    if (!result.transform) {
+        itkGenericExceptionMacro(<< "none of the " << startingRotations.size()
+                                 << " starts ended with valid samples; do the volumes overlap?");
+    }
+    const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    result.seconds = elapsed.count();
+    if (opts.telemetry) {
+        std::ostringstream record;
+        record.precision(std::numeric_limits<double>::max_digits10);
+        record << "{" << telemetryFields << "\"event\": \"summary\", \"starts\": " << startingRotations.size()
+               << ", \"iterations\": " << result.iterations << ", \"value\": " << jsonNumber(result.value)
+               << ", \"seconds\": " << result.seconds << "}";
+        opts.telemetry->Write(record.str());
+        opts.telemetry->Flush();
+    }
+    return result;
+}
+
+template <typename TPixel>
+RegistrationResult registerImages(typename TFixedImage<TPixel>::Pointer fixed,
+                                  typename TMovingImage<TPixel>::Pointer moving, const RegistrationOptions& opts,
+                                  const TTransform* initialTransform)
+{
+    TTransform::Pointer startingTransform;
+    if (initialTransform) {
+        startingTransform = TTransform::New();
+        startingTransform->SetFixedParameters(initialTransform->GetFixedParameters());
+        startingTransform->SetParameters(initialTransform->GetParameters());
+    } else {
+        startingTransform = makeInitialTransform(fixed.GetPointer(), moving.GetPointer());
+        if (opts.locateShrink > 0) {
+            auto localizerSpacing = fixed->GetSpacing();
+            localizerSpacing *= double(opts.locateShrink);
+            locateMoving(startingTransform.GetPointer(), localizerImage(fixed.GetPointer(), localizerSpacing),
+                         moving.GetPointer(), opts);
+        }
+    }
+    const auto pyramid = buildFixedPyramid<TPixel>(fixed, fixed, opts);
+    return registerImages<TPixel>(pyramid, moving, startingTransform, opts);
+}
+
+template RegistrationResult registerImages<uint8_t>(const FixedPyramid<uint8_t>&, TMovingImage<uint8_t>::Pointer,
+                                                    const TTransform*, const RegistrationOptions&,
+                                                    const std::string&);
+template RegistrationResult registerImages<uint16_t>(const FixedPyramid<uint16_t>&, TMovingImage<uint16_t>::Pointer,
+                                                     const TTransform*, const RegistrationOptions&,
+                                                     const std::string&);
+template RegistrationResult registerImages<float>(const FixedPyramid<float>&, TMovingImage<float>::Pointer,
+                                                  const TTransform*, const RegistrationOptions&,
+                                                  const std::string&);
+template RegistrationResult registerImages<uint8_t>(TFixedImage<uint8_t>::Pointer, TMovingImage<uint8_t>::Pointer,
+                                                    const RegistrationOptions&, const TTransform*);
+template RegistrationResult registerImages<uint16_t>(TFixedImage<uint16_t>::Pointer, TMovingImage<uint16_t>::Pointer,
+                                                     const RegistrationOptions&, const TTransform*);
+template RegistrationResult registerImages<float>(TFixedImage<float>::Pointer, TMovingImage<float>::Pointer,
+                                                  const RegistrationOptions&, const TTransform*);
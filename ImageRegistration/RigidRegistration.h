@@ -0,0 +1,60 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "VolumeRegistration.h"
+
+
+// The registration itself, as a library (rigidreg) for programs that already have their volumes in
+// memory. 'register' and ImageRegistration8 are thin wrappers around it that read the volumes and
+// report the result. Everything is configured through RegistrationOptions; the filenames in it
+// are only used for the masks. Implemented for uint8_t, uint16_t and float pixels. The transform
+// is a similarity one, unless opts.fitScale is cleared; then it stays rigid.
+
+// Outcome of registering one moving volume
+struct RegistrationResult {
+    TTransform::Pointer transform;   // maps fixed points onto moving ones
+    uint32_t iterations;             // over all levels and starts
+    double value;                    // final metric value of the start that was kept
+    double seconds;                  // wall time of the whole registration
+    double searchSeconds;            // of that, in the rotation search
+    std::vector<double> levelSeconds;          // per level, of the start that was kept
+    std::vector<std::string> stopConditions;   // per level, of the start that was kept
+};
+
+// Registers 'moving' against an already built fixed pyramid, starting from 'initialTransform'.
+// With a rotation search, the best starting rotations are found at the coarsest level first, the
+// whole pyramid is run from each of them and whichever ends up best is kept. 'movingFilename'
+// names the moving volume in telemetry and locates its gradient cache; leave it empty for a
+// volume that doesn't come from a file.
+template <typename TPixel>
+RegistrationResult registerImages(const FixedPyramid<TPixel>& fixed, typename TMovingImage<TPixel>::Pointer moving,
+                                  const TTransform* initialTransform, const RegistrationOptions& opts,
+                                  const std::string& movingFilename = std::string());
+
+// Registers 'moving' against the whole of 'fixed'. Without an 'initialTransform', it starts from
+// the centers lined up, or from where FFT correlation places the moving volume with
+// opts.locateShrink set.
+template <typename TPixel>
+RegistrationResult registerImages(typename TFixedImage<TPixel>::Pointer fixed,
+                                  typename TMovingImage<TPixel>::Pointer moving, const RegistrationOptions& opts,
+                                  const TTransform* initialTransform = nullptr);
+
+extern template RegistrationResult registerImages<uint8_t>(const FixedPyramid<uint8_t>&, TMovingImage<uint8_t>::Pointer,
+                                                           const TTransform*, const RegistrationOptions&,
+                                                           const std::string&);
+extern template RegistrationResult registerImages<uint16_t>(const FixedPyramid<uint16_t>&,
+                                                            TMovingImage<uint16_t>::Pointer, const TTransform*,
+                                                            const RegistrationOptions&, const std::string&);
+extern template RegistrationResult registerImages<float>(const FixedPyramid<float>&, TMovingImage<float>::Pointer,
+                                                         const TTransform*, const RegistrationOptions&,
+                                                         const std::string&);
+extern template RegistrationResult registerImages<uint8_t>(TFixedImage<uint8_t>::Pointer,
+                                                           TMovingImage<uint8_t>::Pointer,
+                                                           const RegistrationOptions&, const TTransform*);
+extern template RegistrationResult registerImages<uint16_t>(TFixedImage<uint16_t>::Pointer,
+                                                            TMovingImage<uint16_t>::Pointer,
+                                                            const RegistrationOptions&, const TTransform*);
+extern template RegistrationResult registerImages<float>(TFixedImage<float>::Pointer, TMovingImage<float>::Pointer,
+                                                         const RegistrationOptions&, const TTransform*);
@@ -0,0 +1,131 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <limits>
+#include <thread>
+#include <vector>
+
+#include "itkMultiThreader.h"
+
+#include "VolumeRegistration.h"
+
+
+// A starting rotation and the metric value it gave at the search level
+struct RotationHypothesis {
+    TTransform::VersorType rotation;
+    double value;
+};
+
+// Rotations to try: 'numberOfAngles' angles evenly spread over a full turn about each of
+// 'numberOfAxes' axes. One axis means rotations about Z only; more axes are spread evenly over
+// the upper hemisphere (a Fibonacci lattice starting at Z), which covers all of SO(3) since the
+// angles go all the way around.
+inline std::vector<TTransform::VersorType> rotationGrid(const uint32_t numberOfAngles, const uint32_t numberOfAxes)
+{
+    const double goldenAngle = M_PI * (3.0 - std::sqrt(5.0));
+    std::vector<TTransform::VersorType> rotations;
+
+    // The zero rotation is the same about every axis, so only add it once
+    TTransform::VersorType identity;
+    identity.SetIdentity();
+    rotations.push_back(identity);
+
+    for (uint32_t a = 0; a < std::max(1u, numberOfAxes); ++a) {
+        const double z   = 1.0 - double(a) / std::max(1u, numberOfAxes);
+        const double r   = std::sqrt(1.0 - z * z);
+        const double phi = a * goldenAngle;
+        TTransform::VectorType axis;
+        axis[0] = r * std::cos(phi);
+        axis[1] = r * std::sin(phi);
+        axis[2] = z;
+        for (uint32_t k = 1; k < numberOfAngles; ++k) {
+            TTransform::VersorType rotation;
+            rotation.Set(axis, 2.0 * M_PI * k / numberOfAngles);
+            rotations.push_back(rotation);
+        }
+    }
+    return rotations;
+}
+
+// Evaluates the metric for every rotation in 'rotations' (keeping the center, translation and
+// scale of 'initial') and returns the 'keep' best ones, best first. The hypotheses are spread
+// over all cores; each worker has its own single-threaded metric and transform, so only the
+// images and masks are shared.
+template <typename TPixel>
+std::vector<RotationHypothesis> searchRotations(typename TFixedImage<TPixel>::Pointer fixed,
+                                                typename TMovingImage<TPixel>::Pointer moving,
+                                                const std::shared_ptr<const BitMask>& fixedMask,
+                                                const std::shared_ptr<const BitMask>& movingMask,
+                                                const TTransform* initial,
+                                                const std::vector<TTransform::VersorType>& rotations,
+                                                const uint32_t keep, const RegistrationOptions& opts)
+{
+    using TSearchMetric = TMetricBase<TPixel>;
+    const uint32_t availableThreads = opts.threadsPerRegistration > 0
+                                      ? opts.threadsPerRegistration
+                                      : uint32_t(itk::MultiThreader::GetGlobalDefaultNumberOfThreads());
+    const uint32_t numberOfWorkers = std::max(1u, std::min(uint32_t(rotations.size()), availableThreads));
+    if (!opts.quiet) {
+        std::cout << "Searching " << rotations.size() << " rotations on " << numberOfWorkers << " threads"
+                  << std::endl;
+    }
+
+    // Every worker sees the same sample points so their values are comparable
+    std::mt19937 generator(opts.samplingSeed);
+    auto samples = sampleImageDomain<typename TSearchMetric::FixedSampledPointSetType>(
+        fixed.GetPointer(), opts.samplingStrategy == SamplingStrategy::None ? SamplingStrategy::Regular
+                                                                            : opts.samplingStrategy,
+        opts.samplingPercentage, generator, fixedMask.get(),
+        fixedMask ? countVoxelsInside(fixed.GetPointer(), fixedMask.get()) : 0);
+
+    // Metrics are set up here rather than in the workers, since initializing touches the
+    // images' pipelines
+    std::vector<typename TSearchMetric::Pointer> metrics;
+    std::vector<TTransform::Pointer> transforms;
+    for (uint32_t w = 0; w < numberOfWorkers; ++w) {
+        auto transform = TTransform::New();
+        transform->SetFixedParameters(initial->GetFixedParameters());
+        transform->SetParameters(initial->GetParameters());
+        auto metric = makeMetric<TPixel>(opts);
+        metric->SetFixedImage(fixed);
+        metric->SetMovingImage(moving);
+        metric->SetMovingTransform(transform);
+        setMovingMask<TPixel>(metric, movingMask);
+        metric->SetVirtualDomainFromImage(fixed);
+        metric->SetFixedSampledPointSet(samples);
+        metric->SetUseFixedSampledPointSet(true);
+        metric->SetMaximumNumberOfThreads(1);
+        metric->Initialize();
+        metrics.push_back(metric);
+        transforms.push_back(transform);
+    }
+
+    std::vector<RotationHypothesis> hypotheses(rotations.size());
+    std::atomic<size_t> next(0);
+    auto worker = [&](const uint32_t w) {
+        for (size_t i = next++; i < rotations.size(); i = next++) {
+            hypotheses[i].rotation = rotations[i];
+            transforms[w]->SetRotation(rotations[i]);
+            try {
+                hypotheses[i].value = metrics[w]->GetValue();
+            } catch (itk::ExceptionObject&) {
+                // Typically no sample landed inside the moving volume
+                hypotheses[i].value = std::numeric_limits<double>::max();
+            }
+        }
+    };
+    std::vector<std::thread> threads;
+    for (uint32_t w = 0; w < numberOfWorkers; ++w) {
+        threads.emplace_back(worker, w);
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+
+    std::sort(hypotheses.begin(), hypotheses.end(),
+              [](const RotationHypothesis& a, const RotationHypothesis& b) { return a.value < b.value; });
+    hypotheses.resize(std::min<size_t>(std::max(1u, keep), hypotheses.size()));
+    return hypotheses;
+}
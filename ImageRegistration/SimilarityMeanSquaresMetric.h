@@ -0,0 +1,681 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <limits>
+#include <type_traits>
+#include <vector>
+
+#if defined(__AVX2__) && defined(__FMA__)
+#include <immintrin.h>
+#endif
+
+#include "itkIdentityTransform.h"
+#include "itkLinearInterpolateImageFunction.h"
+#include "itkMeanSquaresImageToImageMetricv4.h"
+#include "itkSimilarity3DTransform.h"
+#include "itkTranslationTransform.h"
+
+#include "ImageMask.h"
+#include "StageTransforms.h"
+#include "WorkerPool.h"
+
+// Whether a transform's Jacobian with respect to its parameters is the same at every point
+template <typename TTransform> struct HasConstantJacobian : std::false_type {};
+template <typename T, unsigned int D> struct HasConstantJacobian<itk::TranslationTransform<T, D>> : std::true_type {};
+template <typename T> struct HasConstantJacobian<FixedMatrixTranslationTransform<T>> : std::true_type {};
+
+
+// Mean squares metric for the one combination 'register' runs: an affine TMovingTransform
+// (Similarity3DTransform, or the translation and rigid transforms of a staged registration) on
+// the moving image, linear interpolation, scalar 3D images and no fixed mask. Instead of going
+// through ITK's per-point pipeline (virtual transform, interpolator and Jacobian calls for every
+// sample) the fixed samples are kept as flat x, y, z and value arrays, the transform is folded
+// into one affine map to moving voxel coordinates and the interpolation is done 8 samples at a
+// time with AVX2 when the build has it.
+//
+// The moving gradient is a central difference of the interpolated image one voxel either side
+// of the sample, zero along an axis where a neighbour falls outside the volume, like ITK's
+// CentralDifferenceImageFunction. The Jacobian of these transforms is linear in the point, so
+// instead of a Jacobian per sample only 12 sums of gradient times error (and times the
+// coordinates) are accumulated, and the derivative components come out of those at the end. For
+// a translation the Jacobian is constant and the 3 plain sums are all it takes; that is decided
+// at compile time, so its kernels don't even compute the others.
+//
+// A moving mask is supported if it is a BitMaskSpatialObject on the moving image's grid: the
+// kernels test the bit of the voxel nearest to each mapped sample.
+//
+// The numbers agree with MeanSquaresImageToImageMetricv4 using central differences
+// (UseMovingImageGradientFilter off) for axis-aligned volumes, up to float rounding. For any
+// other setup (another transform or interpolator, other masks, gradient filter on) it simply is that
+// ITK metric.
+template <typename TFixedImage, typename TMovingImage, typename TVirtualImage,
+          typename TInternalComputationValueType, typename TMetricTraits,
+          typename TMovingTransform = itk::Similarity3DTransform<double>>
+class SimilarityMeanSquaresMetric
+    : public itk::MeanSquaresImageToImageMetricv4<TFixedImage, TMovingImage, TVirtualImage,
+                                                  TInternalComputationValueType, TMetricTraits>
+{
+    public:
+        typedef SimilarityMeanSquaresMetric Self;
+        typedef itk::MeanSquaresImageToImageMetricv4<TFixedImage, TMovingImage, TVirtualImage,
+                                                     TInternalComputationValueType, TMetricTraits> Superclass;
+        typedef itk::SmartPointer<Self> Pointer;
+        typedef itk::SmartPointer<const Self> ConstPointer;
+        itkNewMacro(Self);
+        itkTypeMacro(SimilarityMeanSquaresMetric, MeanSquaresImageToImageMetricv4);
+
+        typedef typename Superclass::MeasureType MeasureType;
+        typedef typename Superclass::DerivativeType DerivativeType;
+        typedef typename TFixedImage::PixelType FixedPixelType;
+        typedef typename TMovingImage::PixelType MovingPixelType;
+        typedef TMovingTransform MovingTransformType;
+
+        MeasureType GetValue() const ITK_OVERRIDE
+        {
+            Sums sums;
+            if (!Evaluate<false>(sums)) {
+                return Superclass::GetValue();
+            }
+            DerivativeType unused;
+            return Finish(sums, false, unused);
+        }
+
+        void GetValueAndDerivative(MeasureType& value, DerivativeType& derivative) const ITK_OVERRIDE
+        {
+            Sums sums;
+            if (!Evaluate<true>(sums)) {
+                Superclass::GetValueAndDerivative(value, derivative);
+                return;
+            }
+            value = Finish(sums, true, derivative);
+        }
+
+        // Whether the last evaluation went through the specialized path
+        bool GetLastEvaluationWasFast() const { return m_LastEvaluationWasFast; }
+
+        // Threads the last evaluation ran on
+        itk::ThreadIdType GetNumberOfThreadsUsed() const ITK_OVERRIDE
+        {
+            return m_LastEvaluationWasFast ? m_NumberOfThreadsUsed : Superclass::GetNumberOfThreadsUsed();
+        }
+
+    protected:
+        SimilarityMeanSquaresMetric()
+            : m_LastEvaluationWasFast(false), m_NumberOfThreadsUsed(1), m_MovingMaskWords(nullptr),
+              m_SamplesSource(nullptr), m_SamplesTime(0)
+        {
+            // Gradients come from central differences, so skip building gradient images. The
+            // fixed one is never used by mean squares anyway.
+            this->SetUseFixedImageGradientFilter(false);
+            this->SetUseMovingImageGradientFilter(false);
+        }
+
+    private:
+        // Samples handed to the kernels at a time (sums are kept in float within a block and in
+        // double across blocks), and samples handed to a thread at a time
+        enum : size_t { BlockSize = 256, ChunkSize = 32 * 256 };
+
+        // Whether the derivative needs the sums weighted by the sample coordinates
+        static constexpr bool PointDependentJacobian = !HasConstantJacobian<TMovingTransform>::value;
+
+        // Map from a fixed point (relative to m_Reference) to a continuous index in the moving
+        // buffer, and what is needed to interpolate there. 'mask' holds the moving mask's bits,
+        // if there is one. 'lastWord' is the byte offset of the last 4 bytes of the buffer.
+        struct Mapping {
+            float matrix[3][4];
+            int32_t size[3];
+            int64_t stride[3];
+            int64_t lastWord;
+            const uint32_t* mask;
+        };
+
+        // What one thread gathers: sum and count of squared differences, then the error weighted
+        // gradient (in moving voxel units) and its products with the fixed coordinates
+        struct Sums {
+            double value = 0.0;
+            double count = 0.0;
+            double w[3] = {0.0, 0.0, 0.0};
+            double wx[3][3] = {{0.0, 0.0, 0.0}, {0.0, 0.0, 0.0}, {0.0, 0.0, 0.0}};
+
+            void Add(const Sums& other)
+            {
+                value += other.value;
+                count += other.count;
+                for (int d = 0; d < 3; ++d) {
+                    w[d] += other.w[d];
+                    for (int k = 0; k < 3; ++k) {
+                        wx[d][k] += other.wx[d][k];
+                    }
+                }
+            }
+        };
+
+        // Checks whether the specialized path applies and brings the cached samples up to date
+        bool Prepare() const
+        {
+            const auto transform = dynamic_cast<const MovingTransformType*>(this->m_MovingTransform.GetPointer());
+            const auto interpolator = dynamic_cast<const itk::LinearInterpolateImageFunction<
+                TMovingImage, TInternalComputationValueType>*>(this->m_MovingInterpolator.GetPointer());
+            const auto fixedTransform = dynamic_cast<const itk::IdentityTransform<
+                TInternalComputationValueType, TFixedImage::ImageDimension>*>(this->m_FixedTransform.GetPointer());
+            if (TFixedImage::ImageDimension != 3 || transform == nullptr || interpolator == nullptr ||
+                fixedTransform == nullptr || this->m_FixedImageMask.IsNotNull() ||
+                this->GetUseMovingImageGradientFilter() || this->m_MovingImage.IsNull() || this->m_FixedImage.IsNull()) {
+                return false;
+            }
+            m_MovingMaskWords = nullptr;
+            if (this->m_MovingImageMask.IsNotNull()) {
+                const auto mask = dynamic_cast<const BitMaskSpatialObject*>(this->m_MovingImageMask.GetPointer());
+                if (mask == nullptr || !mask->GetMask()->SharesGridWith(this->m_MovingImage.GetPointer())) {
+                    return false;
+                }
+                m_MovingMaskWords = mask->GetMask()->GetWords();
+            }
+            const auto movingSize = this->m_MovingImage->GetBufferedRegion().GetSize();
+            for (int d = 0; d < 3; ++d) {
+                if (movingSize[d] < 2 || movingSize[d] > uint64_t(std::numeric_limits<int32_t>::max())) {
+                    return false;
+                }
+            }
+
+            if (!this->m_UseFixedSampledPointSet) {
+                // Dense: every voxel of the virtual domain, which has to be the fixed image grid
+                // so that fixed values can be read straight from its buffer
+                const auto fixed = this->m_FixedImage.GetPointer();
+                if (this->GetVirtualRegion() != fixed->GetBufferedRegion() ||
+                    this->GetVirtualOrigin() != fixed->GetOrigin() ||
+                    this->GetVirtualSpacing() != fixed->GetSpacing() ||
+                    this->GetVirtualDirection() != fixed->GetDirection()) {
+                    return false;
+                }
+                const auto region = fixed->GetBufferedRegion();
+                itk::ContinuousIndex<double, 3> center;
+                for (int d = 0; d < 3; ++d) {
+                    center[d] = region.GetIndex()[d] + 0.5 * (double(region.GetSize()[d]) - 1.0);
+                }
+                fixed->TransformContinuousIndexToPhysicalPoint(center, m_Reference);
+                m_SamplesSource = nullptr;
+                return true;
+            }
+
+            const auto pointSet = this->m_FixedSampledPointSet.GetPointer();
+            if (pointSet == nullptr) {
+                return false;
+            }
+            if (pointSet == m_SamplesSource && pointSet->GetMTime() == m_SamplesTime) {
+                return true;
+            }
+
+            // New sample points: keep the ones inside the fixed image, with their fixed value,
+            // exactly as ITK would evaluate them
+            const auto& points = pointSet->GetPoints()->CastToSTLConstContainer();
+            m_Reference.Fill(0.0);
+            for (const auto& point : points) {
+                for (int d = 0; d < 3; ++d) {
+                    m_Reference[d] += point[d] / double(points.size());
+                }
+            }
+            m_SampleX.clear();
+            m_SampleY.clear();
+            m_SampleZ.clear();
+            m_SampleValue.clear();
+            for (const auto& point : points) {
+                if (!this->m_FixedInterpolator->IsInsideBuffer(point)) {
+                    continue;
+                }
+                m_SampleX.push_back(float(point[0] - m_Reference[0]));
+                m_SampleY.push_back(float(point[1] - m_Reference[1]));
+                m_SampleZ.push_back(float(point[2] - m_Reference[2]));
+                m_SampleValue.push_back(float(this->m_FixedInterpolator->Evaluate(point)));
+            }
+            m_SamplesSource = pointSet;
+            m_SamplesTime   = pointSet->GetMTime();
+            return true;
+        }
+
+        // Runs the kernels over every sample on up to GetMaximumNumberOfThreads() threads, which
+        // stay around for the next evaluation
+        template <bool TDerivative>
+        bool Evaluate(Sums& sums) const
+        {
+            m_LastEvaluationWasFast = Prepare();
+            if (!m_LastEvaluationWasFast) {
+                return false;
+            }
+
+            // Fold the transform and the moving image geometry into one affine map:
+            // c = A (M (x + r) + offset - origin) - start. The transform is affine, so M comes
+            // out of mapping the reference point and its unit steps.
+            const auto transform = static_cast<const MovingTransformType*>(this->m_MovingTransform.GetPointer());
+            const auto moving = this->m_MovingImage.GetPointer();
+            const auto& A = moving->GetPhysicalPointToIndex();
+            const auto mappedReference = transform->TransformPoint(m_Reference);
+            itk::Matrix<double, 3, 3> M;
+            for (int k = 0; k < 3; ++k) {
+                auto step = m_Reference;
+                step[k] += 1.0;
+                const auto mappedStep = transform->TransformPoint(step);
+                for (int i = 0; i < 3; ++i) {
+                    M[i][k] = mappedStep[i] - mappedReference[i];
+                }
+            }
+            const auto T = A * M;
+            const auto region = moving->GetBufferedRegion();
+            Mapping map;
+            for (int i = 0; i < 3; ++i) {
+                double translation = -double(region.GetIndex()[i]);
+                for (int j = 0; j < 3; ++j) {
+                    map.matrix[i][j] = float(T[i][j]);
+                    translation += A[i][j] * (mappedReference[j] - moving->GetOrigin()[j]);
+                }
+                map.matrix[i][3] = float(translation);
+                map.size[i] = int32_t(region.GetSize()[i]);
+            }
+            map.stride[0] = 1;
+            map.stride[1] = map.size[0];
+            map.stride[2] = int64_t(map.size[0]) * map.size[1];
+            map.lastWord = int64_t(region.GetNumberOfPixels() * sizeof(MovingPixelType)) - 4;
+            map.mask = m_MovingMaskWords;
+
+            const size_t numberOfSamples = this->m_UseFixedSampledPointSet
+                                           ? m_SampleValue.size()
+                                           : this->m_FixedImage->GetBufferedRegion().GetNumberOfPixels();
+            const size_t numberOfChunks = (numberOfSamples + ChunkSize - 1) / ChunkSize;
+            const size_t numberOfThreads = std::max<size_t>(1, std::min<size_t>(this->GetMaximumNumberOfThreads(),
+                                                                                numberOfChunks));
+            m_NumberOfThreadsUsed = itk::ThreadIdType(numberOfThreads);
+            std::vector<Sums> threadSums(numberOfThreads);
+            std::atomic<size_t> next(0);
+            m_Workers.Run(numberOfThreads, [&](const size_t t) {
+                float x[BlockSize], y[BlockSize], z[BlockSize], f[BlockSize];
+                for (size_t chunk = next++; chunk < numberOfChunks; chunk = next++) {
+                    const size_t end = std::min<size_t>(numberOfSamples, (chunk + 1) * ChunkSize);
+                    for (size_t begin = chunk * ChunkSize; begin < end; begin += BlockSize) {
+                        const size_t n = std::min<size_t>(BlockSize, end - begin);
+                        if (this->m_UseFixedSampledPointSet) {
+                            Accumulate<TDerivative>(map, &m_SampleX[begin], &m_SampleY[begin], &m_SampleZ[begin],
+                                                    &m_SampleValue[begin], n, threadSums[t]);
+                        } else {
+                            FillDenseBlock(begin, n, x, y, z, f);
+                            Accumulate<TDerivative>(map, x, y, z, f, n, threadSums[t]);
+                        }
+                    }
+                }
+            });
+            for (const auto& s : threadSums) {
+                sums.Add(s);
+            }
+            return true;
+        }
+
+        // Fixed voxel centers (relative to m_Reference) and values of voxels [begin, begin + n)
+        // of the fixed buffer
+        void FillDenseBlock(const size_t begin, const size_t n, float* x, float* y, float* z, float* f) const
+        {
+            const auto fixed  = this->m_FixedImage.GetPointer();
+            const auto region = fixed->GetBufferedRegion();
+            const auto buffer = fixed->GetBufferPointer();
+            const uint64_t sx = region.GetSize()[0];
+            const uint64_t sy = region.GetSize()[1];
+            const auto& IndexToPoint = fixed->GetIndexToPhysicalPoint();
+            double origin[3];
+            for (int d = 0; d < 3; ++d) {
+                origin[d] = fixed->GetOrigin()[d] - m_Reference[d];
+                for (int k = 0; k < 3; ++k) {
+                    origin[d] += IndexToPoint[d][k] * region.GetIndex()[k];
+                }
+            }
+            uint64_t i = begin % sx, j = (begin / sx) % sy, k = begin / (sx * sy);
+            for (size_t s = 0; s < n; ++s) {
+                x[s] = float(origin[0] + IndexToPoint[0][0] * i + IndexToPoint[0][1] * j + IndexToPoint[0][2] * k);
+                y[s] = float(origin[1] + IndexToPoint[1][0] * i + IndexToPoint[1][1] * j + IndexToPoint[1][2] * k);
+                z[s] = float(origin[2] + IndexToPoint[2][0] * i + IndexToPoint[2][1] * j + IndexToPoint[2][2] * k);
+                f[s] = float(buffer[begin + s]);
+                if (++i == sx) {
+                    i = 0;
+                    if (++j == sy) {
+                        j = 0;
+                        ++k;
+                    }
+                }
+            }
+        }
+
+        // Linear interpolation of the moving buffer at continuous index c, clamped to the edge
+        // voxels the way LinearInterpolateImageFunction treats the half voxel border
+        static float Interpolate(const MovingPixelType* buffer, const Mapping& map, const float c[3])
+        {
+            int64_t offset = 0;
+            float t[3];
+            for (int d = 0; d < 3; ++d) {
+                const float clamped = std::min(std::max(c[d], 0.0f), float(map.size[d] - 1));
+                const int32_t base  = std::min(int32_t(clamped), map.size[d] - 2);
+                t[d] = clamped - float(base);
+                offset += base * map.stride[d];
+            }
+            const MovingPixelType* p = buffer + offset;
+            const int64_t sy = map.stride[1], sz = map.stride[2];
+            const float v00 = float(p[0])       + t[0] * (float(p[1])           - float(p[0]));
+            const float v10 = float(p[sy])      + t[0] * (float(p[sy + 1])      - float(p[sy]));
+            const float v01 = float(p[sz])      + t[0] * (float(p[sz + 1])      - float(p[sz]));
+            const float v11 = float(p[sy + sz]) + t[0] * (float(p[sy + sz + 1]) - float(p[sy + sz]));
+            const float v0  = v00 + t[1] * (v10 - v00);
+            const float v1  = v01 + t[1] * (v11 - v01);
+            return v0 + t[2] * (v1 - v0);
+        }
+
+        template <bool TDerivative>
+        static void AccumulateScalar(const MovingPixelType* buffer, const Mapping& map, const float* x,
+                                     const float* y, const float* z, const float* f, const size_t n, Sums& sums)
+        {
+            for (size_t s = 0; s < n; ++s) {
+                float c[3];
+                bool valid = true;
+                for (int d = 0; d < 3; ++d) {
+                    c[d] = map.matrix[d][0] * x[s] + map.matrix[d][1] * y[s] + map.matrix[d][2] * z[s] + map.matrix[d][3];
+                    valid = valid && c[d] >= -0.5f && c[d] < float(map.size[d]) - 0.5f;
+                }
+                if (!valid) {
+                    continue;
+                }
+                if (map.mask != nullptr) {
+                    // c is within half a voxel of the grid, so the nearest voxel is on it
+                    int64_t offset = 0;
+                    for (int d = 0; d < 3; ++d) {
+                        offset += std::min(int64_t(std::floor(c[d] + 0.5f)), int64_t(map.size[d] - 1)) * map.stride[d];
+                    }
+                    if (!((map.mask[offset >> 5] >> (offset & 31)) & 1u)) {
+                        continue;
+                    }
+                }
+                const float diff = f[s] - Interpolate(buffer, map, c);
+                sums.value += double(diff) * diff;
+                sums.count += 1.0;
+                if (!TDerivative) {
+                    continue;
+                }
+                const float position[3] = {x[s], y[s], z[s]};
+                for (int d = 0; d < 3; ++d) {
+                    if (c[d] < 0.5f || c[d] >= float(map.size[d]) - 1.5f) {
+                        continue;
+                    }
+                    float cm[3] = {c[0], c[1], c[2]};
+                    float cp[3] = {c[0], c[1], c[2]};
+                    cm[d] -= 1.0f;
+                    cp[d] += 1.0f;
+                    const float w = diff * (Interpolate(buffer, map, cp) - Interpolate(buffer, map, cm));
+                    sums.w[d] += w;
+                    if (!PointDependentJacobian) {
+                        continue;
+                    }
+                    for (int k = 0; k < 3; ++k) {
+                        sums.wx[d][k] += double(w) * position[k];
+                    }
+                }
+            }
+        }
+
+#if defined(__AVX2__) && defined(__FMA__)
+        // 8 moving pixels at once. Float buffers are gathered directly. For 8 and 16-bit ones the
+        // 4 bytes starting at the pixel are gathered and the pixel masked out of them; near the end
+        // of the buffer the last 4 bytes are gathered instead and the pixel shifted out, so nothing
+        // past the buffer is read. Any other pixel type is loaded lane by lane.
+        static __m256 Gather(const float* buffer, const Mapping&, const __m256i index)
+        {
+            return _mm256_i32gather_ps(buffer, index, 4);
+        }
+        template <typename TPixel>
+        static __m256 GatherNarrow(const TPixel* buffer, const Mapping& map, const __m256i index)
+        {
+            const __m256i bytes = _mm256_mullo_epi32(index, _mm256_set1_epi32(sizeof(TPixel)));
+            const __m256i start = _mm256_min_epi32(bytes, _mm256_set1_epi32(int32_t(map.lastWord)));
+            const __m256i word  = _mm256_i32gather_epi32(reinterpret_cast<const int*>(buffer), start, 1);
+            const __m256i shift = _mm256_slli_epi32(_mm256_sub_epi32(bytes, start), 3);
+            const __m256i mask  = _mm256_set1_epi32((1 << (8 * sizeof(TPixel))) - 1);
+            return _mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srlv_epi32(word, shift), mask));
+        }
+        static __m256 Gather(const uint8_t* buffer, const Mapping& map, const __m256i index)
+        {
+            return GatherNarrow(buffer, map, index);
+        }
+        static __m256 Gather(const uint16_t* buffer, const Mapping& map, const __m256i index)
+        {
+            return GatherNarrow(buffer, map, index);
+        }
+        template <typename TPixel>
+        static __m256 Gather(const TPixel* buffer, const Mapping&, const __m256i index)
+        {
+            alignas(32) int32_t offsets[8];
+            alignas(32) float values[8];
+            _mm256_store_si256(reinterpret_cast<__m256i*>(offsets), index);
+            for (int i = 0; i < 8; ++i) {
+                values[i] = float(buffer[offsets[i]]);
+            }
+            return _mm256_load_ps(values);
+        }
+
+        // All-ones lanes where the moving mask bit of the voxel nearest to c is set. Lanes off the
+        // grid are clamped onto it; they are invalid anyway.
+        static __m256 MaskBits(const Mapping& map, const __m256 c[3])
+        {
+            __m256i offset = _mm256_setzero_si256();
+            for (int d = 0; d < 3; ++d) {
+                const __m256i nearest = _mm256_cvttps_epi32(_mm256_floor_ps(_mm256_add_ps(c[d], _mm256_set1_ps(0.5f))));
+                const __m256i clamped = _mm256_min_epi32(_mm256_max_epi32(nearest, _mm256_setzero_si256()),
+                                                         _mm256_set1_epi32(map.size[d] - 1));
+                offset = _mm256_add_epi32(offset, _mm256_mullo_epi32(clamped, _mm256_set1_epi32(int32_t(map.stride[d]))));
+            }
+            const __m256i word = _mm256_i32gather_epi32(reinterpret_cast<const int*>(map.mask),
+                                                        _mm256_srli_epi32(offset, 5), 4);
+            const __m256i bit  = _mm256_and_si256(_mm256_srlv_epi32(word, _mm256_and_si256(offset, _mm256_set1_epi32(31))),
+                                                  _mm256_set1_epi32(1));
+            return _mm256_castsi256_ps(_mm256_cmpeq_epi32(bit, _mm256_set1_epi32(1)));
+        }
+
+        static __m256 Lerp(const __m256 a, const __m256 b, const __m256 t)
+        {
+            return _mm256_fmadd_ps(t, _mm256_sub_ps(b, a), a);
+        }
+
+        // Interpolate() for 8 continuous indices
+        static __m256 Interpolate(const MovingPixelType* buffer, const Mapping& map, const __m256 c[3])
+        {
+            __m256i offset = _mm256_setzero_si256();
+            __m256 t[3];
+            for (int d = 0; d < 3; ++d) {
+                const __m256 clamped = _mm256_min_ps(_mm256_max_ps(c[d], _mm256_setzero_ps()),
+                                                     _mm256_set1_ps(float(map.size[d] - 1)));
+                const __m256i base   = _mm256_min_epi32(_mm256_cvttps_epi32(clamped), _mm256_set1_epi32(map.size[d] - 2));
+                t[d] = _mm256_sub_ps(clamped, _mm256_cvtepi32_ps(base));
+                offset = _mm256_add_epi32(offset, _mm256_mullo_epi32(base, _mm256_set1_epi32(int32_t(map.stride[d]))));
+            }
+            const __m256i sy = _mm256_set1_epi32(int32_t(map.stride[1]));
+            const __m256i sz = _mm256_set1_epi32(int32_t(map.stride[2]));
+            const __m256i one = _mm256_set1_epi32(1);
+            const __m256i o00 = offset;
+            const __m256i o10 = _mm256_add_epi32(offset, sy);
+            const __m256i o01 = _mm256_add_epi32(offset, sz);
+            const __m256i o11 = _mm256_add_epi32(o10, sz);
+            const __m256 v00 = Lerp(Gather(buffer, map, o00), Gather(buffer, map, _mm256_add_epi32(o00, one)), t[0]);
+            const __m256 v10 = Lerp(Gather(buffer, map, o10), Gather(buffer, map, _mm256_add_epi32(o10, one)), t[0]);
+            const __m256 v01 = Lerp(Gather(buffer, map, o01), Gather(buffer, map, _mm256_add_epi32(o01, one)), t[0]);
+            const __m256 v11 = Lerp(Gather(buffer, map, o11), Gather(buffer, map, _mm256_add_epi32(o11, one)), t[0]);
+            return Lerp(Lerp(v00, v10, t[1]), Lerp(v01, v11, t[1]), t[2]);
+        }
+
+        static double HorizontalSum(const __m256 v)
+        {
+            alignas(32) float lanes[8];
+            _mm256_store_ps(lanes, v);
+            double sum = 0.0;
+            for (const float lane : lanes) {
+                sum += lane;
+            }
+            return sum;
+        }
+
+        template <bool TDerivative>
+        static size_t AccumulateSimd(const MovingPixelType* buffer, const Mapping& map, const float* x,
+                                     const float* y, const float* z, const float* f, const size_t n, Sums& sums)
+        {
+            const __m256 half = _mm256_set1_ps(0.5f);
+            const __m256 one  = _mm256_set1_ps(1.0f);
+            __m256 value = _mm256_setzero_ps(), count = _mm256_setzero_ps();
+            __m256 w[3], wx[3][3];
+            for (int d = 0; d < 3; ++d) {
+                w[d] = _mm256_setzero_ps();
+                for (int k = 0; k < 3; ++k) {
+                    wx[d][k] = _mm256_setzero_ps();
+                }
+            }
+
+            size_t s = 0;
+            for (; s + 8 <= n; s += 8) {
+                const __m256 position[3] = {_mm256_loadu_ps(x + s), _mm256_loadu_ps(y + s), _mm256_loadu_ps(z + s)};
+                __m256 c[3];
+                __m256 valid = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+                for (int d = 0; d < 3; ++d) {
+                    c[d] = _mm256_fmadd_ps(_mm256_set1_ps(map.matrix[d][0]), position[0],
+                           _mm256_fmadd_ps(_mm256_set1_ps(map.matrix[d][1]), position[1],
+                           _mm256_fmadd_ps(_mm256_set1_ps(map.matrix[d][2]), position[2],
+                                           _mm256_set1_ps(map.matrix[d][3]))));
+                    valid = _mm256_and_ps(valid, _mm256_cmp_ps(c[d], _mm256_set1_ps(-0.5f), _CMP_GE_OQ));
+                    valid = _mm256_and_ps(valid, _mm256_cmp_ps(c[d], _mm256_set1_ps(float(map.size[d]) - 0.5f),
+                                                               _CMP_LT_OQ));
+                }
+                if (map.mask != nullptr) {
+                    valid = _mm256_and_ps(valid, MaskBits(map, c));
+                }
+                const __m256 diff = _mm256_and_ps(valid, _mm256_sub_ps(_mm256_loadu_ps(f + s),
+                                                                      Interpolate(buffer, map, c)));
+                value = _mm256_fmadd_ps(diff, diff, value);
+                count = _mm256_add_ps(count, _mm256_and_ps(valid, one));
+                if (!TDerivative) {
+                    continue;
+                }
+                for (int d = 0; d < 3; ++d) {
+                    const __m256 inside = _mm256_and_ps(
+                        _mm256_cmp_ps(c[d], half, _CMP_GE_OQ),
+                        _mm256_cmp_ps(c[d], _mm256_set1_ps(float(map.size[d]) - 1.5f), _CMP_LT_OQ));
+                    __m256 cm[3] = {c[0], c[1], c[2]};
+                    __m256 cp[3] = {c[0], c[1], c[2]};
+                    cm[d] = _mm256_sub_ps(c[d], one);
+                    cp[d] = _mm256_add_ps(c[d], one);
+                    const __m256 difference = _mm256_sub_ps(Interpolate(buffer, map, cp), Interpolate(buffer, map, cm));
+                    const __m256 weighted = _mm256_and_ps(inside, _mm256_mul_ps(diff, difference));
+                    w[d] = _mm256_add_ps(w[d], weighted);
+                    if (!PointDependentJacobian) {
+                        continue;
+                    }
+                    for (int k = 0; k < 3; ++k) {
+                        wx[d][k] = _mm256_fmadd_ps(weighted, position[k], wx[d][k]);
+                    }
+                }
+            }
+
+            sums.value += HorizontalSum(value);
+            sums.count += HorizontalSum(count);
+            for (int d = 0; d < 3; ++d) {
+                sums.w[d] += HorizontalSum(w[d]);
+                for (int k = 0; k < 3; ++k) {
+                    sums.wx[d][k] += HorizontalSum(wx[d][k]);
+                }
+            }
+            return s;
+        }
+#endif
+
+        // Adds n samples to 'sums', 8 at a time where possible and the rest one by one
+        template <bool TDerivative>
+        void Accumulate(const Mapping& map, const float* x, const float* y, const float* z, const float* f,
+                        const size_t n, Sums& sums) const
+        {
+            const MovingPixelType* buffer = this->m_MovingImage->GetBufferPointer();
+            Sums block;
+            size_t done = 0;
+#if defined(__AVX2__) && defined(__FMA__)
+            // The vector kernel addresses the buffer with 32-bit byte offsets
+            if (map.lastWord + 8 < int64_t(std::numeric_limits<int32_t>::max())) {
+                done = AccumulateSimd<TDerivative>(buffer, map, x, y, z, f, n, block);
+            }
+#endif
+            AccumulateScalar<TDerivative>(buffer, map, x + done, y + done, z + done, f + done, n - done, block);
+            sums.Add(block);
+        }
+
+        // Turns the sums into the value and, if asked for, the derivative ITK's mean squares
+        // metric returns: 2/N sum (f - m) grad(m) J, with grad(m) in physical units
+        MeasureType Finish(const Sums& sums, const bool withDerivative, DerivativeType& derivative) const
+        {
+            const auto numberOfParameters = this->GetNumberOfParameters();
+            if (withDerivative) {
+                derivative.SetSize(numberOfParameters);
+                derivative.Fill(0.0);
+            }
+            this->m_NumberOfValidPoints = itk::SizeValueType(sums.count);
+            if (sums.count < 1.0) {
+                itkWarningMacro("No valid points were found during metric evaluation.");
+                this->m_Value = std::numeric_limits<MeasureType>::max();
+                return this->m_Value;
+            }
+            this->m_Value = sums.value / sums.count;
+            if (!withDerivative) {
+                return this->m_Value;
+            }
+
+            // The Jacobian is linear in the point: J(x + r) = J(r) + sum_k x_k (J(r + e_k) - J(r)),
+            // and for a constant one only J(r) is needed
+            const auto transform = static_cast<const MovingTransformType*>(this->m_MovingTransform.GetPointer());
+            typename MovingTransformType::JacobianType J0, Jk[3];
+            transform->ComputeJacobianWithRespectToParameters(m_Reference, J0);
+            for (int k = 0; k < 3 && PointDependentJacobian; ++k) {
+                auto point = m_Reference;
+                point[k] += 1.0;
+                transform->ComputeJacobianWithRespectToParameters(point, Jk[k]);
+                Jk[k] -= J0;
+            }
+
+            // The kernels sum (f - m) (m(c + e) - m(c - e)), i.e. 2 (f - m) times the gradient in
+            // voxel units. The physical gradient is A^T times that, with A the moving image's
+            // point to index matrix.
+            const auto& A = this->m_MovingImage->GetPhysicalPointToIndex();
+            for (int d = 0; d < 3; ++d) {
+                double v = 0.0, vx[3] = {0.0, 0.0, 0.0};
+                for (int e = 0; e < 3; ++e) {
+                    v += A[e][d] * sums.w[e];
+                    for (int k = 0; k < 3; ++k) {
+                        vx[k] += A[e][d] * sums.wx[e][k];
+                    }
+                }
+                for (unsigned int p = 0; p < numberOfParameters; ++p) {
+                    double component = v * J0(d, p);
+                    for (int k = 0; k < 3 && PointDependentJacobian; ++k) {
+                        component += vx[k] * Jk[k](d, p);
+                    }
+                    derivative[p] += component / sums.count;
+                }
+            }
+            return this->m_Value;
+        }
+
+        mutable bool m_LastEvaluationWasFast;
+        mutable itk::ThreadIdType m_NumberOfThreadsUsed;
+
+        // Bits of the moving mask, if the kernels test it
+        mutable const uint32_t* m_MovingMaskWords;
+
+        // Point the sample coordinates are relative to, keeping them small enough for float
+        mutable typename TFixedImage::PointType m_Reference;
+
+        // Sampled point set the arrays below were built from
+        mutable const void* m_SamplesSource;
+        mutable itk::ModifiedTimeType m_SamplesTime;
+        mutable std::vector<float> m_SampleX;
+        mutable std::vector<float> m_SampleY;
+        mutable std::vector<float> m_SampleZ;
+        mutable std::vector<float> m_SampleValue;
+
+        mutable WorkerPool m_Workers;
+};
@@ -0,0 +1,58 @@
+#pragma once
+
+#include "itkMatrixOffsetTransformBase.h"
+
+
+// Translation on top of a fixed linear map about a fixed center: x -> M (x - c) + c + t, with
+// only t as parameters. With M the identity this is itk::TranslationTransform; 'register' uses it
+// for the translation stage of a staged registration, where M holds whatever rotation and scale
+// the registration started from so that they survive the stage.
+template <typename TParametersValueType = double>
+class FixedMatrixTranslationTransform : public itk::MatrixOffsetTransformBase<TParametersValueType, 3, 3>
+{
+    public:
+        typedef FixedMatrixTranslationTransform Self;
+        typedef itk::MatrixOffsetTransformBase<TParametersValueType, 3, 3> Superclass;
+        typedef itk::SmartPointer<Self> Pointer;
+        typedef itk::SmartPointer<const Self> ConstPointer;
+        itkNewMacro(Self);
+        itkTypeMacro(FixedMatrixTranslationTransform, MatrixOffsetTransformBase);
+
+        typedef typename Superclass::ParametersType ParametersType;
+        typedef typename Superclass::JacobianType JacobianType;
+        typedef typename Superclass::InputPointType InputPointType;
+        typedef typename Superclass::OutputVectorType OutputVectorType;
+
+        void SetParameters(const ParametersType& parameters) ITK_OVERRIDE
+        {
+            if (&parameters != &this->m_Parameters) {
+                this->m_Parameters = parameters;
+            }
+            OutputVectorType translation;
+            for (unsigned int d = 0; d < 3; ++d) {
+                translation[d] = parameters[d];
+            }
+            this->SetTranslation(translation);
+        }
+
+        const ParametersType& GetParameters() const ITK_OVERRIDE
+        {
+            for (unsigned int d = 0; d < 3; ++d) {
+                this->m_Parameters[d] = this->GetTranslation()[d];
+            }
+            return this->m_Parameters;
+        }
+
+        // The identity, wherever the point is
+        void ComputeJacobianWithRespectToParameters(const InputPointType&, JacobianType& jacobian) const ITK_OVERRIDE
+        {
+            jacobian.SetSize(3, 3);
+            jacobian.Fill(0.0);
+            for (unsigned int d = 0; d < 3; ++d) {
+                jacobian(d, d) = 1.0;
+            }
+        }
+
+    protected:
+        FixedMatrixTranslationTransform() : Superclass(3) {};
+};
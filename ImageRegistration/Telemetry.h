@@ -0,0 +1,270 @@
+#pragma once
+
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <mutex>
+#include <sstream>
+#include <string>
+
+#include "itkCommand.h"
+
+
+// Escapes a string for use inside a JSON string literal
+inline std::string jsonEscape(const std::string& s)
+{
+    std::string escaped;
+    for (const char c : s) {
+        if (c == '"' || c == '\\') {
+            escaped += '\\';
+            escaped += c;
+        } else if (c == '\n') {
+            escaped += "\\n";
+        } else if (c == '\t') {
+            escaped += "\\t";
+        } else if (uint8_t(c) >= 0x20) {
+            escaped += c;
+        }
+    }
+    return escaped;
+}
+
+// 'value' as a JSON number that reads back as the same double, or null if it isn't finite (JSON
+// has no NaN or infinity)
+inline std::string jsonNumber(const double value)
+{
+    if (!std::isfinite(value)) {
+        return "null";
+    }
+    std::ostringstream number;
+    number.precision(std::numeric_limits<double>::max_digits10);
+    number << value;
+    return number.str();
+}
+
+// JSON lines sink shared by every registration in the process. Writes standard output unless
+// opened on a file. Records are written whole under a lock, without flushing each line.
+class TelemetryLog
+{
+    public:
+        TelemetryLog() : m_Stream(&std::cout) {}
+
+        bool Open(const std::string& filename)
+        {
+            m_File.open(filename);
+            m_Stream = &m_File;
+            return m_File.good();
+        }
+
+        void Write(const std::string& record)
+        {
+            std::lock_guard<std::mutex> lock(m_Mutex);
+            *m_Stream << record << '\n';
+        }
+
+        void Flush()
+        {
+            std::lock_guard<std::mutex> lock(m_Mutex);
+            m_Stream->flush();
+        }
+
+    private:
+        std::ofstream m_File;
+        std::ostream* m_Stream;
+        std::mutex m_Mutex;
+};
+
+// What a TimedMetric measured over some number of evaluations
+struct MetricTiming {
+    double seconds = 0.0;
+    uint64_t evaluations = 0;
+    uint64_t validPoints = 0;   // of the last evaluation
+    uint32_t threads = 0;
+};
+
+// The timing side of TimedMetric, so observers don't need to know the metric type
+class MetricTimer
+{
+    public:
+        // Timing since the last call, which starts a new interval
+        MetricTiming TakeTiming() const
+        {
+            const auto timing = m_Interval;
+            m_Interval.seconds = 0.0;
+            m_Interval.evaluations = 0;
+            return timing;
+        }
+
+    protected:
+        void Record(const std::chrono::steady_clock::time_point start, const uint64_t validPoints,
+                    const uint32_t threads) const
+        {
+            const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+            m_Interval.seconds += elapsed.count();
+            m_Interval.evaluations++;
+            m_Interval.validPoints = validPoints;
+            m_Interval.threads = threads;
+        }
+
+    private:
+        mutable MetricTiming m_Interval;
+};
+
+// Any v4 image metric, timing its evaluations
+template <typename TMetric>
+class TimedMetric : public TMetric, public MetricTimer
+{
+    public:
+        typedef TimedMetric Self;
+        typedef TMetric Superclass;
+        typedef itk::SmartPointer<Self> Pointer;
+        itkNewMacro(Self);
+        itkTypeMacro(TimedMetric, ImageToImageMetricv4);
+
+        typedef typename Superclass::MeasureType MeasureType;
+        typedef typename Superclass::DerivativeType DerivativeType;
+
+        MeasureType GetValue() const ITK_OVERRIDE
+        {
+            const auto start = std::chrono::steady_clock::now();
+            const auto value = Superclass::GetValue();
+            Record(start, this->GetNumberOfValidPoints(), this->GetNumberOfThreadsUsed());
+            return value;
+        }
+
+        void GetValueAndDerivative(MeasureType& value, DerivativeType& derivative) const ITK_OVERRIDE
+        {
+            const auto start = std::chrono::steady_clock::now();
+            Superclass::GetValueAndDerivative(value, derivative);
+            Record(start, this->GetNumberOfValidPoints(), this->GetNumberOfThreadsUsed());
+        }
+
+    protected:
+        TimedMetric() {};
+};
+
+// Writes one JSON line per iteration of a v4 gradient descent optimizer: wall time and metric
+// time since the previous iteration, metric evaluations, valid samples, the (scaled) step taken,
+// learning rate and metric threads. 'fields' (JSON members, each followed by ", ") start every
+// record to tell runs apart. Summary() writes the record for the whole optimization. Numbers are
+// written with enough digits to read back exactly, non-finite ones as null.
+template <typename TOptimizer>
+class TelemetryObserver : public itk::Command
+{
+    public:
+        typedef TelemetryObserver Self;
+        typedef itk::Command Superclass;
+        typedef itk::SmartPointer<Self> Pointer;
+        itkNewMacro(Self);
+
+    protected:
+        TelemetryObserver()
+            : m_Log(nullptr), m_Timer(nullptr), m_Start(std::chrono::steady_clock::now()), m_LastIteration(m_Start) {};
+
+    public:
+        void Configure(TelemetryLog* log, const MetricTimer* timer, const std::string& fields)
+        {
+            m_Log    = log;
+            m_Timer  = timer;
+            m_Fields = fields;
+        }
+
+        void Execute(itk::Object* caller, const itk::EventObject & event)
+        {
+            Execute((const itk::Object*) caller, event);
+        }
+        void Execute(const itk::Object * object, const itk::EventObject & event)
+        {
+            const auto optimizer = static_cast<const TOptimizer*>(object);
+            if (itk::StartEvent().CheckEvent(&event)) {
+                Start(optimizer->GetCurrentPosition());
+                return;
+            }
+            if (!itk::IterationEvent().CheckEvent(&event)) {
+                return;
+            }
+            const auto now = std::chrono::steady_clock::now();
+            const std::chrono::duration<double, std::milli> elapsed = now - m_LastIteration;
+            m_LastIteration = now;
+            const auto timing = m_Timer != nullptr ? m_Timer->TakeTiming() : MetricTiming();
+            m_MetricSeconds += timing.seconds;
+            m_Evaluations   += timing.evaluations;
+
+            const auto& position = optimizer->GetCurrentPosition();
+            const auto& scales   = optimizer->GetScales();
+            double step = 0.0;
+            if (m_LastPosition.GetSize() == position.GetSize()) {
+                for (unsigned int p = 0; p < position.GetSize(); ++p) {
+                    const double scale = p < scales.GetSize() ? scales[p] : 1.0;
+                    step += std::pow(scale * (position[p] - m_LastPosition[p]), 2);
+                }
+            }
+            m_LastPosition = position;
+
+            std::ostringstream record;
+            record.precision(std::numeric_limits<double>::max_digits10);
+            record << "{" << m_Fields << "\"event\": \"iteration\", "
+                   << "\"iteration\": " << optimizer->GetCurrentIteration() << ", "
+                   << "\"value\": " << jsonNumber(optimizer->GetValue()) << ", "
+                   << "\"wall_ms\": " << elapsed.count() << ", "
+                   << "\"metric_ms\": " << 1000.0 * timing.seconds << ", "
+                   << "\"evaluations\": " << timing.evaluations << ", "
+                   << "\"valid_points\": " << timing.validPoints << ", "
+                   << "\"step_length\": " << jsonNumber(std::sqrt(step)) << ", "
+                   << "\"learning_rate\": " << jsonNumber(optimizer->GetLearningRate()) << ", "
+                   << "\"threads\": " << timing.threads << ", "
+                   << "\"position\": [";
+            for (unsigned int p = 0; p < position.GetSize(); ++p) {
+                record << (p > 0 ? ", " : "") << jsonNumber(position[p]);
+            }
+            record << "]}";
+            m_Log->Write(record.str());
+        }
+
+        // Restart the clocks, e.g. right before StartOptimization() in case the optimizer
+        // doesn't announce its start
+        void Start(const typename TOptimizer::ParametersType& position)
+        {
+            m_Start = m_LastIteration = std::chrono::steady_clock::now();
+            m_LastPosition = position;
+            m_MetricSeconds = 0.0;
+            m_Evaluations = 0;
+            if (m_Timer != nullptr) {
+                m_Timer->TakeTiming();
+            }
+        }
+
+        // Record for the whole run: iterations, final value, wall and metric time, stop reason
+        void Summary(const TOptimizer* optimizer, const std::string& event = "summary")
+        {
+            if (m_Timer != nullptr) {
+                const auto timing = m_Timer->TakeTiming();
+                m_MetricSeconds += timing.seconds;
+                m_Evaluations   += timing.evaluations;
+            }
+            const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - m_Start;
+            std::ostringstream record;
+            record.precision(std::numeric_limits<double>::max_digits10);
+            record << "{" << m_Fields << "\"event\": \"" << event << "\", "
+                   << "\"iterations\": " << optimizer->GetCurrentIteration() << ", "
+                   << "\"value\": " << jsonNumber(optimizer->GetValue()) << ", "
+                   << "\"seconds\": " << elapsed.count() << ", "
+                   << "\"metric_seconds\": " << m_MetricSeconds << ", "
+                   << "\"evaluations\": " << m_Evaluations << ", "
+                   << "\"stop\": \"" << jsonEscape(optimizer->GetStopConditionDescription()) << "\"}";
+            m_Log->Write(record.str());
+        }
+
+    private:
+        TelemetryLog* m_Log;
+        const MetricTimer* m_Timer;
+        std::string m_Fields;
+        std::chrono::steady_clock::time_point m_Start;
+        std::chrono::steady_clock::time_point m_LastIteration;
+        typename TOptimizer::ParametersType m_LastPosition;
+        double m_MetricSeconds = 0.0;
+        uint64_t m_Evaluations = 0;
+};
@@ -0,0 +1,121 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <string>
+
+#include "itkBinShrinkImageFilter.h"
+#include "itkFFTNormalizedCorrelationImageFilter.h"
+#include "itkImage.h"
+#include "itkImageFileReader.h"
+#include "itkMinimumMaximumImageCalculator.h"
+#include "itkStreamingImageFilter.h"
+#include "MappedImage.h"
+
+
+// Finds where a small volume sits inside a large one, up to a translation, by normalized cross
+// correlation computed with FFTs (FFTW if ITK was built with it, otherwise VNL) on block averaged
+// copies of both. Meant for the initial placement of a moving sub-volume, so the optimizer
+// starts close instead of walking there.
+using TLocalizerImage = itk::Image<float, 3>;
+
+// Block averaging factors that bring 'spacing' to about 'targetSpacing'
+inline itk::FixedArray<unsigned int, 3> localizerShrinkFactors(const itk::Vector<double, 3>& spacing,
+                                                               const itk::Vector<double, 3>& targetSpacing)
+{
+    itk::FixedArray<unsigned int, 3> factors;
+    for (int d = 0; d < 3; ++d) {
+        factors[d] = std::max(1u, static_cast<unsigned int>(std::lround(targetSpacing[d] / spacing[d])));
+    }
+    return factors;
+}
+
+// Block averaged float copy of 'image' at about 'targetSpacing'
+template <typename TImage>
+TLocalizerImage::Pointer localizerImage(const TImage* image, const itk::Vector<double, 3>& targetSpacing)
+{
+    auto shrink = itk::BinShrinkImageFilter<TImage, TLocalizerImage>::New();
+    shrink->SetInput(image);
+    shrink->SetShrinkFactors(localizerShrinkFactors(image->GetSpacing(), targetSpacing));
+    shrink->Update();
+    TLocalizerImage::Pointer output = shrink->GetOutput();
+    output->DisconnectPipeline();
+    return output;
+}
+
+// Block averaged float copy of the volume in 'filename', 'shrinkFactor' voxels to a block along
+// each axis. The volume is streamed through in 'streamDivisions' slabs, so it never has to fit
+// in memory at full resolution (if its file format can be read piecewise). An uncompressed
+// MetaImage is mapped and read through once instead.
+template <typename TPixel>
+TLocalizerImage::Pointer readLocalizerImage(const std::string& filename, const unsigned int shrinkFactor,
+                                            const unsigned int streamDivisions)
+{
+    using TImage = itk::Image<TPixel, 3>;
+    auto shrink = itk::BinShrinkImageFilter<TImage, TLocalizerImage>::New();
+    const auto mapped = mapMetaImage<TImage>(filename, MappedAccess::Sequential);
+    auto reader = itk::ImageFileReader<TImage>::New();
+    if (mapped) {
+        shrink->SetInput(mapped);
+    } else {
+        reader->SetFileName(filename);
+        shrink->SetInput(reader->GetOutput());
+    }
+    shrink->SetShrinkFactors(shrinkFactor);
+    auto streamer = itk::StreamingImageFilter<TLocalizerImage, TLocalizerImage>::New();
+    streamer->SetInput(shrink->GetOutput());
+    streamer->SetNumberOfStreamDivisions(streamDivisions);
+    streamer->Update();
+    TLocalizerImage::Pointer output = streamer->GetOutput();
+    output->DisconnectPipeline();
+    return output;
+}
+
+// Vertex offset of the parabola through (-1, a), (0, b), (1, c), for sub-voxel peaks
+inline double parabolicPeakOffset(const double a, const double b, const double c)
+{
+    const double curvature = a - 2.0 * b + c;
+    return curvature < 0.0 ? std::max(-0.5, std::min(0.5, 0.5 * (a - c) / curvature)) : 0.0;
+}
+
+// Where 'moving' best matches inside 'fixed' (both localizer images at the same spacing). Only
+// placements where at least 'requiredOverlap' of the largest possible overlap is inside both
+// count. Returns the physical offset to add to a moving point to get the fixed point it lies
+// on, and the correlation at the peak in 'correlation'.
+inline itk::Vector<double, 3> locateTranslation(const TLocalizerImage* fixed, const TLocalizerImage* moving,
+                                                const double requiredOverlap, double& correlation)
+{
+    auto ncc = itk::FFTNormalizedCorrelationImageFilter<TLocalizerImage, TLocalizerImage>::New();
+    ncc->SetFixedImage(fixed);
+    ncc->SetMovingImage(moving);
+    ncc->SetRequiredFractionOfOverlappingPixels(requiredOverlap);
+    ncc->Update();
+    const auto map = ncc->GetOutput();
+
+    auto peak = itk::MinimumMaximumImageCalculator<TLocalizerImage>::New();
+    peak->SetImage(map);
+    peak->ComputeMaximum();
+    const auto peakIndex = peak->GetIndexOfMaximum();
+    correlation = peak->GetMaximum();
+
+    // The correlation map is indexed by where the last moving voxel lands in the fixed image
+    const auto mapRegion    = map->GetLargestPossibleRegion();
+    const auto fixedRegion  = fixed->GetLargestPossibleRegion();
+    const auto movingRegion = moving->GetLargestPossibleRegion();
+    itk::ContinuousIndex<double, 3> firstMovingVoxel;
+    for (int d = 0; d < 3; ++d) {
+        double refined = double(peakIndex[d]);
+        auto before = peakIndex, after = peakIndex;
+        before[d] -= 1;
+        after[d]  += 1;
+        if (mapRegion.IsInside(before) && mapRegion.IsInside(after)) {
+            refined += parabolicPeakOffset(map->GetPixel(before), map->GetPixel(peakIndex), map->GetPixel(after));
+        }
+        firstMovingVoxel[d] = fixedRegion.GetIndex()[d] + (refined - mapRegion.GetIndex()[d])
+                              - (double(movingRegion.GetSize()[d]) - 1.0);
+    }
+    TLocalizerImage::PointType fixedPoint, movingPoint;
+    fixed->TransformContinuousIndexToPhysicalPoint(firstMovingVoxel, fixedPoint);
+    moving->TransformIndexToPhysicalPoint(movingRegion.GetIndex(), movingPoint);
+    return fixedPoint - movingPoint;
+}
@@ -1,144 +1,126 @@
+#include <atomic>
 #include <cmath>
+#include <fstream>
+#include <limits>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <type_traits>
 
-// Everything else for this application
-#include "itkRegionOfInterestImageFilter.h"
-#include "VolumeRegistration.h"
+#include "itkImageRegionIteratorWithIndex.h"
 
+// Everything else for this application; the registration itself is in the rigidreg library
+#include "RigidRegistration.h"
 
-int main(int argc, char *argv[])
+
+// Reads the fixed volume, or only 'regionOfInterest' of it if given, and builds its pyramid.
+// 'fixedReader' must already have read its output information. An uncompressed MetaImage is
+// mapped instead of read: the whole volume is then used in place, and of a region only the pages
+// it covers are ever read.
+template <typename TPixel>
+FixedPyramid<TPixel> readFixedPyramid(TFixedReader<TPixel>* fixedReader, const typename TFixedImage<TPixel>::RegionType* regionOfInterest,
+                                      const RegistrationOptions& opts)
 {
-    if(argc < 3) {
-        std::cerr << "Missing Parameters " << std::endl;
-        std::cerr << "Usage: " << std::endl;
-        std::cerr << "    " << argv[0]
-                  << " fixedImageFile movingImageFile" << std::endl; 
-        return EXIT_FAILURE;
+    using TFixed = TFixedImage<TPixel>;
+    auto header = TFixed::New();
+    header->CopyInformation(fixedReader->GetOutput());
+
+    const auto mapped = mapMetaImage<TFixed>(opts.fixedFilename,
+                                             regionOfInterest ? MappedAccess::Sparse : MappedAccess::Whole);
+    typename TFixed::Pointer fixedImage;
+    if (regionOfInterest) {
+        std::cout << "Region start = " << regionOfInterest->GetIndex() << std::endl;
+        std::cout << "Region size  = " << regionOfInterest->GetSize() << std::endl;
+        fixedImage = mapped ? extractRegion<TFixed>(mapped, *regionOfInterest)
+                            : readRegion<TFixed>(fixedReader, *regionOfInterest);
+    } else if (mapped) {
+        fixedImage = mapped;
+    } else {
+        fixedReader->Update();
+        fixedImage = fixedReader->GetOutput();
+        // Cut it loose from the reader so sharing it between threads never touches the pipeline
+        fixedImage->DisconnectPipeline();
     }
-    
-    auto initialTransform = TTransform::New();
-    auto optimizer        = TOptimizer::New();
-    auto registration     = TRegistration::New();
-    auto metric           = TMetric::New();
-    auto fixedReader      = TFixedReader::New();
-    auto movingReader     = TMovingReader::New();
+    return buildFixedPyramid<TPixel>(header, fixedImage, opts);
+}
+
+// Index region given with --roi, cropped to the fixed volume
+template <typename TFixed>
+bool explicitRegion(const TFixed* fixed, const RegistrationOptions& opts, typename TFixed::RegionType& region)
+{
+    typename TFixed::IndexType start;
+    typename TFixed::SizeType size;
+    for (uint32_t d = 0; d < TDimension; ++d) {
+        start[d] = opts.roi[d];
+        size[d]  = opts.roi[TDimension + d];
+    }
+    region = typename TFixed::RegionType(start, size);
+    if (!region.Crop(fixed->GetLargestPossibleRegion())) {
+        std::cerr << "[error]: --roi lies outside the fixed volume" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+template <typename TPixel>
+int registerVolumes(const RegistrationOptions& opts)
+{
+    using TFixed  = TFixedImage<TPixel>;
 
-    // Parse arguments
-    auto fixedFilename  = std::string(argv[1]);
-    auto movingFilename = std::string(argv[2]);
+    auto fixedReader = TFixedReader<TPixel>::New();
 
     // Read in data
-    fixedReader->SetFileName(fixedFilename);
-    movingReader->SetFileName(movingFilename);
+    fixedReader->SetFileName(opts.fixedFilename);
 
-    // Get the size of the fixed image
-    fixedReader->Update();
-    movingReader->Update();
+    // Only the fixed volume's header is read for now; how much of it we need depends on the ROI
+    typename TMovingImage<TPixel>::Pointer moving;
+    try {
+        fixedReader->UpdateOutputInformation();
+        moving = readImage<TMovingImage<TPixel>>(opts.movingFilename, MappedAccess::Whole);
+    } catch(itk::ExceptionObject& err) {
+        std::cout << "ExceptionObject caught!" << std::endl;
+        std::cout << err << std::endl;
+        return EXIT_FAILURE;
+    }
     auto fixedSize = fixedReader->GetOutput()->GetLargestPossibleRegion().GetSize();
-    auto movingSize = movingReader->GetOutput()->GetLargestPossibleRegion().GetSize();
-
-    // Extract a region of interest from the fixed reader in order to register to that
-    /*
-    auto roiExtractor = itk::RegionOfInterestImageFilter<TFixedImage, TFixedImage>::New();
-    roiExtractor->SetInput(fixedReader->GetOutput());
-    TFixedImage::IndexType start;
-    start[0] = uint32_t( floor(fixedSize[0] * 0.45 - movingSize[0] / 2)) - 50;
-    start[1] = uint32_t( floor(fixedSize[1] * 0.55 - movingSize[1] / 2)) - 50;
-    start[2] = 50;
-    TFixedImage::SizeType size;
-    size[0] = movingSize[0] + 100;
-    size[1] = movingSize[1] + 100;
-    size[2] = movingSize[2] + 100;
+    auto movingSize = moving->GetLargestPossibleRegion().GetSize();
     std::cout << "Fixed size   = " << fixedSize << std::endl;
     std::cout << "Moving size  = " << movingSize << std::endl;
-    std::cout << "Region start = " << start << std::endl;
-    std::cout << "Region size  = " << size << std::endl;
-    TFixedImage::RegionType regionOfInterest(start, size);
-    roiExtractor->SetRegionOfInterest(regionOfInterest);
-    */
-
-    /*
-     * Set up initial first transformation - best guess
-     */
-    // Rotation
-    TTransform::VectorType axis;
-    axis[0] = 0.0;
-    axis[1] = 0.0;
-    axis[2] = 1.0;
-    const double angle = 0.0;
-    TTransform::VersorType rotation;
-    rotation.Set(axis, angle);
-    initialTransform->SetRotation(rotation);
-
-    // Scaling
-    initialTransform->SetScale(1.0);
-
-    // Translation
-    TTransform::TranslationType translate;
-    translate[0] = uint32_t( floor(fixedSize[0] * 0.45) );
-    translate[1] = uint32_t( floor(fixedSize[1] * 0.55) );
-    translate[2] = 107;
-    std::cout << "Translating " << translate << std::endl;
-    initialTransform->SetTranslation(translate);
-
-    // Set up initialTransform initializer
-    auto initializer = TTransformInitializer::New();
-    initializer->SetTransform(initialTransform);
-    initializer->SetFixedImage(fixedReader->GetOutput());
-    initializer->SetMovingImage(movingReader->GetOutput());
-    initializer->GeometryOn();
-    initializer->InitializeTransform();
-
-    // Connect all components
-    registration->SetOptimizer(optimizer);
-    registration->SetMetric(metric);
-    registration->SetInitialTransform(initialTransform);
-    registration->SetFixedImage(fixedReader->GetOutput());
-    registration->SetMovingImage(movingReader->GetOutput());
-
-    // Configure the Optimizer
-    TOptimizer::ScalesType optimizerScales(initialTransform->GetNumberOfParameters());
-    const double translationScale = 1.0 / 1000.0;
-    optimizerScales[0] = 1.0;
-    optimizerScales[1] = 1.0;
-    optimizerScales[2] = 1.0;
-    optimizerScales[3] = translationScale;
-    optimizerScales[4] = translationScale;
-    optimizerScales[5] = translationScale;
-    optimizerScales[6] = 1.0;
-    optimizer->SetMinimumStepLength(0.001);
-    optimizer->SetScales(optimizerScales);
-    optimizer->SetNumberOfIterations(200);
-    optimizer->SetLearningRate(0.2);
-    optimizer->SetReturnBestParametersAndValue(true);
-
-    CommandIterationUpdate::Pointer observer = CommandIterationUpdate::New();
-    optimizer->AddObserver(itk::IterationEvent(), observer);
-
-    // Set levels of registration
-    const auto numberOfLevels = 1;
-    TRegistration::ShrinkFactorsArrayType shrinkFactorsPerLevel;
-    shrinkFactorsPerLevel.SetSize(1);
-    shrinkFactorsPerLevel[0] = 1;
-    TRegistration::SmoothingSigmasArrayType smoothingSigmasPerLevel;
-    smoothingSigmasPerLevel.SetSize(1);
-    smoothingSigmasPerLevel[0] = 0;
-    registration->SetNumberOfLevels(numberOfLevels);
-    registration->SetSmoothingSigmasPerLevel(smoothingSigmasPerLevel);
-    registration->SetShrinkFactorsPerLevel(shrinkFactorsPerLevel);
 
+    // Set up initial first transformation - best guess
+    auto initialTransform = makeInitialTransform(fixedReader->GetOutput(), moving.GetPointer());
+
+    FixedPyramid<TPixel> fixed;
+    RegistrationResult result;
     try {
-        registration->Update();
-        std::cout << "Optimizer stop condition: "
-                            << registration->GetOptimizer()->GetStopConditionDescription()
-                            << std::endl;
+        if (opts.locateShrink > 0) {
+            locateMoving(initialTransform.GetPointer(), readFixedLocalizerImage<TPixel>(opts).GetPointer(),
+                         moving.GetPointer(), opts);
+        }
+
+        // Read the fixed volume, or only the region of it we are going to register against
+        typename TFixed::RegionType regionOfInterest;
+        const bool useRegion = !opts.roi.empty() || opts.roiMargin >= 0;
+        if (!opts.roi.empty()) {
+            if (!explicitRegion(fixedReader->GetOutput(), opts, regionOfInterest)) {
+                return EXIT_FAILURE;
+            }
+        } else if (opts.roiMargin >= 0) {
+            regionOfInterest = placementRegion(fixedReader->GetOutput(), moving.GetPointer(),
+                                               initialTransform.GetPointer(), opts.roiMargin);
+        }
+        fixed = readFixedPyramid<TPixel>(fixedReader, useRegion ? &regionOfInterest : nullptr, opts);
+
+        result = registerImages<TPixel>(fixed, moving, initialTransform, opts,
+                                        opts.movingFilename);
     } catch(itk::ExceptionObject& err) {
         std::cout << "ExceptionObject caught!" << std::endl;
         std::cout << err << std::endl;
         return EXIT_FAILURE;
     }
-    
+
     // Print out final parameters
-    auto finalParameters = registration->GetOutput()->Get()->GetParameters();
+    auto finalParameters = result.transform->GetParameters();
     std::cout << std::endl << std::endl;
     std::cout << "Result = " << std::endl;
     std::cout << " versor X        = " << finalParameters[0] << std::endl;
@@ -148,46 +130,358 @@ int main(int argc, char *argv[])
     std::cout << " Translation Y   = " << finalParameters[4]  << std::endl;
     std::cout << " Translation Z   = " << finalParameters[5]  << std::endl;
     std::cout << " Isotropic Scale = " << finalParameters[6]  << std::endl;
-    std::cout << " Iterations      = " << optimizer->GetCurrentIteration() << std::endl;
-    std::cout << " Metric value    = " << optimizer->GetValue() << std::endl;
+    std::cout << " Iterations      = " << result.iterations << std::endl;
+    std::cout << " Metric value    = " << result.value << std::endl;
+    std::cout << " Seconds         = " << result.seconds << std::endl;
+    for (size_t l = 0; l < result.stopConditions.size(); ++l) {
+        std::cout << " Level " << l << " stopped after " << result.levelSeconds[l] << " s: "
+                  << result.stopConditions[l] << std::endl;
+    }
     std::cout << std::endl;
 
     // Print out transformation matrix
     auto finalTransform = TTransform::New();
-    finalTransform->SetFixedParameters(registration->GetOutput()->Get()->GetFixedParameters());
+    finalTransform->SetFixedParameters(result.transform->GetFixedParameters());
     finalTransform->SetParameters(finalParameters);
     std::cout << "Matrix = " << std::endl << finalTransform->GetMatrix() << std::endl;
     std::cout << "Offset = " << std::endl << finalTransform->GetOffset() << std::endl;
 
     // Write the registered image out to a file so we can look at it and visually compare
-    // 1. Apply initialTransform to the fixed image to make it look like the moving image
-    /*
-    ResampleFilterType::Pointer resampler = ResampleFilterType::New();
-    resampler->SetTransform(finalTransform);
-    resampler->SetInput(movingImageReader->GetOutput());
-    FixedImageType::Pointer fixedImage = fixedImageReader->GetOutput();
-    resampler->SetSize(fixedImage->GetLargestPossibleRegion().GetSize());
-    resampler->SetOutputOrigin(fixedImage->GetOrigin());
-    resampler->SetOutputSpacing(fixedImage->GetSpacing());
-    resampler->SetOutputDirection(fixedImage->GetDirection());
-    resampler->SetDefaultPixelValue(100);
-    // 2. Cast the image from float values to 16-bit values
-    WriterType::Pointer writer = WriterType::New();
-    CastFilterType::Pointer caster = CastFilterType::New();
-    writer->SetFileName(argv[3]);
-    caster->SetInput(resampler->GetOutput());
-    writer->SetInput(caster->GetOutput());
-
-    // 3. Write the registered image to file
+    if (!opts.outputFilename.empty()) {
+        // The pyramid is no longer needed; only the fixed header describes the output grid
+        fixed.levels.clear();
+        std::cout << "Writing " << opts.outputFilename << " in " << opts.streamDivisions << " pieces" << std::endl;
+        try {
+            writeResampled<TPixel>(moving, fixed.header, finalTransform, opts.outputFilename,
+                                   opts.streamDivisions, opts.outputDefaultValue);
+        } catch (itk::ExceptionObject& err) {
+            std::cerr << "ExceptionObject caught!" << std::endl;
+            std::cerr << err << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
+
+// Reads the moving volume filenames listed in 'filename', one per line. Blank lines and lines
+// starting with '#' are skipped.
+bool readManifest(const std::string& filename, std::vector<std::string>& movingFilenames)
+{
+    std::ifstream manifest(filename);
+    if (!manifest.is_open()) {
+        return false;
+    }
+    std::string line;
+    while (std::getline(manifest, line)) {
+        line.erase(0, line.find_first_not_of(" \t\r"));
+        line.erase(line.find_last_not_of(" \t\r") + 1);
+        if (!line.empty() && line[0] != '#') {
+            movingFilenames.push_back(line);
+        }
+    }
+    return true;
+}
+
+// Batch mode: every moving volume in the manifest against one fixed volume. The fixed volume is
+// read and its pyramid built once; then 'opts.jobs' registrations run at a time, sharing it and
+// splitting the cores between them. Each finished registration appends one JSON line to the
+// results file.
+template <typename TPixel>
+int registerBatch(const RegistrationOptions& opts)
+{
+    std::vector<std::string> movingFilenames;
+    if (!readManifest(opts.manifestFilename, movingFilenames)) {
+        std::cerr << "[error]: could not read manifest " << opts.manifestFilename << std::endl;
+        return EXIT_FAILURE;
+    }
+    std::ofstream results(opts.resultsFilename, std::ios::out);
+    if (!results.is_open()) {
+        std::cerr << "[error]: could not open " << opts.resultsFilename << " for writing" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    auto fixedReader = TFixedReader<TPixel>::New();
+    fixedReader->SetFileName(opts.fixedFilename);
+    FixedPyramid<TPixel> fixed;
+    TLocalizerImage::Pointer fixedLocalizer;
     try {
-        writer->Update();
+        fixedReader->UpdateOutputInformation();
+        if (opts.locateShrink > 0) {
+            fixedLocalizer = readFixedLocalizerImage<TPixel>(opts);
+        }
+        typename TFixedImage<TPixel>::RegionType regionOfInterest;
+        if (!opts.roi.empty() && !explicitRegion(fixedReader->GetOutput(), opts, regionOfInterest)) {
+            return EXIT_FAILURE;
+        }
+        fixed = readFixedPyramid<TPixel>(fixedReader, opts.roi.empty() ? nullptr : &regionOfInterest, opts);
+    } catch(itk::ExceptionObject& err) {
+        std::cout << "ExceptionObject caught!" << std::endl;
+        std::cout << err << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    // Split the cores between the concurrent registrations and keep their progress output quiet
+    const uint32_t jobs = std::max(1u, std::min(opts.jobs, uint32_t(movingFilenames.size())));
+    auto jobOpts = opts;
+    jobOpts.quiet = true;
+    jobOpts.threadsPerRegistration =
+        std::max(1u, uint32_t(itk::MultiThreader::GetGlobalDefaultNumberOfThreads()) / jobs);
+    std::cout << "Registering " << movingFilenames.size() << " volumes, " << jobs << " at a time with "
+              << jobOpts.threadsPerRegistration << " threads each" << std::endl;
+
+    // Reads are serialized through ioMutex(); the disk is the bottleneck while reading anyway
+    const auto fixedPixelType = nativePixelType(opts.fixedFilename);
+    std::mutex resultsMutex;
+    std::atomic<size_t> next(0);
+    std::atomic<uint32_t> failures(0);
+    auto worker = [&]() {
+        for (size_t i = next++; i < movingFilenames.size(); i = next++) {
+            const auto& movingFilename = movingFilenames[i];
+            std::ostringstream line;
+            line.precision(std::numeric_limits<double>::max_digits10);
+            line << "{\"moving\": \"" << jsonEscape(movingFilename) << "\", ";
+            try {
+                typename TMovingImage<TPixel>::Pointer moving;
+                {
+                    std::lock_guard<std::mutex> lock(ioMutex());
+                    if (nativePixelType(movingFilename) != fixedPixelType) {
+                        itkGenericExceptionMacro("pixel type differs from the fixed volume");
+                    }
+                    moving = readImage<TMovingImage<TPixel>>(movingFilename, MappedAccess::Whole);
+                }
+                auto initialTransform = makeInitialTransform(fixed.header.GetPointer(), moving.GetPointer());
+                if (fixedLocalizer) {
+                    locateMoving(initialTransform.GetPointer(), fixedLocalizer.GetPointer(), moving.GetPointer(),
+                                 jobOpts);
+                }
+                const auto result = registerImages<TPixel>(fixed, moving, initialTransform, jobOpts,
+                                                           movingFilename);
+
+                const auto parameters = result.transform->GetParameters();
+                const auto center = result.transform->GetCenter();
+                line << "\"status\": \"ok\", \"parameters\": [";
+                for (uint32_t p = 0; p < parameters.GetSize(); ++p) {
+                    line << (p > 0 ? ", " : "") << jsonNumber(parameters[p]);
+                }
+                line << "], \"center\": [" << jsonNumber(center[0]) << ", " << jsonNumber(center[1]) << ", "
+                     << jsonNumber(center[2]) << "], "
+                     << "\"iterations\": " << result.iterations << ", \"metric\": " << jsonNumber(result.value) << ", "
+                     << "\"seconds\": " << result.seconds << ", \"stop\": [";
+                for (size_t l = 0; l < result.stopConditions.size(); ++l) {
+                    line << (l > 0 ? ", " : "") << "\"" << jsonEscape(result.stopConditions[l]) << "\"";
+                }
+                line << "]}";
+            } catch (itk::ExceptionObject& err) {
+                failures++;
+                line << "\"status\": \"error\", \"error\": \"" << jsonEscape(err.GetDescription()) << "\"}";
+            } catch (std::exception& err) {
+                failures++;
+                line << "\"status\": \"error\", \"error\": \"" << jsonEscape(err.what()) << "\"}";
+            }
+
+            std::lock_guard<std::mutex> lock(resultsMutex);
+            results << line.str() << std::endl;
+            std::cout << "[" << i + 1 << "/" << movingFilenames.size() << "] " << movingFilename << std::endl;
+        }
+    };
+    std::vector<std::thread> threads;
+    for (uint32_t j = 0; j < jobs; ++j) {
+        threads.emplace_back(worker);
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+
+    std::cout << movingFilenames.size() - failures << " of " << movingFilenames.size()
+              << " registrations succeeded, results in " << opts.resultsFilename << std::endl;
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// Smooth test pattern of 41 x 37 x 29 voxels, anisotropic spacing and 'origin', with values in
+// [15, 235] times 'scale'
+template <typename TImage>
+typename TImage::Pointer syntheticVolume(const typename TImage::PointType& origin, const double scale)
+{
+    auto image = TImage::New();
+    typename TImage::SizeType size;
+    typename TImage::SpacingType spacing;
+    size[0] = 41;
+    size[1] = 37;
+    size[2] = 29;
+    spacing[0] = 0.9;
+    spacing[1] = 1.1;
+    spacing[2] = 1.3;
+    image->SetRegions(size);
+    image->SetSpacing(spacing);
+    image->SetOrigin(origin);
+    image->Allocate();
+    for (itk::ImageRegionIteratorWithIndex<TImage> it(image, image->GetBufferedRegion()); !it.IsAtEnd(); ++it) {
+        typename TImage::PointType p;
+        image->TransformIndexToPhysicalPoint(it.GetIndex(), p);
+        const double value = 125.0 + 60.0 * std::sin(0.31 * p[0]) * std::cos(0.23 * p[1]) +
+                             50.0 * std::sin(0.19 * p[2] + 0.11 * p[0]);
+        it.Set(typename TImage::PixelType(scale * value));
+    }
+    return image;
+}
+
+// checkMetric() on a synthetic fixed and moving volume, at 'transform', densely and on every third
+// fixed voxel, each with and without a moving mask. Every case has to take the specialized path.
+template <typename TPixel, typename TStageTransform>
+bool checkMetricOnSyntheticVolumes(const char* name, typename TStageTransform::Pointer transform,
+                                   const double tolerance)
+{
+    using TImage = TFixedImage<TPixel>;
+    using TCheckedMetric = TMetric<TPixel, TStageTransform>;
+    const double scale = std::is_same<TPixel, uint16_t>::value ? 200.0 : 1.0;
+    typename TImage::PointType fixedOrigin, movingOrigin;
+    fixedOrigin.Fill(0.0);
+    movingOrigin[0] = -1.3;
+    movingOrigin[1] = 0.6;
+    movingOrigin[2] = -0.4;
+    const auto fixed  = syntheticVolume<TImage>(fixedOrigin, scale);
+    const auto moving = syntheticVolume<TImage>(movingOrigin, scale);
+
+    // Moving mask: the ellipsoid filling the moving volume's index box to 90%
+    using TMaskImage = itk::Image<uint8_t, TDimension>;
+    auto maskImage = TMaskImage::New();
+    maskImage->CopyInformation(moving);
+    maskImage->SetRegions(moving->GetBufferedRegion());
+    maskImage->Allocate();
+    const auto maskRegion = maskImage->GetBufferedRegion();
+    const auto maskSize = maskRegion.GetSize();
+    for (itk::ImageRegionIteratorWithIndex<TMaskImage> it(maskImage, maskRegion); !it.IsAtEnd(); ++it) {
+        double radius = 0.0;
+        for (uint32_t d = 0; d < TDimension; ++d) {
+            const double half = 0.5 * double(maskSize[d] - 1);
+            radius += std::pow((it.GetIndex()[d] - half) / (0.9 * half), 2.0);
+        }
+        it.Set(radius < 1.0 ? 1 : 0);
+    }
+    const auto mask = std::make_shared<const BitMask>(maskImage.GetPointer());
+
+    auto points = TCheckedMetric::FixedSampledPointSetType::New();
+    uint64_t voxel = 0, id = 0;
+    for (itk::ImageRegionIteratorWithIndex<TImage> it(fixed, fixed->GetBufferedRegion()); !it.IsAtEnd(); ++it) {
+        if (voxel++ % 3 == 0) {
+            typename TCheckedMetric::FixedSampledPointSetType::PointType point;
+            fixed->TransformIndexToPhysicalPoint(it.GetIndex(), point);
+            points->SetPoint(id++, point);
+        }
+    }
+
+    bool ok = true;
+    for (int sampled = 0; sampled < 2; ++sampled) {
+        for (int masked = 0; masked < 2; ++masked) {
+            auto metric = TCheckedMetric::New();
+            metric->SetFixedImage(fixed);
+            metric->SetMovingImage(moving);
+            metric->SetMovingTransform(transform);
+            metric->SetVirtualDomainFromImage(fixed);
+            metric->SetMaximumNumberOfThreads(4);
+            if (masked) {
+                setMovingMask<TPixel>(metric.GetPointer(), mask);
+            }
+            if (sampled) {
+                metric->SetFixedSampledPointSet(points);
+                metric->SetUseFixedSampledPointSet(true);
+            }
+            metric->Initialize();
+            std::cout << name << ", " << (sampled ? "every third voxel" : "dense")
+                      << (masked ? ", moving mask" : "") << std::endl;
+            const bool agrees = checkMetric<TPixel, TStageTransform>(metric.GetPointer(), tolerance);
+            ok = agrees && metric->GetLastEvaluationWasFast() && ok;
+        }
     }
-    catch (itk::ExceptionObject& err) {
-        std::cerr << "ExceptionObject caught!" << std::endl;
-        std::cerr << err << std::endl;
+    return ok;
+}
+
+// 'register --self-check': the metric against ITK's for every pixel type and stage transform, at
+// a position with some rotation, translation and scale
+bool selfCheck()
+{
+    const double tolerance = 1e-3;
+    auto similarity = TTransform::New();
+    TTransform::InputPointType center;
+    center[0] = 18.0;
+    center[1] = 20.0;
+    center[2] = 18.0;
+    TTransform::VersorType::VectorType axis;
+    axis[0] = 1.0;
+    axis[1] = 2.0;
+    axis[2] = 3.0;
+    TTransform::VersorType rotation;
+    rotation.Set(axis, 0.08);
+    TTransform::OutputVectorType translation;
+    translation[0] = 0.6;
+    translation[1] = -0.5;
+    translation[2] = 0.4;
+    similarity->SetCenter(center);
+    similarity->SetRotation(rotation);
+    similarity->SetTranslation(translation);
+    similarity->SetScale(1.02);
+    auto rigid = TRigidTransform::New();
+    copyStage(similarity.GetPointer(), rigid.GetPointer());
+    auto shift = TTranslationTransform::New();
+    copyStage(similarity.GetPointer(), shift.GetPointer());
+
+    bool ok = true;
+    ok = checkMetricOnSyntheticVolumes<uint8_t, TTransform>("uint8, similarity", similarity, tolerance) && ok;
+    ok = checkMetricOnSyntheticVolumes<uint8_t, TRigidTransform>("uint8, rigid", rigid, tolerance) && ok;
+    ok = checkMetricOnSyntheticVolumes<uint8_t, TTranslationTransform>("uint8, translation", shift, tolerance) && ok;
+    ok = checkMetricOnSyntheticVolumes<uint16_t, TTransform>("uint16, similarity", similarity, tolerance) && ok;
+    ok = checkMetricOnSyntheticVolumes<uint16_t, TRigidTransform>("uint16, rigid", rigid, tolerance) && ok;
+    ok = checkMetricOnSyntheticVolumes<uint16_t, TTranslationTransform>("uint16, translation", shift, tolerance) && ok;
+    ok = checkMetricOnSyntheticVolumes<float, TTransform>("float, similarity", similarity, tolerance) && ok;
+    ok = checkMetricOnSyntheticVolumes<float, TRigidTransform>("float, rigid", rigid, tolerance) && ok;
+    ok = checkMetricOnSyntheticVolumes<float, TTranslationTransform>("float, translation", shift, tolerance) && ok;
+    std::cout << (ok ? "The metric agrees with ITK's" : "[error]: the metric differs from ITK's") << std::endl;
+    return ok;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc == 2 && std::string(argv[1]) == "--self-check") {
+        return selfCheck() ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    RegistrationOptions opts;
+    if (!parseOptions(argc, argv, opts)) {
         return EXIT_FAILURE;
     }
-    */
+    const bool batch = !opts.manifestFilename.empty();
 
-    return EXIT_SUCCESS;
+    // Batch mode keeps standard output for its progress lines
+    if (!opts.telemetryFilename.empty()) {
+        opts.telemetry = std::make_shared<TelemetryLog>();
+        if (!opts.telemetry->Open(opts.telemetryFilename)) {
+            std::cerr << "[error]: can't write " << opts.telemetryFilename << std::endl;
+            return EXIT_FAILURE;
+        }
+    } else if (!batch) {
+        opts.telemetry = std::make_shared<TelemetryLog>();
+    }
+
+    // Run in the pixel type the volumes are stored in. Both have to agree, otherwise fall back
+    // to float for both. In batch mode the fixed volume decides.
+    auto pixelType = NativePixelType::Float;
+    try {
+        pixelType = nativePixelType(opts.fixedFilename);
+        if (!batch && nativePixelType(opts.movingFilename) != pixelType) {
+            std::cout << "Fixed and moving pixel types differ, registering as float" << std::endl;
+            pixelType = NativePixelType::Float;
+        }
+    } catch(itk::ExceptionObject& err) {
+        std::cout << "ExceptionObject caught!" << std::endl;
+        std::cout << err << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    if (pixelType == NativePixelType::UInt8) {
+        return batch ? registerBatch<uint8_t>(opts) : registerVolumes<uint8_t>(opts);
+    } else if (pixelType == NativePixelType::UInt16) {
+        return batch ? registerBatch<uint16_t>(opts) : registerVolumes<uint16_t>(opts);
+    } else {
+        return batch ? registerBatch<float>(opts) : registerVolumes<float>(opts);
+    }
 }
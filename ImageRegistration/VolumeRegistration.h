@@ -1,74 +1,876 @@
+#pragma once
+
+#include <cmath>
+#include <limits>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <vector>
+
 // Registration stuff
-#include "itkImageRegistrationMethodv4.h"
 #include "itkMeanSquaresImageToImageMetricv4.h"
+#include "itkMattesMutualInformationImageToImageMetricv4.h"
+#include "itkCorrelationImageToImageMetricv4.h"
 #include "itkSimilarity3DTransform.h"
+#include "itkVersorRigid3DTransform.h"
 #include "itkRegularStepGradientDescentOptimizerv4.h"
 #include "itkLinearInterpolateImageFunction.h"
-#include "itkCenteredTransformInitializer.h"
+#include "itkRegistrationParameterScalesFromPhysicalShift.h"
 
 // Needed for I/O
+#include "itkImageIOFactory.h"
 #include "itkImageFileReader.h"
 #include "itkImageFileWriter.h"
 #include "itkResampleImageFilter.h"
 
+// Reading only part of the fixed volume
+#include "itkRegionOfInterestImageFilter.h"
+
+// Building the levels of the registration pyramid
+#include "itkSmoothingRecursiveGaussianImageFilter.h"
+#include "itkShrinkImageFilter.h"
+#include "itksys/SystemTools.hxx"
+
 // Need to be able to cast images from floats in their intermediate
 // representation back to appropriate bit depths
 #include "itkCastImageFilter.h"
+#include "itkDefaultImageToImageMetricTraitsv4.h"
 
-// For the observer class
-#include "itkCommand.h"
+// Timing
+#include <chrono>
+
+#include "RegistrationOptions.h"
+#include "SimilarityMeanSquaresMetric.h"
+#include "FixedPointInterpolator.h"
+#include "MappedImage.h"
+#include "TranslationLocalizer.h"
 
 // Only working with 3D data
 const auto TDimension = 3;
 
-// Pixel types. Externally, they are of type TPixel. Internally, they are of type TInternalPixel
-using TPixel         = float;
-using TInternalPixel = float;
+// Images stay in the pixel type they have on disk (uint8_t, uint16_t or float), so a 16-bit
+// volume takes half and an 8-bit one a quarter of the memory it would as float
+template <typename TPixel> using TFixedImage  = itk::Image<TPixel, TDimension>;
+template <typename TPixel> using TMovingImage = itk::Image<TPixel, TDimension>;
 
-// Image types
-using TFixedImage    = itk::Image<TPixel, TDimension>;
-using TMovingImage   = itk::Image<TPixel, TDimension>;
+// Metric traits that keep the images in their on-disk pixel type, but make the metric evaluate
+// fixed values and interpolated moving values as float. With the default traits an integer
+// image would have its interpolated values truncated back to integers.
+template <typename TImage>
+class FloatPixelMetricTraits : public itk::DefaultImageToImageMetricTraitsv4<TImage, TImage, TImage, double>
+{
+    public:
+        typedef float FixedImagePixelType;
+        typedef float MovingImagePixelType;
+        typedef float FixedPixelType;
+        typedef float MovingPixelType;
+};
 
 // Registration stuff
-using TTransform            = itk::Similarity3DTransform<double>;
-using TOptimizer            = itk::RegularStepGradientDescentOptimizerv4<double>;
-using TRegistration         = itk::ImageRegistrationMethodv4<TFixedImage, TMovingImage, TTransform>;
-using TMetric               = itk::MeanSquaresImageToImageMetricv4<TFixedImage, TMovingImage>;
-using TTransformInitializer = itk::CenteredTransformInitializer<TTransform, TFixedImage, TMovingImage>;
+using TTransform = itk::Similarity3DTransform<double>;
+using TOptimizer = itk::RegularStepGradientDescentOptimizerv4<double>;
+// What the earlier stages of a staged registration optimize instead of the whole TTransform
+using TTranslationTransform = FixedMatrixTranslationTransform<double>;
+using TRigidTransform = itk::VersorRigid3DTransform<double>;
+template <typename TPixel, typename TStageTransform = TTransform>
+using TMetric = SimilarityMeanSquaresMetric<TFixedImage<TPixel>, TMovingImage<TPixel>, TFixedImage<TPixel>,
+                                            double, FloatPixelMetricTraits<TFixedImage<TPixel>>, TStageTransform>;
+// The other similarity measures, and what all of them have in common
+template <typename TPixel>
+using TMattesMetric = itk::MattesMutualInformationImageToImageMetricv4<TFixedImage<TPixel>, TMovingImage<TPixel>,
+                                                                       TFixedImage<TPixel>, double,
+                                                                       FloatPixelMetricTraits<TFixedImage<TPixel>>>;
+template <typename TPixel>
+using TCorrelationMetric = itk::CorrelationImageToImageMetricv4<TFixedImage<TPixel>, TMovingImage<TPixel>,
+                                                                TFixedImage<TPixel>, double,
+                                                                FloatPixelMetricTraits<TFixedImage<TPixel>>>;
+template <typename TPixel>
+using TMetricBase = itk::ImageToImageMetricv4<TFixedImage<TPixel>, TMovingImage<TPixel>, TFixedImage<TPixel>, double,
+                                              FloatPixelMetricTraits<TFixedImage<TPixel>>>;
+template <typename TPixel>
+using TGradientImage = typename TMetricBase<TPixel>::MovingImageGradientImageType;
+// The generic ITK metric TMetric specializes, for checking it
+template <typename TPixel>
+using TReferenceMetric = itk::MeanSquaresImageToImageMetricv4<TFixedImage<TPixel>, TMovingImage<TPixel>,
+                                                              TFixedImage<TPixel>, double,
+                                                              FloatPixelMetricTraits<TFixedImage<TPixel>>>;
 
-// Readers
-using TFixedReader  = itk::ImageFileReader<TFixedImage>;
-using TMovingReader = itk::ImageFileReader<TMovingImage>;
+// ITK's IO factories aren't safe to use from several threads at once, so all reading and
+// writing of images that can happen concurrently goes through this
+inline std::mutex& ioMutex()
+{
+    static std::mutex mutex;
+    return mutex;
+}
 
-// The observer class that will print out intermediate info of the optimizer
-class CommandIterationUpdate : public itk::Command
+// Reads the binary mask in 'filename' (nonzero is inside) in the pixel type it is stored in
+template <typename TMaskPixel>
+std::shared_ptr<const BitMask> readMaskAs(const std::string& filename)
 {
-    public:
-        typedef CommandIterationUpdate Self;
-        typedef itk::Command Superclass;
-        typedef itk::SmartPointer<Self> Pointer;
-        itkNewMacro(Self);
-    
-    protected:
-        CommandIterationUpdate() {};
-    
-    public:
-        typedef itk::RegularStepGradientDescentOptimizerv4<double> OptimizerType;
-        typedef const OptimizerType* OptimizerPointer;
-        void Execute(itk::Object* caller, const itk::EventObject & event)
-        {
-            Execute((const itk::Object*) caller, event);
+    using TMaskImage = itk::Image<TMaskPixel, TDimension>;
+    typename TMaskImage::Pointer image;
+    {
+        std::lock_guard<std::mutex> lock(ioMutex());
+        image = readImage<TMaskImage>(filename, MappedAccess::Sequential);
+    }
+    auto mask = std::make_shared<const BitMask>(image.GetPointer());
+    if (mask->GetNumberOfInsideVoxels() == 0) {
+        itkGenericExceptionMacro(<< "mask " << filename << " has no voxels inside");
+    }
+    return mask;
+}
+
+template <typename TPixel> using TFixedReader = itk::ImageFileReader<TFixedImage<TPixel>>;
+
+// The pixel types 'register' has a native path for
+enum class NativePixelType { UInt8, UInt16, Float };
+
+// Looks at the header of 'filename' to decide which native path to read it with. Anything that
+// isn't 8 or 16-bit unsigned goes through float, like every volume used to.
+inline NativePixelType nativePixelType(const std::string& filename)
+{
+    auto imageIO = itk::ImageIOFactory::CreateImageIO(filename.c_str(), itk::ImageIOFactory::ReadMode);
+    if (imageIO.IsNull()) {
+        // Let the reader report the problem
+        return NativePixelType::Float;
+    }
+    imageIO->SetFileName(filename);
+    imageIO->ReadImageInformation();
+    if (imageIO->GetNumberOfComponents() != 1) {
+        return NativePixelType::Float;
+    }
+    switch (imageIO->GetComponentType()) {
+        case itk::ImageIOBase::UCHAR:
+            return NativePixelType::UInt8;
+        case itk::ImageIOBase::USHORT:
+            return NativePixelType::UInt16;
+        default:
+            return NativePixelType::Float;
+    }
+}
+
+inline std::shared_ptr<const BitMask> readMask(const std::string& filename)
+{
+    switch (nativePixelType(filename)) {
+        case NativePixelType::UInt8:
+            return readMaskAs<uint8_t>(filename);
+        case NativePixelType::UInt16:
+            return readMaskAs<uint16_t>(filename);
+        default:
+            return readMaskAs<float>(filename);
+    }
+}
+
+// Physical center of an image's grid, computed from its header information only. Same as what
+// CenteredTransformInitializer::GeometryOn() uses, but without updating the image's pipeline.
+template <typename TImage>
+typename TImage::PointType geometricCenter(const TImage* image)
+{
+    const auto region = image->GetLargestPossibleRegion();
+    itk::ContinuousIndex<double, TImage::ImageDimension> centerIndex;
+    for (uint32_t d = 0; d < TImage::ImageDimension; ++d) {
+        centerIndex[d] = region.GetIndex()[d] + (region.GetSize()[d] - 1) / 2.0;
+    }
+    typename TImage::PointType center;
+    image->TransformContinuousIndexToPhysicalPoint(centerIndex, center);
+    return center;
+}
+
+// Centers 'transform' on the fixed volume and lines up the centers of both volumes
+template <typename TFixed, typename TMoving>
+void initializeGeometricCenters(TTransform* transform, const TFixed* fixed, const TMoving* moving)
+{
+    const auto fixedCenter  = geometricCenter(fixed);
+    const auto movingCenter = geometricCenter(moving);
+    transform->SetCenter(fixedCenter);
+    transform->SetTranslation(movingCenter - fixedCenter);
+}
+
+// Best-guess starting transform: no rotation or scaling, with the centers of both volumes lined
+// up. Only the header information of either image is used.
+template <typename TFixed, typename TMoving>
+TTransform::Pointer makeInitialTransform(const TFixed* fixed, const TMoving* moving)
+{
+    auto initialTransform = TTransform::New();
+
+    // Rotation
+    TTransform::VectorType axis;
+    axis[0] = 0.0;
+    axis[1] = 0.0;
+    axis[2] = 1.0;
+    const double angle = 0.0;
+    TTransform::VersorType rotation;
+    rotation.Set(axis, angle);
+    initialTransform->SetRotation(rotation);
+
+    // Scaling
+    initialTransform->SetScale(1.0);
+
+    // Center the transform on the fixed volume and line up the centers of both volumes. This
+    // only needs the header of the fixed volume, unlike CenteredTransformInitializer.
+    initializeGeometricCenters(initialTransform.GetPointer(), fixed, moving);
+    return initialTransform;
+}
+
+// Fixed volume block averaged for locating moving volumes in it, read piecewise
+template <typename TPixel>
+TLocalizerImage::Pointer readFixedLocalizerImage(const RegistrationOptions& opts)
+{
+    std::lock_guard<std::mutex> lock(ioMutex());
+    return readLocalizerImage<TPixel>(opts.fixedFilename, opts.locateShrink, opts.streamDivisions);
+}
+
+// Finds 'moving' in the fixed volume's localizer image and moves the starting position there:
+// the transform is centered where the moving volume's center lands and maps it onto that center
+template <typename TMoving>
+void locateMoving(TTransform* transform, const TLocalizerImage* fixedLocalizer, const TMoving* moving,
+                  const RegistrationOptions& opts)
+{
+    double correlation = 0.0;
+    const auto movingLocalizer = localizerImage(moving, fixedLocalizer->GetSpacing());
+    const auto offset = locateTranslation(fixedLocalizer, movingLocalizer, 0.9, correlation);
+    transform->SetCenter(geometricCenter(moving) + offset);
+    transform->SetTranslation(-offset);
+    if (!opts.quiet) {
+        std::cout << "Located moving volume at offset " << offset << " (correlation " << correlation << ")"
+                  << std::endl;
+    }
+}
+
+// Index region of 'fixed' that the moving volume covers under 'transform', padded by 'margin'
+// voxels on every side and cropped to the fixed volume
+template <typename TFixed, typename TMoving>
+typename TFixed::RegionType placementRegion(const TFixed* fixed, const TMoving* moving,
+                                            const TTransform* transform, const int64_t margin)
+{
+    // The transform maps fixed points onto moving points, so go the other way
+    auto inverse = TTransform::New();
+    if (!transform->GetInverse(inverse)) {
+        itkGenericExceptionMacro("initial transform is not invertible");
+    }
+
+    // Bounding box of the moving volume's corners, in fixed index space
+    const auto movingRegion = moving->GetLargestPossibleRegion();
+    std::vector<double> lower(TDimension, std::numeric_limits<double>::max());
+    std::vector<double> upper(TDimension, std::numeric_limits<double>::lowest());
+    for (uint32_t corner = 0; corner < (1u << TDimension); ++corner) {
+        typename TMoving::IndexType index = movingRegion.GetIndex();
+        for (uint32_t d = 0; d < TDimension; ++d) {
+            if (corner & (1u << d)) {
+                index[d] += movingRegion.GetSize()[d] - 1;
+            }
+        }
+        typename TMoving::PointType movingPoint;
+        moving->TransformIndexToPhysicalPoint(index, movingPoint);
+        itk::ContinuousIndex<double, TDimension> fixedIndex;
+        fixed->TransformPhysicalPointToContinuousIndex(inverse->TransformPoint(movingPoint), fixedIndex);
+        for (uint32_t d = 0; d < TDimension; ++d) {
+            lower[d] = std::min(lower[d], fixedIndex[d]);
+            upper[d] = std::max(upper[d], fixedIndex[d]);
+        }
+    }
+
+    typename TFixed::IndexType start;
+    typename TFixed::SizeType size;
+    for (uint32_t d = 0; d < TDimension; ++d) {
+        start[d] = int64_t(std::floor(lower[d])) - margin;
+        size[d]  = uint64_t(int64_t(std::ceil(upper[d])) + margin - start[d] + 1);
+    }
+    typename TFixed::RegionType region(start, size);
+    if (!region.Crop(fixed->GetLargestPossibleRegion())) {
+        itkGenericExceptionMacro("moving volume does not overlap the fixed volume");
+    }
+    return region;
+}
+
+// Reads only 'region' of the image behind 'reader'. The request is streamed down to the reader,
+// so formats that support it (e.g. uncompressed MetaImage) never load the rest of the file.
+// The returned image keeps its physical placement; its index region starts at zero.
+template <typename TImage>
+typename TImage::Pointer readRegion(itk::ImageFileReader<TImage>* reader, const typename TImage::RegionType& region)
+{
+    auto roiExtractor = itk::RegionOfInterestImageFilter<TImage, TImage>::New();
+    reader->ReleaseDataFlagOn();
+    roiExtractor->SetInput(reader->GetOutput());
+    roiExtractor->SetRegionOfInterest(region);
+    roiExtractor->Update();
+    typename TImage::Pointer output = roiExtractor->GetOutput();
+    output->DisconnectPipeline();
+    return output;
+}
+
+// Copy of 'region' of an image already in memory (or mapped), placed like readRegion()'s
+template <typename TImage>
+typename TImage::Pointer extractRegion(const TImage* image, const typename TImage::RegionType& region)
+{
+    auto roiExtractor = itk::RegionOfInterestImageFilter<TImage, TImage>::New();
+    roiExtractor->SetInput(image);
+    roiExtractor->SetRegionOfInterest(region);
+    roiExtractor->Update();
+    typename TImage::Pointer output = roiExtractor->GetOutput();
+    output->DisconnectPipeline();
+    return output;
+}
+
+// Builds one level of the pyramid: smooth with a Gaussian of 'sigma' (physical units), then
+// shrink by 'shrinkFactor'. Returns the input itself when neither is needed so the full
+// resolution level doesn't cost an extra copy of the volume.
+template <typename TImage>
+typename TImage::Pointer makeLevelImage(typename TImage::Pointer image, const double sigma,
+                                        const uint32_t shrinkFactor)
+{
+    typename TImage::Pointer output = image;
+    if (sigma > 0.0) {
+        auto smoother = itk::SmoothingRecursiveGaussianImageFilter<TImage, TImage>::New();
+        smoother->SetInput(output);
+        smoother->SetSigma(sigma);
+        // 'image' may be a read-only mapped volume, and is the finer levels' input anyway
+        smoother->InPlaceOff();
+        smoother->Update();
+        output = smoother->GetOutput();
+        output->DisconnectPipeline();
+    }
+    if (shrinkFactor > 1) {
+        auto shrinker = itk::ShrinkImageFilter<TImage, TImage>::New();
+        shrinker->SetInput(output);
+        shrinker->SetShrinkFactors(shrinkFactor);
+        shrinker->Update();
+        output = shrinker->GetOutput();
+        output->DisconnectPipeline();
+    }
+    return output;
+}
+
+// A new metric of the type chosen in 'opts', timing its evaluations for telemetry. Gradients are
+// taken by central differences, like the mean squares metric does, so no gradient images are
+// built on every Initialize(). Mean squares is specialized for the transform it will be given.
+template <typename TPixel, typename TStageTransform = TTransform>
+typename TMetricBase<TPixel>::Pointer makeMetric(const RegistrationOptions& opts)
+{
+    typename TMetricBase<TPixel>::Pointer metric;
+    if (opts.metric == MetricType::MattesMutualInformation) {
+        // ITK gives every thread its own joint histogram and adds them up afterwards
+        auto mattes = TimedMetric<TMattesMetric<TPixel>>::New();
+        mattes->SetNumberOfHistogramBins(opts.histogramBins);
+        metric = mattes;
+    } else if (opts.metric == MetricType::Correlation) {
+        metric = TimedMetric<TCorrelationMetric<TPixel>>::New();
+    } else {
+        metric = TimedMetric<TMetric<TPixel, TStageTransform>>::New();
+    }
+    metric->SetUseFixedImageGradientFilter(false);
+    metric->SetUseMovingImageGradientFilter(false);
+    // 8 and 16-bit volumes are interpolated in fixed point wherever ITK's own metric code runs
+    metric->SetFixedInterpolator(TLinearInterpolator<TFixedImage<TPixel>>::New());
+    metric->SetMovingInterpolator(TLinearInterpolator<TMovingImage<TPixel>>::New());
+    return metric;
+}
+
+// Makes 'metric' take moving gradients the way 'opts' asks for. 'gradient' is the precomputed
+// gradient image of the moving image, if there is one.
+template <typename TPixel>
+void setGradientSource(TMetricBase<TPixel>* metric, TGradientImage<TPixel>* gradient,
+                       const RegistrationOptions& opts)
+{
+    if (opts.gradientSource == GradientSource::Precomputed && gradient != nullptr) {
+        auto filter = PrecomputedGradientFilter<TMovingImage<TPixel>, TGradientImage<TPixel>>::New();
+        filter->SetGradientImage(gradient);
+        metric->SetMovingImageGradientFilter(filter);
+        metric->SetUseMovingImageGradientFilter(true);
+    } else {
+        metric->SetUseMovingImageGradientFilter(opts.gradientSource == GradientSource::Filter);
+    }
+}
+
+// Gives 'metric' the moving mask, if there is one
+template <typename TPixel>
+void setMovingMask(TMetricBase<TPixel>* metric, const std::shared_ptr<const BitMask>& mask)
+{
+    if (mask) {
+        auto spatialObject = BitMaskSpatialObject::New();
+        spatialObject->SetMask(mask);
+        metric->SetMovingImageMask(spatialObject);
+    }
+}
+
+// Evaluates 'metric' and the generic ITK metric on the same samples and transform and prints how
+// far apart their values and derivatives are. Returns false if they differ by more than
+// 'tolerance', relative to the ITK value and to the largest ITK derivative component.
+template <typename TPixel, typename TStageTransform>
+bool checkMetric(const TMetric<TPixel, TStageTransform>* metric, const double tolerance)
+{
+    auto reference = TReferenceMetric<TPixel>::New();
+    reference->SetFixedImage(metric->GetFixedImage());
+    reference->SetMovingImage(metric->GetMovingImage());
+    reference->SetMovingTransform(const_cast<TMetric<TPixel, TStageTransform>*>(metric)->GetModifiableMovingTransform());
+    reference->SetVirtualDomainFromImage(metric->GetFixedImage());
+    reference->SetUseFixedImageGradientFilter(false);
+    reference->SetUseMovingImageGradientFilter(false);
+    reference->SetFixedSampledPointSet(metric->GetFixedSampledPointSet());
+    reference->SetUseFixedSampledPointSet(metric->GetUseFixedSampledPointSet());
+    reference->SetMovingImageMask(metric->GetMovingImageMask());
+    reference->SetMaximumNumberOfThreads(metric->GetMaximumNumberOfThreads());
+    reference->Initialize();
+
+    typename TMetric<TPixel, TStageTransform>::MeasureType value, referenceValue;
+    typename TMetric<TPixel, TStageTransform>::DerivativeType derivative, referenceDerivative;
+    metric->GetValueAndDerivative(value, derivative);
+    reference->GetValueAndDerivative(referenceValue, referenceDerivative);
+
+    double largest = 0.0, derivativeError = 0.0;
+    for (unsigned int p = 0; p < referenceDerivative.GetSize(); ++p) {
+        largest = std::max(largest, std::abs(referenceDerivative[p]));
+        derivativeError = std::max(derivativeError, std::abs(derivative[p] - referenceDerivative[p]));
+    }
+    const double valueError = std::abs(value - referenceValue) / std::max(std::abs(referenceValue), 1e-12);
+    derivativeError /= std::max(largest, 1e-12);
+
+    std::cout << "Metric check" << (metric->GetLastEvaluationWasFast() ? "" : " (generic path)")
+              << ": value " << value << " vs " << referenceValue << " (relative error " << valueError
+              << "), derivative " << derivative << " vs " << referenceDerivative << " (relative error "
+              << derivativeError << ")" << std::endl;
+    return valueError <= tolerance && derivativeError <= tolerance;
+}
+
+// Estimates optimizer scales from how far a small change of each parameter moves points of
+// the metric's virtual domain, and the learning rate for which the first step (along the scaled
+// metric derivative at the current position) moves no point further than 'opts.maximumStepSize'.
+// The optimizer normalizes the scaled derivative, so a step is 'learningRate' long whatever the
+// derivative's magnitude, and the rate is estimated on the unit step. 'metric' must be
+// initialized.
+template <typename TPixel>
+void estimatePhysicalShiftScales(TMetricBase<TPixel>* metric, const RegistrationOptions& opts,
+                                 TOptimizer::ScalesType& scales, double& learningRate)
+{
+    using TEstimator = itk::RegistrationParameterScalesFromPhysicalShift<TMetricBase<TPixel>>;
+    auto estimator = TEstimator::New();
+    estimator->SetMetric(metric);
+    estimator->SetTransformForward(true);
+    estimator->SetSamplingStrategy(TEstimator::RandomSampling);
+    estimator->SetNumberOfRandomSamples(opts.scaleSamples);
+    estimator->EstimateScales(scales);
+
+    typename TMetricBase<TPixel>::MeasureType value;
+    typename TMetricBase<TPixel>::DerivativeType derivative;
+    metric->GetValueAndDerivative(value, derivative);
+    TOptimizer::ParametersType step(derivative.GetSize());
+    for (uint32_t p = 0; p < step.GetSize(); ++p) {
+        step[p] = derivative[p] / scales[p];
+    }
+    const double magnitude = step.magnitude();
+    if (!(magnitude > 0.0) || !std::isfinite(magnitude)) {
+        learningRate = 1.0;
+        return;
+    }
+    step /= magnitude;
+    const double maximumStep = opts.maximumStepSize > 0.0 ? opts.maximumStepSize : estimator->EstimateMaximumStepSize();
+    const double stepScale = estimator->EstimateStepScale(step);
+    learningRate = stepScale > std::numeric_limits<double>::epsilon() ? maximumStep / stepScale : 1.0;
+
+    // The shift is only about linear in the step, so check what the first step really moves
+    step *= learningRate;
+    const double firstShift = estimator->EstimateStepScale(step);
+    if (!(firstShift > 0.5 * maximumStep && firstShift < 2.0 * maximumStep)) {
+        std::cerr << "[warning]: the first step moves points by " << firstShift << " instead of about "
+                  << maximumStep << std::endl;
+    }
+}
+
+// Runs the optimizer on one pyramid level. 'transform' holds the starting position and is
+// updated in place with the best position found at this level; 'scales' has an entry for each
+// of its parameters. Returns the optimizer so the caller can report how the level went. Either
+// mask may be null. With telemetry on, every record starts with 'telemetryFields'.
+template <typename TPixel, typename TStageTransform = TTransform>
+TOptimizer::Pointer registerLevel(typename TFixedImage<TPixel>::Pointer fixed,
+                                  typename TMovingImage<TPixel>::Pointer moving,
+                                  typename TGradientImage<TPixel>::Pointer movingGradient,
+                                  const std::shared_ptr<const BitMask>& fixedMask,
+                                  const std::shared_ptr<const BitMask>& movingMask,
+                                  typename TStageTransform::Pointer transform, const LevelSchedule& level,
+                                  const TOptimizer::ScalesType& scales, const RegistrationOptions& opts,
+                                  const std::string& telemetryFields)
+{
+    auto metric    = makeMetric<TPixel, TStageTransform>(opts);
+    auto optimizer = TOptimizer::New();
+
+    metric->SetFixedImage(fixed);
+    metric->SetMovingImage(moving);
+    metric->SetMovingTransform(transform);
+    metric->SetVirtualDomainFromImage(fixed);
+    setGradientSource<TPixel>(metric, movingGradient, opts);
+    setMovingMask<TPixel>(metric, movingMask);
+
+    // Restrict the metric to a subset of the fixed voxels (inside the fixed mask) if asked to
+    auto sampler = MetricSampleCommand<TMetricBase<TPixel>>::New();
+    sampler->Configure(metric, fixed, opts.samplingStrategy, opts.samplingPercentage, opts.samplingSeed,
+                       fixedMask.get());
+    sampler->Sample();
+    metric->Initialize();
+    if (opts.checkMetric &&
+        !checkMetric<TPixel, TStageTransform>(dynamic_cast<TMetric<TPixel, TStageTransform>*>(metric.GetPointer()), 1e-3)) {
+        std::cerr << "[warning]: the metric differs from ITK's by more than 1e-3" << std::endl;
+    }
+
+    if (opts.threadsPerRegistration > 0) {
+        metric->SetMaximumNumberOfThreads(opts.threadsPerRegistration);
+        optimizer->SetNumberOfThreads(opts.threadsPerRegistration);
+    }
+
+    auto levelScales  = scales;
+    auto learningRate = level.learningRate;
+    if (opts.scalesMode == ScalesMode::PhysicalShift) {
+        estimatePhysicalShiftScales<TPixel>(metric, opts, levelScales, learningRate);
+        if (!opts.quiet) {
+            std::cout << "Estimated scales = " << levelScales << ", learning rate = " << learningRate << std::endl;
         }
-        void Execute(const itk::Object * object, const itk::EventObject & event)
-        {
-            OptimizerPointer optimizer = static_cast<OptimizerPointer>(object);
-            if(!itk::IterationEvent().CheckEvent(&event)) {
-                return;
+    }
+
+    optimizer->SetMetric(metric);
+    optimizer->SetScales(levelScales);
+    optimizer->SetNumberOfIterations(level.numberOfIterations);
+    optimizer->SetLearningRate(learningRate);
+    optimizer->SetMinimumStepLength(level.minimumStepLength);
+    if (level.convergenceWindow > 0) {
+        optimizer->SetConvergenceWindowSize(level.convergenceWindow);
+        optimizer->SetMinimumConvergenceValue(level.minimumConvergence);
+    } else {
+        // The window never fills, so the check never passes
+        optimizer->SetConvergenceWindowSize(level.numberOfIterations + 1);
+    }
+    optimizer->SetReturnBestParametersAndValue(true);
+
+    auto observer = TelemetryObserver<TOptimizer>::New();
+    if (opts.telemetry) {
+        observer->Configure(opts.telemetry.get(), dynamic_cast<const MetricTimer*>(metric.GetPointer()),
+                            telemetryFields);
+        optimizer->AddObserver(itk::StartEvent(), observer);
+        optimizer->AddObserver(itk::IterationEvent(), observer);
+        observer->Start(transform->GetParameters());
+    }
+    if (opts.resampleEachIteration) {
+        optimizer->AddObserver(itk::IterationEvent(), sampler);
+    }
+
+    optimizer->StartOptimization();
+    if (opts.telemetry) {
+        observer->Summary(optimizer, "level");
+    }
+    return optimizer;
+}
+
+// The fixed volume and the pyramid levels derived from it. Built once, then only read, so any
+// number of registrations (also concurrent ones) can run against it.
+template <typename TPixel>
+struct FixedPyramid {
+    // Geometry of the whole fixed volume on disk, even if only a region of it was read
+    typename TFixedImage<TPixel>::Pointer header;
+    // One smoothed and shrunk image per level of the schedule, coarsest first
+    std::vector<typename TFixedImage<TPixel>::Pointer> levels;
+    // Where samples may be drawn, if restricted. Looked up by physical point, so it serves every level.
+    std::shared_ptr<const BitMask> mask;
+};
+
+template <typename TPixel>
+FixedPyramid<TPixel> buildFixedPyramid(const TFixedImage<TPixel>* header, typename TFixedImage<TPixel>::Pointer image,
+                                       const RegistrationOptions& opts)
+{
+    FixedPyramid<TPixel> pyramid;
+    pyramid.header = TFixedImage<TPixel>::New();
+    pyramid.header->CopyInformation(header);
+    for (const auto& level : opts.levels) {
+        pyramid.levels.push_back(makeLevelImage<TFixedImage<TPixel>>(image, level.smoothingSigma, level.shrinkFactor));
+    }
+    if (!opts.fixedMaskFilename.empty()) {
+        pyramid.mask = readMask(opts.fixedMaskFilename);
+    }
+    return pyramid;
+}
+
+// The moving volume at every level: only smoothed, since the fixed image's grid decides how
+// many samples are taken. With precomputed gradients it also holds their gradient images.
+// Levels with the same smoothing share their images, and all of them the mask.
+template <typename TPixel>
+struct MovingPyramid {
+    std::vector<typename TMovingImage<TPixel>::Pointer> levels;
+    std::vector<typename TGradientImage<TPixel>::Pointer> gradients;
+    std::shared_ptr<const BitMask> mask;
+};
+
+// Name of the cached gradient image of 'movingFilename' smoothed with 'sigma'
+inline std::string gradientCacheFilename(const std::string& movingFilename, const double sigma)
+{
+    std::ostringstream name;
+    const auto path = itksys::SystemTools::GetFilenamePath(movingFilename);
+    name << (path.empty() ? "" : path + "/")
+         << itksys::SystemTools::GetFilenameWithoutLastExtension(movingFilename) << ".gradient-s" << sigma << ".mha";
+    return name.str();
+}
+
+// Gradient image of 'image' (the moving volume smoothed with 'sigma'). With the cache on, a
+// cached one is used if it is newer than the moving volume and has the same geometry;
+// otherwise it is computed and, with the cache on, written for next time.
+template <typename TPixel>
+typename TGradientImage<TPixel>::Pointer movingGradientImage(const TMovingImage<TPixel>* image, const double sigma,
+                                                             const std::string& movingFilename,
+                                                             const RegistrationOptions& opts)
+{
+    const bool useCache = opts.gradientCache && !movingFilename.empty();
+    const auto cacheFilename = useCache ? gradientCacheFilename(movingFilename, sigma) : std::string();
+    int newer = -1;
+    if (useCache && itksys::SystemTools::FileExists(cacheFilename.c_str()) &&
+        itksys::SystemTools::FileTimeCompare(cacheFilename.c_str(), movingFilename.c_str(), &newer) && newer >= 0) {
+        std::lock_guard<std::mutex> lock(ioMutex());
+        auto reader = itk::ImageFileReader<TGradientImage<TPixel>>::New();
+        reader->SetFileName(cacheFilename);
+        reader->Update();
+        typename TGradientImage<TPixel>::Pointer cached = reader->GetOutput();
+        if (cached->GetLargestPossibleRegion() == image->GetLargestPossibleRegion() &&
+            cached->GetSpacing() == image->GetSpacing() && cached->GetOrigin() == image->GetOrigin() &&
+            cached->GetDirection() == image->GetDirection()) {
+            cached->DisconnectPipeline();
+            if (!opts.quiet) {
+                std::cout << "Using cached gradients " << cacheFilename << std::endl;
             }
-            std::cout << optimizer->GetCurrentIteration() << "     ";
-            std::cout << optimizer->GetValue() << "     ";
-            std::cout << optimizer->GetCurrentPosition() << std::endl;
+            return cached;
+        }
+    }
+
+    auto gradient = computeGradientImage<TMovingImage<TPixel>, TGradientImage<TPixel>>(image);
+    if (useCache) {
+        std::lock_guard<std::mutex> lock(ioMutex());
+        auto writer = itk::ImageFileWriter<TGradientImage<TPixel>>::New();
+        writer->SetFileName(cacheFilename);
+        writer->SetInput(gradient);
+        writer->Update();
+        if (!opts.quiet) {
+            std::cout << "Wrote gradient cache " << cacheFilename << std::endl;
+        }
+    }
+    return gradient;
+}
+
+template <typename TPixel>
+MovingPyramid<TPixel> buildMovingPyramid(typename TMovingImage<TPixel>::Pointer image,
+                                         const std::string& movingFilename, const RegistrationOptions& opts)
+{
+    MovingPyramid<TPixel> pyramid;
+    std::map<double, size_t> firstLevelWithSigma;
+    for (const auto& level : opts.levels) {
+        const auto same = firstLevelWithSigma.find(level.smoothingSigma);
+        if (same != firstLevelWithSigma.end()) {
+            pyramid.levels.push_back(pyramid.levels[same->second]);
+            pyramid.gradients.push_back(pyramid.gradients[same->second]);
+            continue;
+        }
+        firstLevelWithSigma[level.smoothingSigma] = pyramid.levels.size();
+        auto smoothed = makeLevelImage<TMovingImage<TPixel>>(image, level.smoothingSigma, 1);
+        typename TGradientImage<TPixel>::Pointer gradient;
+        if (opts.gradientSource == GradientSource::Precomputed) {
+            gradient = movingGradientImage<TPixel>(smoothed, level.smoothingSigma, movingFilename, opts);
         }
+        pyramid.levels.push_back(smoothed);
+        pyramid.gradients.push_back(gradient);
+    }
+    if (!opts.movingMaskFilename.empty()) {
+        pyramid.mask = readMask(opts.movingMaskFilename);
+        if (!pyramid.mask->SharesGridWith(image.GetPointer())) {
+            itkGenericExceptionMacro(<< "moving mask " << opts.movingMaskFilename
+                                     << " doesn't have the moving volume's size");
+        }
+    }
+    return pyramid;
+}
+
+// Outcome of running the whole pyramid
+struct PyramidResult {
+    uint32_t iterations;
+    double   value;
+    uint64_t validPoints;   // of the last metric evaluation at the finest level
+    std::vector<double> levelSeconds;
+    std::vector<std::string> stopConditions;   // why each level (its last stage) stopped
 };
 
-void printHelp(char* programName);
+// Which parameters of the similarity transform a staged registration optimizes, in the order the
+// stages run. The stages before the last optimize a transform with only those parameters, which
+// has a cheaper metric derivative and fewer directions for the optimizer to explore.
+enum class TransformStage { Translation, Rigid, Similarity };
+
+inline const char* stageName(const TransformStage stage)
+{
+    return stage == TransformStage::Translation ? "translation"
+                                                : stage == TransformStage::Rigid ? "rigid" : "similarity";
+}
+
+// Last stage level 'l' of 'numberOfLevels' runs: translation alone at the coarsest of three or
+// more levels, scale (if fitted at all) only at the finest level and rigid in between. Unstaged,
+// every level optimizes the whole transform: rigid, or similarity with 'fitScale'.
+inline TransformStage lastStage(const uint32_t l, const uint32_t numberOfLevels, const bool staged,
+                                const bool fitScale)
+{
+    const auto whole = fitScale ? TransformStage::Similarity : TransformStage::Rigid;
+    if (!staged || l + 1 == numberOfLevels) {
+        return whole;
+    }
+    return l == 0 && numberOfLevels >= 3 ? TransformStage::Translation : TransformStage::Rigid;
+}
+
+// The entries of the similarity transform's scales (versor 0-2, translation 3-5, scale 6) for
+// the parameters of 'stage'
+inline TOptimizer::ScalesType stageScales(const TOptimizer::ScalesType& scales, const TransformStage stage)
+{
+    if (stage == TransformStage::Similarity) {
+        return scales;
+    }
+    const uint32_t first = stage == TransformStage::Translation ? 3 : 0;
+    TOptimizer::ScalesType subset(6 - first);
+    for (uint32_t p = 0; p < subset.GetSize(); ++p) {
+        subset[p] = scales[first + p];
+    }
+    return subset;
+}
+
+// Moving a position between the similarity transform and the transforms of the earlier stages.
+// Going to a stage transform keeps the center; coming back only overwrites what the stage
+// optimized.
+inline void copyStage(const TTransform* from, TTranslationTransform* to)
+{
+    to->SetCenter(from->GetCenter());
+    to->SetMatrix(from->GetMatrix());
+    to->SetTranslation(from->GetTranslation());
+}
+inline void copyStage(const TTranslationTransform* from, TTransform* to)
+{
+    to->SetTranslation(from->GetTranslation());
+}
+inline void copyStage(const TTransform* from, TRigidTransform* to)
+{
+    to->SetCenter(from->GetCenter());
+    to->SetRotation(from->GetVersor());
+    to->SetTranslation(from->GetTranslation());
+}
+inline void copyStage(const TRigidTransform* from, TTransform* to)
+{
+    to->SetRotation(from->GetVersor());
+    to->SetTranslation(from->GetTranslation());
+}
+
+// registerLevel() for one of the earlier stages: optimizes a TStageTransform started from
+// 'transform' and copies the result back into it
+template <typename TPixel, typename TStageTransform>
+TOptimizer::Pointer registerStage(typename TFixedImage<TPixel>::Pointer fixed,
+                                  typename TMovingImage<TPixel>::Pointer moving,
+                                  typename TGradientImage<TPixel>::Pointer movingGradient,
+                                  const std::shared_ptr<const BitMask>& fixedMask,
+                                  const std::shared_ptr<const BitMask>& movingMask,
+                                  TTransform* transform, const LevelSchedule& level,
+                                  const TOptimizer::ScalesType& scales, const RegistrationOptions& opts,
+                                  const std::string& telemetryFields)
+{
+    auto stageTransform = TStageTransform::New();
+    copyStage(transform, stageTransform.GetPointer());
+    auto optimizer = registerLevel<TPixel, TStageTransform>(fixed, moving, movingGradient, fixedMask, movingMask,
+                                                            stageTransform, level, scales, opts, telemetryFields);
+    copyStage(stageTransform.GetPointer(), transform);
+    return optimizer;
+}
+
+// Runs every level of the pyramid coarse to fine, each level starting from where the previous
+// one stopped. 'transform' holds the starting position and ends up at the registered one.
+// Staged (opts.staged), a level runs each stage from the one after the previous level's last up
+// to its own last stage in turn, with the level's iterations each. Without opts.fitScale the
+// last stage is rigid. With it, a starting scale other than 1 can't be held by the rigid
+// transform, so then the rigid stage is left out, or replaced by the similarity one on a level
+// that would otherwise run nothing.
+template <typename TPixel>
+PyramidResult registerPyramid(const FixedPyramid<TPixel>& fixed, const MovingPyramid<TPixel>& moving,
+                              TTransform::Pointer transform, const TOptimizer::ScalesType& scales,
+                              const RegistrationOptions& opts, const std::string& telemetryFields)
+{
+    PyramidResult result = { 0, 0.0, 0, {}, {} };
+    const uint32_t numberOfLevels = uint32_t(opts.levels.size());
+    for (uint32_t l = 0; l < numberOfLevels; ++l) {
+        const auto& level = opts.levels[l];
+        if (!opts.quiet) {
+            std::cout << "Level " << l << ": shrink = " << level.shrinkFactor
+                      << ", sigma = " << level.smoothingSigma << std::endl;
+        }
+        const auto levelStart = std::chrono::steady_clock::now();
+        const auto last  = lastStage(l, numberOfLevels, opts.staged, opts.fitScale);
+        const auto first = l == 0 ? (opts.staged ? TransformStage::Translation : last)
+                                  : std::min(TransformStage(int(lastStage(l - 1, numberOfLevels, opts.staged,
+                                                                          opts.fitScale)) + 1), last);
+        TOptimizer::Pointer optimizer;
+        uint32_t levelIterations = 0;
+        for (auto next = first; next <= last; next = TransformStage(int(next) + 1)) {
+            auto stage = next;
+            if (stage == TransformStage::Rigid && opts.fitScale && transform->GetScale() != 1.0) {
+                if (optimizer) {
+                    continue;
+                }
+                stage = TransformStage::Similarity;
+            }
+            auto fields = telemetryFields + "\"level\": " + std::to_string(l) + ", ";
+            if (opts.staged) {
+                fields += std::string("\"stage\": \"") + stageName(stage) + "\", ";
+                if (!opts.quiet) {
+                    std::cout << "Stage: " << stageName(stage) << std::endl;
+                }
+            }
+            const auto stageScaling = stageScales(scales, stage);
+            if (stage == TransformStage::Translation) {
+                optimizer = registerStage<TPixel, TTranslationTransform>(
+                    fixed.levels[l], moving.levels[l], moving.gradients[l], fixed.mask, moving.mask,
+                    transform.GetPointer(), level, stageScaling, opts, fields);
+            } else if (stage == TransformStage::Rigid) {
+                optimizer = registerStage<TPixel, TRigidTransform>(
+                    fixed.levels[l], moving.levels[l], moving.gradients[l], fixed.mask, moving.mask,
+                    transform.GetPointer(), level, stageScaling, opts, fields);
+            } else {
+                optimizer = registerLevel<TPixel>(fixed.levels[l], moving.levels[l], moving.gradients[l], fixed.mask,
+                                                  moving.mask, transform, level, stageScaling, opts, fields);
+            }
+            levelIterations += optimizer->GetCurrentIteration();
+            if (!opts.quiet) {
+                std::cout << "Optimizer stop condition: " << optimizer->GetStopConditionDescription() << std::endl;
+            }
+        }
+        const std::chrono::duration<double> levelTime = std::chrono::steady_clock::now() - levelStart;
+        if (!opts.quiet) {
+            std::cout << "Level " << l << " took " << levelTime.count() << " s for "
+                      << levelIterations << " iterations ("
+                      << 1000.0 * levelTime.count() / std::max(1u, levelIterations)
+                      << " ms/iteration)" << std::endl;
+        }
+        result.iterations += levelIterations;
+        result.value = optimizer->GetValue();
+        const auto metric = dynamic_cast<const TMetricBase<TPixel>*>(optimizer->GetMetric());
+        result.validPoints = metric != nullptr ? metric->GetNumberOfValidPoints() : 0;
+        result.levelSeconds.push_back(levelTime.count());
+        result.stopConditions.push_back(optimizer->GetStopConditionDescription());
+    }
+    return result;
+}
+
+// Resamples 'moving' with 'transform' onto the grid of the whole fixed volume described by
+// 'fixedHeader' and writes it to 'filename' in the moving pixel type. The writer pulls the output
+// through the resampler in 'streamDivisions' pieces, so with a streaming format only one piece of
+// the (possibly larger than memory) output exists at a time.
+template <typename TPixel>
+void writeResampled(typename TMovingImage<TPixel>::Pointer moving, const TFixedImage<TPixel>* fixedHeader,
+                    const TTransform* transform, const std::string& filename, const uint32_t streamDivisions,
+                    const double defaultValue)
+{
+    using TOutputImage = TFixedImage<TPixel>;
+    auto resampler = itk::ResampleImageFilter<TMovingImage<TPixel>, TOutputImage>::New();
+    resampler->SetInput(moving);
+    resampler->SetTransform(transform);
+    resampler->SetInterpolator(TLinearInterpolator<TMovingImage<TPixel>>::New());
+    resampler->SetOutputParametersFromImage(fixedHeader);
+    resampler->SetDefaultPixelValue(static_cast<TPixel>(defaultValue));
+
+    auto writer = itk::ImageFileWriter<TOutputImage>::New();
+    writer->SetFileName(filename);
+    writer->SetInput(resampler->GetOutput());
+    writer->SetNumberOfStreamDivisions(streamDivisions);
+    writer->Update();
+}
@@ -0,0 +1,90 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+// Threads that are started once and then handed one task after another, for work that is run far
+// too often to start threads for it each time (a metric evaluation, say). Run() calls the task
+// with thread numbers 0 to n - 1, number 0 on the calling thread, and returns once all of them
+// are done. One Run() at a time.
+class WorkerPool
+{
+    public:
+        WorkerPool() = default;
+        WorkerPool(const WorkerPool&) = delete;
+        WorkerPool& operator=(const WorkerPool&) = delete;
+
+        ~WorkerPool()
+        {
+            {
+                std::lock_guard<std::mutex> lock(m_Mutex);
+                m_Stop = true;
+            }
+            m_Start.notify_all();
+            for (auto& thread : m_Threads) {
+                thread.join();
+            }
+        }
+
+        void Run(const size_t numberOfThreads, const std::function<void(size_t)>& task)
+        {
+            if (numberOfThreads <= 1) {
+                task(0);
+                return;
+            }
+            {
+                std::lock_guard<std::mutex> lock(m_Mutex);
+                while (m_Threads.size() + 1 < numberOfThreads) {
+                    m_Threads.emplace_back(&WorkerPool::Work, this, m_Threads.size() + 1, m_Generation);
+                }
+                m_Task = &task;
+                m_NumberOfThreads = numberOfThreads;
+                m_Pending = numberOfThreads - 1;
+                ++m_Generation;
+            }
+            m_Start.notify_all();
+            task(0);
+            std::unique_lock<std::mutex> lock(m_Mutex);
+            m_Done.wait(lock, [this]() { return m_Pending == 0; });
+            m_Task = nullptr;
+        }
+
+    private:
+        // Thread number 't', waiting for tasks from the one after 'generation' on
+        void Work(const size_t t, uint64_t generation)
+        {
+            std::unique_lock<std::mutex> lock(m_Mutex);
+            for (;;) {
+                m_Start.wait(lock, [&]() { return m_Stop || m_Generation != generation; });
+                if (m_Stop) {
+                    return;
+                }
+                generation = m_Generation;
+                if (t >= m_NumberOfThreads) {
+                    continue;
+                }
+                const auto task = m_Task;
+                lock.unlock();
+                (*task)(t);
+                lock.lock();
+                if (--m_Pending == 0) {
+                    m_Done.notify_one();
+                }
+            }
+        }
+
+        std::mutex m_Mutex;
+        std::condition_variable m_Start;
+        std::condition_variable m_Done;
+        std::vector<std::thread> m_Threads;
+        const std::function<void(size_t)>* m_Task = nullptr;
+        size_t m_NumberOfThreads = 0;
+        size_t m_Pending = 0;
+        uint64_t m_Generation = 0;
+        bool m_Stop = false;
+};
@@ -17,6 +17,7 @@
 // PointSet
 #include "itkPointSet.h"
 #include "PointSetUtil.h"
+#include "MappedImage.h"
 
 
 template <typename TPixel, uint32_t TDimension>
@@ -43,7 +44,13 @@ void extractSandGrainCentroids(const std::string inputFile, const std::string ou
     const TPixel hIntensityUnits = TPixel( floor(H * pixelMax) );
     std::cout << "hIntensityUnits = " << uint32_t(hIntensityUnits) << std::endl;
     convexFilter->SetHeight(hIntensityUnits);
-    convexFilter->SetInput(reader->GetOutput());
+    // An uncompressed MetaImage is mapped and filtered in place instead of being read first
+    const auto mapped = mapMetaImage<ImageType>(inputFile, MappedAccess::Whole);
+    if (mapped) {
+        convexFilter->SetInput(mapped);
+    } else {
+        convexFilter->SetInput(reader->GetOutput());
+    }
 
     // Set and configure BinaryThreshold filter. This will binarize the image
     // so that anything below threshVal will be put to 0, and anything above
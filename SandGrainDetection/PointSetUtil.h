@@ -1,13 +1,86 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstring>
 #include <iostream>
+#include <limits>
 #include <fstream>
 #include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#if defined(__AVX2__) && defined(__FMA__)
+#include <immintrin.h>
+#endif
 
-#include "itkMesh.h"
+#include "itkByteSwapper.h"
+#include "itkImage.h"
+#include "itkMultiThreader.h"
 #include "itkPointSet.h"
-#include "itkTransformMeshFilter.h"
+#include "itkSignedMaurerDistanceMapImageFilter.h"
+#include "itksys/SystemTools.hxx"
+#include "MappedImage.h"
+
+
+// Point set files come as text (the number of points, the dimension, then one point per line)
+// or binary: a PointFileHeader and then the coordinates of all points one after the other, all
+// little-endian. Binary files are written for filenames ending in .bin; either is read.
+enum class PointFileFormat { Text, Binary };
+
+enum PointElementType : uint32_t { PointElementFloat = 1, PointElementDouble = 2 };
+
+struct PointFileHeader
+{
+    char magic[8];            // PointFileMagic
+    uint32_t version;         // PointFileVersion
+    uint32_t dimension;
+    uint32_t elementType;     // PointElementType
+    uint32_t elementSize;     // bytes per coordinate
+    uint64_t numberOfPoints;
+};
+static_assert(sizeof(PointFileHeader) == 32, "PointFileHeader must have no padding");
+
+const char PointFileMagic[8] = { 'P', 'O', 'I', 'N', 'T', 'S', '\0', '\0' };
+const uint32_t PointFileVersion = 1;
+
+template <typename TElement>
+uint32_t pointElementType()
+{
+    static_assert(std::is_same<TElement, float>::value || std::is_same<TElement, double>::value,
+                  "binary point files hold float or double coordinates");
+    return std::is_same<TElement, float>::value ? PointElementFloat : PointElementDouble;
+}
+
+inline PointFileFormat pointFileFormat(const std::string& filename)
+{
+    return itksys::SystemTools::GetFilenameLastExtension(filename) == ".bin" ? PointFileFormat::Binary
+                                                                             : PointFileFormat::Text;
+}
+
+// Byte swaps 'count' values of T in place if the host is big-endian (files are little-endian)
+template <typename T>
+void littleEndianInPlace(T* values, const uint64_t count)
+{
+    itk::ByteSwapper<T>::SwapRangeFromSystemToLittleEndian(values, count);
+}
 
+// 'count' little-endian TSource values at 'from' as TTarget
+template <typename TSource, typename TTarget>
+void convertCoordinates(const char* from, TTarget* to, const uint64_t count)
+{
+    for (uint64_t i = 0; i < count; ++i) {
+        TSource value;
+        std::memcpy(&value, from + i * sizeof(TSource), sizeof(TSource));
+        littleEndianInPlace(&value, 1);
+        to[i] = TTarget(value);
+    }
+}
 
-// Writes PointSet 'points' to file named 'filename'
+// Writes PointSet 'points' to file named 'filename', as text or binary according to its
+// extension. Returns -1 if there are no points or the file can't be written.
 template <typename TElement, const uint32_t TDimension>
 const int32_t writeToFile(const std::string filename,
                           const typename itk::PointSet<TElement, TDimension>::Pointer points)
@@ -17,7 +90,37 @@ const int32_t writeToFile(const std::string filename,
         return -1;
     }
 
-    // Writing binary file
+    if (pointFileFormat(filename) == PointFileFormat::Binary) {
+        std::ofstream pointsFile(filename, std::ios::out | std::ios::binary);
+        if (!pointsFile.is_open()) {
+            return -1;
+        }
+        PointFileHeader header;
+        std::copy(PointFileMagic, PointFileMagic + 8, header.magic);
+        header.version        = PointFileVersion;
+        header.dimension      = TDimension;
+        header.elementType    = pointElementType<TElement>();
+        header.elementSize    = sizeof(TElement);
+        header.numberOfPoints = points->GetNumberOfPoints();
+        littleEndianInPlace(&header.version, 4);    // version through elementSize
+        littleEndianInPlace(&header.numberOfPoints, 1);
+        pointsFile.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+        // The points container is one array of coordinates already; write it in one go
+        const auto& container = points->GetPoints()->CastToSTLConstContainer();
+        if (itk::ByteSwapper<TElement>::SystemIsLittleEndian()) {
+            pointsFile.write(reinterpret_cast<const char*>(container.data()),
+                             std::streamsize(container.size() * sizeof(container[0])));
+        } else {
+            for (auto p : container) {
+                littleEndianInPlace(p.GetDataPointer(), TDimension);
+                pointsFile.write(reinterpret_cast<const char*>(p.GetDataPointer()), sizeof(p));
+            }
+        }
+        return pointsFile ? 0 : -1;
+    }
+
+    // Writing text file
     std::ofstream pointsFile(filename, std::ios::out);
     const uint32_t numPoints = uint32_t(points->GetNumberOfPoints());
 
@@ -45,13 +148,94 @@ const int32_t writeToFile(const std::string filename,
     return -1;
 }
 
-// Read PointSet from file named 'filename' and return pointer to it
+// Points of binary point file 'filename' (see PointFileHeader), or null if it is malformed. The
+// file is mapped and its payload copied into the points container in one go; coordinates only
+// need converting if they aren't TElement already.
+template <typename TElement, uint32_t TDimension>
+typename itk::PointSet<TElement, TDimension>::Pointer
+readBinaryFile(const std::string& filename)
+{
+    using TPointSet = itk::PointSet<TElement, TDimension>;
+    using TPoint    = typename TPointSet::PointType;
+    static_assert(sizeof(TPoint) == TDimension * sizeof(TElement), "points must be plain coordinate arrays");
+
+    const uint64_t fileBytes = itksys::SystemTools::FileLength(filename);
+    PointFileHeader header;
+    std::ifstream pointsFile(filename, std::ios::in | std::ios::binary);
+    if (fileBytes < sizeof(header) || !pointsFile.read(reinterpret_cast<char*>(&header), sizeof(header))) {
+        std::cerr << "[error]: " << filename << " is not a point file" << std::endl;
+        return nullptr;
+    }
+    littleEndianInPlace(&header.version, 4);
+    littleEndianInPlace(&header.numberOfPoints, 1);
+    if (header.version != PointFileVersion) {
+        std::cerr << "[error]: " << filename << " is a version " << header.version
+                  << " point file; only version " << PointFileVersion << " can be read" << std::endl;
+        return nullptr;
+    }
+    if (header.dimension != TDimension) {
+        std::cerr << "[error]: trying to read " << header.dimension << "D PointSet into "
+                  << TDimension << "D PointSet" << std::endl;
+        exit(1);
+    }
+    const bool isFloat  = header.elementType == PointElementFloat && header.elementSize == sizeof(float);
+    const bool isDouble = header.elementType == PointElementDouble && header.elementSize == sizeof(double);
+    if (!(isFloat || isDouble) ||
+        header.numberOfPoints > (fileBytes - sizeof(header)) / (TDimension * header.elementSize)) {
+        std::cerr << "[error]: " << filename << " is truncated or has an unknown coordinate type" << std::endl;
+        return nullptr;
+    }
+    const uint64_t numberOfValues = header.numberOfPoints * TDimension;
+    const uint64_t payloadBytes   = numberOfValues * header.elementSize;
+
+    auto container = TPointSet::PointsContainer::New();
+    container->Reserve(header.numberOfPoints);
+    auto values = reinterpret_cast<TElement*>(container->CastToSTLContainer().data());
+    const bool sameType = header.elementType == pointElementType<TElement>();
+    std::vector<char> buffer;
+    const char* payload = nullptr;
+    const auto mapping = FileMapping::Open(filename, sizeof(header), payloadBytes, MappedAccess::Sequential);
+    if (mapping) {
+        payload = mapping->GetData();
+    } else if (sameType) {
+        pointsFile.read(reinterpret_cast<char*>(values), std::streamsize(payloadBytes));
+        payload = reinterpret_cast<const char*>(values);
+    } else {
+        buffer.resize(payloadBytes);
+        pointsFile.read(buffer.data(), std::streamsize(payloadBytes));
+        payload = buffer.data();
+    }
+    if (sameType) {
+        if (payload != reinterpret_cast<const char*>(values)) {
+            std::memcpy(values, payload, payloadBytes);
+        }
+        littleEndianInPlace(values, numberOfValues);
+    } else if (isDouble) {
+        convertCoordinates<double>(payload, values, numberOfValues);
+    } else {
+        convertCoordinates<float>(payload, values, numberOfValues);
+    }
+
+    auto points = TPointSet::New();
+    points->SetPoints(container);
+    return points;
+}
+
+// Read PointSet from file named 'filename' and return pointer to it. Binary point files are
+// recognized by their magic number; anything else is read as text.
 template <typename TElement, uint32_t TDimension>
 const typename itk::PointSet<TElement, TDimension>::Pointer
 readFromFile(const std::string filename)
 {
     std::ifstream pointsFile(filename, std::ios::in);
     if (pointsFile.is_open()) {
+        char magic[sizeof(PointFileMagic)] = {};
+        if (pointsFile.read(magic, sizeof(magic)) && std::equal(magic, magic + sizeof(magic), PointFileMagic)) {
+            return readBinaryFile<TElement, TDimension>(filename);
+        }
+        pointsFile.clear();
+        pointsFile.seekg(0);
+
         // Read in metadata (number of points, dimension of each point)
         uint32_t numPoints = 0;
         pointsFile >> numPoints;
@@ -65,15 +249,17 @@ readFromFile(const std::string filename)
             exit(1);
         }
 
-        // Read in point data
-        typename itk::PointSet<TElement, TDimension>::PointType p;
-        auto points = itk::PointSet<TElement, TDimension>::New();
+        // Read in point data, straight into a container of the right size
+        auto container = itk::PointSet<TElement, TDimension>::PointsContainer::New();
+        container->Reserve(numPoints);
         for (auto i = 0; i < numPoints; ++i) {
+            auto& p = container->ElementAt(i);
             for (auto j = 0; j < pointDimension; ++j) {
                 pointsFile >> p[j];
             }
-            points->SetPoint(i, p);
         }
+        auto points = itk::PointSet<TElement, TDimension>::New();
+        points->SetPoints(container);
 
         return points;
     } else {
@@ -81,30 +267,116 @@ readFromFile(const std::string filename)
     }
 }
 
+// Maps 'count' points, stored as their coordinates one after the other at 'coordinates', through
+// x -> matrix x + offset in place. The points are split into chunks that 'threads' threads (0:
+// ITK's default) take in turn. With AVX2, 3D double points go 4 at a time: their 12 coordinates
+// are loaded as 3 vectors, shuffled into one vector each of x, y and z, mapped with fused
+// multiply-adds and shuffled back. The few points left over take the scalar loop, which then
+// fuses the same multiply-adds in the same order, so every point maps to the same result.
 template <typename TElement, uint32_t TDimension>
-typename itk::Mesh<TElement, TDimension>::Pointer
-pointSet2Mesh(const typename itk::PointSet<TElement, TDimension>::Pointer points)
+void transformCoordinates(TElement* coordinates, const uint64_t count, const double matrix[TDimension][TDimension],
+                          const double offset[TDimension], const uint32_t threads = 0)
 {
-    auto mesh = itk::Mesh<TElement, TDimension>::New();
-    for (auto i = 0; i < points->GetNumberOfPoints(); ++i) {
-        mesh->SetPoint(i, points->GetPoint(i));
+    auto transformRange = [&](uint64_t begin, const uint64_t end) {
+#if defined(__AVX2__) && defined(__FMA__)
+        if (std::is_same<TElement, double>::value && TDimension == 3) {
+            __m256d m[3][3], shift[3];
+            for (uint32_t r = 0; r < 3; ++r) {
+                shift[r] = _mm256_set1_pd(offset[r]);
+                for (uint32_t c = 0; c < 3; ++c) {
+                    m[r][c] = _mm256_set1_pd(matrix[r][c]);
+                }
+            }
+            double* p = reinterpret_cast<double*>(coordinates) + 3 * begin;
+            for (; begin + 4 <= end; begin += 4, p += 12) {
+                // a = x0 y0 z0 x1, b = y1 z1 x2 y2, c = z2 x3 y3 z3
+                const __m256d a = _mm256_loadu_pd(p);
+                const __m256d b = _mm256_loadu_pd(p + 4);
+                const __m256d c = _mm256_loadu_pd(p + 8);
+                // u = x0 y0 x2 y2, v = z0 x1 z2 x3, w = y1 z1 y3 z3
+                const __m256d u = _mm256_blend_pd(a, b, 0xC);
+                const __m256d v = _mm256_permute2f128_pd(a, c, 0x21);
+                const __m256d w = _mm256_blend_pd(b, c, 0xC);
+                const __m256d x = _mm256_shuffle_pd(u, v, 0xA);
+                const __m256d y = _mm256_shuffle_pd(u, w, 0x5);
+                const __m256d z = _mm256_shuffle_pd(v, w, 0xA);
+                __m256d mapped[3];
+                for (uint32_t r = 0; r < 3; ++r) {
+                    mapped[r] = _mm256_fmadd_pd(m[r][2], z, _mm256_fmadd_pd(m[r][1], y,
+                                                                            _mm256_fmadd_pd(m[r][0], x, shift[r])));
+                }
+                const __m256d mappedU = _mm256_shuffle_pd(mapped[0], mapped[1], 0x0);
+                const __m256d mappedV = _mm256_shuffle_pd(mapped[2], mapped[0], 0xA);
+                const __m256d mappedW = _mm256_shuffle_pd(mapped[1], mapped[2], 0xF);
+                _mm256_storeu_pd(p,     _mm256_permute2f128_pd(mappedU, mappedV, 0x20));
+                _mm256_storeu_pd(p + 4, _mm256_blend_pd(mappedW, mappedU, 0xC));
+                _mm256_storeu_pd(p + 8, _mm256_permute2f128_pd(mappedV, mappedW, 0x31));
+            }
+        }
+#endif
+        for (uint64_t i = begin; i < end; ++i) {
+            TElement* p = coordinates + TDimension * i;
+            double mapped[TDimension];
+            for (uint32_t r = 0; r < TDimension; ++r) {
+                mapped[r] = offset[r];
+                for (uint32_t c = 0; c < TDimension; ++c) {
+#if defined(__AVX2__) && defined(__FMA__)
+                    mapped[r] = std::fma(matrix[r][c], double(p[c]), mapped[r]);
+#else
+                    mapped[r] += matrix[r][c] * double(p[c]);
+#endif
+                }
+            }
+            for (uint32_t r = 0; r < TDimension; ++r) {
+                p[r] = TElement(mapped[r]);
+            }
+        }
+    };
+
+    const uint64_t chunkSize = 1 << 16;
+    const uint64_t numberOfChunks = (count + chunkSize - 1) / chunkSize;
+    const uint64_t numberOfThreads = std::max<uint64_t>(1, std::min<uint64_t>(
+        threads > 0 ? threads : itk::MultiThreader::GetGlobalDefaultNumberOfThreads(), numberOfChunks));
+    std::atomic<uint64_t> next(0);
+    auto worker = [&]() {
+        for (uint64_t chunk = next++; chunk < numberOfChunks; chunk = next++) {
+            transformRange(chunk * chunkSize, std::min<uint64_t>(count, (chunk + 1) * chunkSize));
+        }
+    };
+    if (numberOfThreads == 1) {
+        worker();
+    } else {
+        std::vector<std::thread> workers;
+        for (uint64_t t = 0; t < numberOfThreads; ++t) {
+            workers.emplace_back(worker);
+        }
+        for (auto& thread : workers) {
+            thread.join();
+        }
     }
-    return mesh;
 }
 
-template <typename TElement, uint32_t TDimension>
-typename itk::PointSet<TElement, TDimension>::Pointer
-mesh2PointSet(const typename itk::Mesh<TElement, TDimension>::Pointer points)
+// Transforms 'points' in place by 'transform', which has a matrix and an offset (e.g. a
+// Similarity3DTransform) and MUST be set up before this
+template <typename TElement, uint32_t TDimension, typename TTransform>
+void transformPointsInPlace(const typename itk::PointSet<TElement, TDimension>::Pointer points,
+                            const TTransform* transform, const uint32_t threads = 0)
 {
-    auto pointSet = itk::PointSet<TElement, TDimension>::New();
-    for (auto i = 0; i < points->GetNumberOfPoints(); ++i) {
-        pointSet->SetPoint(i, points->GetPoint(i));
+    using TPoint = typename itk::PointSet<TElement, TDimension>::PointType;
+    static_assert(sizeof(TPoint) == TDimension * sizeof(TElement), "points must be plain coordinate arrays");
+    double matrix[TDimension][TDimension], offset[TDimension];
+    for (uint32_t r = 0; r < TDimension; ++r) {
+        for (uint32_t c = 0; c < TDimension; ++c) {
+            matrix[r][c] = transform->GetMatrix()[r][c];
+        }
+        offset[r] = transform->GetOffset()[r];
     }
-    return pointSet;
+    auto& container = points->GetPoints()->CastToSTLContainer();
+    transformCoordinates<TElement, TDimension>(reinterpret_cast<TElement*>(container.data()), container.size(),
+                                               matrix, offset, threads);
+    points->Modified();
 }
 
-
-
 // Transform PointSet by applying specific Transform
 // 'transform' MUST be set up before this (e.g. with your params and such)
 template <typename TElement, uint32_t TDimension, typename TTransform>
@@ -112,25 +384,139 @@ typename itk::PointSet<TElement, TDimension>::Pointer
 applyTransform(const typename itk::PointSet<TElement, TDimension>::Pointer points,
                const typename TTransform::Pointer transform)
 {
-    // Need to convert to mesh first to do transformation
-    auto mesh = pointSet2Mesh<TElement, TDimension>(points);
-
-    // Create transform
-    using TMesh = itk::Mesh<TElement, TDimension>;
-    auto transformFilter = itk::TransformMeshFilter<TMesh, TMesh, TTransform>::New();
-    transformFilter->SetInput(mesh);
-    transformFilter->SetTransform(transform);
-
-    // Run transform
-    try {
-        transformFilter->Update();
-    } catch (itk::ExceptionObject& ex) {
-        std::cerr << "[error]: itk::ExceptionObject caught" << std::endl;
-        std::cerr << ex << std::endl;
-        exit(1);
+    // Copy the points in one go and transform the copy
+    auto container = itk::PointSet<TElement, TDimension>::PointsContainer::New();
+    container->CastToSTLContainer() = points->GetPoints()->CastToSTLConstContainer();
+    auto transformedPoints = itk::PointSet<TElement, TDimension>::New();
+    transformedPoints->SetPoints(container);
+    transformPointsInPlace<TElement, TDimension, TTransform>(transformedPoints, transform.GetPointer());
+    return transformedPoints;
+}
+
+// Optimizer scales for the v3 optimizers, which work on each parameter multiplied by its scale:
+// the farthest a unit change of the parameter moves any of (up to 'maxSamples' of) 'points'
+// under 'transform' at its current parameters. A unit step in any scaled parameter then moves
+// points about equally far, whatever the spacing and extent of the points.
+template <typename TElement, uint32_t TDimension, typename TTransform>
+typename TTransform::ParametersType
+physicalShiftScales(const typename itk::PointSet<TElement, TDimension>::Pointer points,
+                    const TTransform* transform, const uint64_t maxSamples = 1000)
+{
+    const double delta = 1e-3;
+    const auto parameters = transform->GetParameters();
+    auto shifted = TTransform::New();
+    shifted->SetFixedParameters(transform->GetFixedParameters());
+
+    typename TTransform::ParametersType scales(parameters.GetSize());
+    const uint64_t numberOfPoints = points->GetNumberOfPoints();
+    const uint64_t stride = std::max<uint64_t>(1, numberOfPoints / maxSamples);
+    for (uint32_t p = 0; p < parameters.GetSize(); ++p) {
+        auto changed = parameters;
+        changed[p] += delta;
+        shifted->SetParameters(changed);
+        double maxShift = 0.0;
+        for (uint64_t i = 0; i < numberOfPoints; i += stride) {
+            const auto point = points->GetPoint(i);
+            maxShift = std::max(maxShift, (shifted->TransformPoint(point) - transform->TransformPoint(point)).GetNorm());
+        }
+        scales[p] = maxShift > 0.0 ? maxShift / delta : 1.0;
     }
+    return scales;
+}
 
-    // Convert back to PointSet
-    auto transformedPoints = mesh2PointSet<TElement, TDimension>(transformFilter->GetOutput());
-    return transformedPoints;
+// Smallest and largest coordinate of 'points' along each axis
+template <typename TElement, uint32_t TDimension>
+void pointBounds(const typename itk::PointSet<TElement, TDimension>::Pointer points,
+                 typename itk::PointSet<TElement, TDimension>::PointType& lower,
+                 typename itk::PointSet<TElement, TDimension>::PointType& upper)
+{
+    lower.Fill(std::numeric_limits<double>::max());
+    upper.Fill(std::numeric_limits<double>::lowest());
+    for (auto i = 0; i < points->GetNumberOfPoints(); ++i) {
+        const auto p = points->GetPoint(i);
+        for (uint32_t d = 0; d < TDimension; ++d) {
+            lower[d] = std::min<double>(lower[d], p[d]);
+            upper[d] = std::max<double>(upper[d], p[d]);
+        }
+    }
+}
+
+// Counts of 'points' per cell of a grid with 'cellSize' spacing, covering the points' bounding box
+template <typename TElement, uint32_t TDimension>
+typename itk::Image<float, TDimension>::Pointer
+rasterizePoints(const typename itk::PointSet<TElement, TDimension>::Pointer points, const double cellSize)
+{
+    using TImage = itk::Image<float, TDimension>;
+    typename itk::PointSet<TElement, TDimension>::PointType lower, upper;
+    pointBounds<TElement, TDimension>(points, lower, upper);
+    typename TImage::PointType origin;
+    typename TImage::SizeType size;
+    for (uint32_t d = 0; d < TDimension; ++d) {
+        origin[d] = lower[d];
+        size[d] = uint64_t((upper[d] - lower[d]) / cellSize) + 2;
+    }
+    auto image = TImage::New();
+    image->SetRegions(typename TImage::RegionType(size));
+    image->SetOrigin(origin);
+    image->SetSpacing(cellSize);
+    image->Allocate();
+    image->FillBuffer(0.0f);
+
+    typename TImage::IndexType index;
+    for (auto i = 0; i < points->GetNumberOfPoints(); ++i) {
+        if (image->TransformPhysicalPointToIndex(points->GetPoint(i), index)) {
+            image->SetPixel(index, image->GetPixel(index) + 1.0f);
+        }
+    }
+    return image;
+}
+
+// Distance (physical units) from every voxel center of a grid with 'spacing' to the nearest of
+// 'points'. The grid covers the points' bounding box padded by 'margin' on every side. Points are
+// rasterized to the voxel they fall in, so distances are to those voxels' centers, off by at most
+// half a voxel diagonal.
+template <typename TElement, uint32_t TDimension>
+typename itk::Image<float, TDimension>::Pointer
+pointDistanceMap(const typename itk::PointSet<TElement, TDimension>::Pointer points, const double spacing,
+                 const double margin)
+{
+    using TSites = itk::Image<uint8_t, TDimension>;
+    using TMap   = itk::Image<float, TDimension>;
+    typename itk::PointSet<TElement, TDimension>::PointType lower, upper;
+    pointBounds<TElement, TDimension>(points, lower, upper);
+    typename TSites::PointType origin;
+    typename TSites::SizeType size;
+    for (uint32_t d = 0; d < TDimension; ++d) {
+        origin[d] = lower[d] - margin;
+        size[d] = uint64_t((upper[d] - lower[d] + 2.0 * margin) / spacing) + 2;
+    }
+    auto sites = TSites::New();
+    sites->SetRegions(typename TSites::RegionType(size));
+    sites->SetOrigin(origin);
+    sites->SetSpacing(spacing);
+    sites->Allocate();
+    sites->FillBuffer(0);
+    typename TSites::IndexType index;
+    for (auto i = 0; i < points->GetNumberOfPoints(); ++i) {
+        if (sites->TransformPhysicalPointToIndex(points->GetPoint(i), index)) {
+            sites->SetPixel(index, 1);
+        }
+    }
+
+    // The signed distance is the plain one outside the site voxels; inside them (only where sites
+    // are packed tightly enough to have voxels not on their border) it is clamped to 0
+    auto distance = itk::SignedMaurerDistanceMapImageFilter<TSites, TMap>::New();
+    distance->SetInput(sites);
+    distance->SetBackgroundValue(0);
+    distance->SetUseImageSpacing(true);
+    distance->SetSquaredDistance(false);
+    distance->SetInsideIsPositive(false);
+    distance->Update();
+    typename TMap::Pointer map = distance->GetOutput();
+    map->DisconnectPipeline();
+    float* buffer = map->GetBufferPointer();
+    for (uint64_t i = 0; i < map->GetBufferedRegion().GetNumberOfPixels(); ++i) {
+        buffer[i] = std::max(buffer[i], 0.0f);
+    }
+    return map;
 }
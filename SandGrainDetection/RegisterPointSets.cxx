@@ -1,14 +1,26 @@
+#include <algorithm>
+#include <chrono>
 #include <iostream>
 #include <fstream>
 #include <cmath>
+#include <limits>
+#include <sstream>
 
 #include "itkAffineTransform.h"
+#include "itkImageFileWriter.h"
 #include "itkEuclideanDistancePointMetric.h"
 #include "itkPointSetToPointSetRegistrationMethod.h"
 #include "itkEuclideanDistancePointMetric.h"
 #include "itkSimilarity3DTransform.h"
 #include "itkLevenbergMarquardtOptimizer.h"
+#include "itkSmoothingRecursiveGaussianImageFilter.h"
+#include "itksys/SystemTools.hxx"
+#include "KdTreePointMetric.h"
+#include "MappedImage.h"
 #include "PointSetUtil.h"
+#include "Telemetry.h"
+#include "TranslationLocalizer.h"
+#include "UmeyamaSimilarity.h"
 
 
 const inline double rad2deg(const double rad)
@@ -16,18 +28,108 @@ const inline double rad2deg(const double rad)
     return (rad * 180.0 / M_PI);
 }
 
-class CommandIterationUpdate : public itk::Command
+// Where the distance map of 'pointsFilename' with 'spacing' and 'margin' is cached: next to it,
+// e.g. grains.dmap-s0.5-m8.mha for grains.txt
+std::string distanceMapCacheFilename(const std::string& pointsFilename, const double spacing, const double margin)
+{
+    std::ostringstream name;
+    const auto path = itksys::SystemTools::GetFilenamePath(pointsFilename);
+    name << (path.empty() ? "" : path + "/") << itksys::SystemTools::GetFilenameWithoutLastExtension(pointsFilename)
+         << ".dmap-s" << spacing << "-m" << margin << ".mha";
+    return name.str();
+}
+
+// Distance map of the points in 'pointsFilename' (see pointDistanceMap()). With the cache on, a
+// cached one newer than the points file is mapped in place of computing it; otherwise it is
+// computed and, with the cache on, written for next time.
+template <uint32_t TDimension>
+typename itk::Image<float, TDimension>::Pointer
+distanceMap(const typename itk::PointSet<double, TDimension>::Pointer points, const std::string& pointsFilename,
+            const double spacing, const double margin, const bool useCache)
+{
+    using TMap = itk::Image<float, TDimension>;
+    const auto cacheFilename = distanceMapCacheFilename(pointsFilename, spacing, margin);
+    int newer = -1;
+    if (useCache && itksys::SystemTools::FileExists(cacheFilename.c_str()) &&
+        itksys::SystemTools::FileTimeCompare(cacheFilename.c_str(), pointsFilename.c_str(), &newer) && newer >= 0) {
+        std::cout << "Using cached distance map " << cacheFilename << std::endl;
+        return readImage<TMap>(cacheFilename, MappedAccess::Whole);
+    }
+    auto map = pointDistanceMap<double, TDimension>(points, spacing, margin);
+    if (useCache) {
+        auto writer = itk::ImageFileWriter<TMap>::New();
+        writer->SetFileName(cacheFilename);
+        writer->SetInput(map);
+        try {
+            writer->Update();
+        } catch (itk::ExceptionObject& e) {
+            std::cerr << "[warning]: could not cache distance map " << cacheFilename << ": " << e.GetDescription()
+                      << std::endl;
+        }
+    }
+    return map;
+}
+
+// Point metric that times its evaluations. With the cost function gradient off, the optimizer
+// only ever asks for values (finite differences included).
+template <typename TMetric>
+class TimedPointMetric : public TMetric
 {
     public:
-        typedef  CommandIterationUpdate Self;
-        typedef  itk::Command           Superclass;
+        typedef TimedPointMetric        Self;
+        typedef TMetric                 Superclass;
+        typedef itk::SmartPointer<Self> Pointer;
+        itkNewMacro(Self);
+        typedef typename Superclass::MeasureType            MeasureType;
+        typedef typename Superclass::TransformParametersType TransformParametersType;
+
+        MeasureType GetValue(const TransformParametersType& parameters) const ITK_OVERRIDE
+        {
+            const auto start = std::chrono::steady_clock::now();
+            const auto value = Superclass::GetValue(parameters);
+            const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+            m_Seconds += elapsed.count();
+            m_Evaluations++;
+            return value;
+        }
+
+        // Seconds and evaluations since the last call
+        void TakeTiming(double& seconds, uint64_t& evaluations) const
+        {
+            seconds = m_Seconds;
+            evaluations = m_Evaluations;
+            m_Seconds = 0.0;
+            m_Evaluations = 0;
+        }
+
+    protected:
+        TimedPointMetric() {};
+
+    private:
+        mutable double m_Seconds = 0.0;
+        mutable uint64_t m_Evaluations = 0;
+};
+
+// Writes one JSON line per optimizer iteration: wall and metric time since the previous one,
+// metric evaluations, residuals, RMS residual and the step taken, with enough digits to read
+// back exactly. Levenberg-Marquardt has no learning rate, so that is null.
+template <typename TMetric>
+class PointTelemetryObserver : public itk::Command
+{
+    public:
+        typedef PointTelemetryObserver  Self;
+        typedef itk::Command            Superclass;
         typedef itk::SmartPointer<Self> Pointer;
         itkNewMacro(Self);
     protected:
-        CommandIterationUpdate() {};
+        PointTelemetryObserver() : m_Metric(nullptr), m_Iteration(0),
+                                   m_Start(std::chrono::steady_clock::now()), m_LastIteration(m_Start) {};
     public:
         typedef itk::LevenbergMarquardtOptimizer OptimizerType;
         typedef const OptimizerType *            OptimizerPointer;
+
+        void SetMetric(const TMetric* metric) { m_Metric = metric; }
+
         void Execute(itk::Object *caller, const itk::EventObject & event) ITK_OVERRIDE
         {
             Execute( (const itk::Object *)caller, event);
@@ -38,19 +140,115 @@ class CommandIterationUpdate : public itk::Command
             if( !itk::IterationEvent().CheckEvent(&event) ) {
               return;
             }
-            std::cout << optimizer->GetCachedValue() << std::endl;
-            std::cout << optimizer->GetCachedCurrentPosition();
-            std::cout << std::endl << std::endl;
+            const auto now = std::chrono::steady_clock::now();
+            const std::chrono::duration<double, std::milli> elapsed = now - m_LastIteration;
+            m_LastIteration = now;
+            double metricSeconds = 0.0;
+            uint64_t evaluations = 0;
+            m_Metric->TakeTiming(metricSeconds, evaluations);
+
+            const auto& residuals = optimizer->GetCachedValue();
+            double sumOfSquares = 0.0;
+            for (unsigned int i = 0; i < residuals.GetSize(); ++i) {
+                sumOfSquares += residuals[i] * residuals[i];
+            }
+            const auto& position = optimizer->GetCachedCurrentPosition();
+            double step = 0.0;
+            if (m_LastPosition.GetSize() == position.GetSize()) {
+                for (unsigned int p = 0; p < position.GetSize(); ++p) {
+                    step += (position[p] - m_LastPosition[p]) * (position[p] - m_LastPosition[p]);
+                }
+            }
+            m_LastPosition = position;
+
+            std::ostringstream record;
+            record.precision(std::numeric_limits<double>::max_digits10);
+            record << "{\"event\": \"iteration\", \"iteration\": " << m_Iteration++
+                   << ", \"value\": " << jsonNumber(std::sqrt(sumOfSquares / std::max(1u, residuals.GetSize())))
+                   << ", \"wall_ms\": " << elapsed.count()
+                   << ", \"metric_ms\": " << 1000.0 * metricSeconds
+                   << ", \"evaluations\": " << evaluations
+                   << ", \"valid_points\": " << residuals.GetSize()
+                   << ", \"step_length\": " << jsonNumber(std::sqrt(step))
+                   << ", \"learning_rate\": null"
+                   << ", \"threads\": " << m_Metric->GetNumberOfThreadsUsed()
+                   << ", \"position\": [";
+            for (unsigned int p = 0; p < position.GetSize(); ++p) {
+                record << (p > 0 ? ", " : "") << jsonNumber(position[p]);
+            }
+            record << "]}\n";
+            std::cout << record.str();
         }
+
+        // Record for the whole run
+        void Summary(const OptimizerType* optimizer) const
+        {
+            const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - m_Start;
+            std::ostringstream record;
+            record.precision(std::numeric_limits<double>::max_digits10);
+            record << "{\"event\": \"summary\", \"iterations\": " << m_Iteration
+                   << ", \"seconds\": " << elapsed.count()
+                   << ", \"stop\": \"" << jsonEscape(optimizer->GetStopConditionDescription()) << "\"}\n";
+            std::cout << record.str() << std::flush;
+        }
+
+    private:
+        const TMetric* m_Metric;
+        uint64_t m_Iteration;
+        std::chrono::steady_clock::time_point m_Start;
+        std::chrono::steady_clock::time_point m_LastIteration;
+        OptimizerType::ParametersType m_LastPosition;
 };
 
 
 int main(int argc, char * argv[] )
 {
-    if( argc < 3 ) {
+    // Options may come anywhere; the rest are the positional arguments
+    std::vector<std::string> args;
+    bool bruteForce = false;
+    uint32_t threads = 0;
+    double mapSpacing = 0.0, mapMargin = -1.0;
+    bool mapCache = false;
+    bool correspondence = false;
+    uint64_t polishIterations = 0;
+    for (int i = 1; i < argc; ++i) {
+        const auto arg = std::string(argv[i]);
+        if (arg == "--brute-force") {
+            bruteForce = true;
+        } else if (arg == "--threads" && i + 1 < argc) {
+            threads = uint32_t(std::stoul(argv[++i]));
+        } else if (arg == "--distance-map" && i + 1 < argc) {
+            mapSpacing = std::stod(argv[++i]);
+        } else if (arg == "--map-margin" && i + 1 < argc) {
+            mapMargin = std::stod(argv[++i]);
+        } else if (arg == "--map-cache") {
+            mapCache = true;
+        } else if (arg == "--correspondence") {
+            correspondence = true;
+        } else if (arg == "--polish" && i + 1 < argc) {
+            polishIterations = std::stoull(argv[++i]);
+        } else {
+            args.push_back(arg);
+        }
+    }
+    if( args.size() < 2 ) {
         std::cerr << "Usage:" << std::endl;
         std::cerr << "    " << argv[0]
-                  << " fixedPointsFile  movingPointsFile" << std::endl;
+                  << " fixedPointsFile  movingPointsFile  [cellSize]  [--threads n]  [--brute-force]"
+                  << "  [--distance-map s  [--map-margin m]  [--map-cache]]  [--correspondence  [--polish n]]"
+                  << std::endl;
+        std::cerr << "The starting translation comes from FFT correlation of the point densities on a grid"
+                  << " with cellSize spacing (default: 1/128 of the fixed points' largest extent)" << std::endl;
+        std::cerr << "Closest fixed points are found in a KD-tree with n threads (default: all cores);"
+                  << " --brute-force tries every fixed point instead, on one thread" << std::endl;
+        std::cerr << "--distance-map looks distances up in a distance map of the fixed points with voxel size s"
+                  << " over their bounds padded by m (default: 16 s), falling back to the KD-tree off the map;"
+                  << " --map-cache keeps the map next to the fixed points file for later runs. Map distances"
+                  << " can be off by up to about 0.87 s (half a voxel diagonal) and jump where the map ends, so"
+                  << " the registration is finished with exact KD-tree distances from where the map left it"
+                  << std::endl;
+        std::cerr << "--correspondence pairs the points by index and solves for the similarity transform in"
+                  << " closed form; --polish refines that with up to n closest point iterations" << std::endl;
         exit(1);;
     }
 
@@ -60,39 +258,54 @@ int main(int argc, char * argv[] )
     using TPoint = typename TPointSet::PointType;
 
     // Read points from filenames
-    const auto fixedFilename  = std::string(argv[1]);
-    const auto movingFilename = std::string(argv[2]);
+    const auto fixedFilename  = args[0];
+    const auto movingFilename = args[1];
     auto fixed  = readFromFile<double, TDimension>(fixedFilename); 
     auto moving = readFromFile<double, TDimension>(movingFilename); 
+    if (!fixed || !moving) {
+        std::cerr << "[error]: could not read points from " << (fixed ? movingFilename : fixedFilename) << std::endl;
+        exit(1);
+    }
+
+    // With known correspondences the least squares similarity has a closed form; the optimizer
+    // only runs if asked to polish it
+    using TTransform = itk::Similarity3DTransform<double>;
+    TTransform::Pointer closedForm;
+    if (correspondence) {
+        const auto start = std::chrono::steady_clock::now();
+        double rms = 0.0;
+        closedForm = umeyamaSimilarity<double>(fixed, moving, threads, rms);
+        if (!closedForm) {
+            exit(1);
+        }
+        const std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+        std::cout << "Closed form similarity: RMS residual " << rms << " in " << elapsed.count() << " ms" << std::endl;
+    }
+    const bool optimize = !correspondence || polishIterations > 0;
 
     // Set up registration infrastructure
-    auto metric       = itk::EuclideanDistancePointMetric<TPointSet, TPointSet>::New();
-    using TTransform  = itk::Similarity3DTransform<double>;
+    using TMetric     = TimedPointMetric<KdTreePointMetric<TPointSet, TPointSet>>;
+    auto metric       = TMetric::New();
+    metric->SetUseKdTree(!bruteForce);
+    metric->SetNumberOfThreads(threads);
+    if (mapSpacing > 0.0 && optimize) {
+        const double margin = mapMargin >= 0.0 ? mapMargin : 16.0 * mapSpacing;
+        const auto start = std::chrono::steady_clock::now();
+        metric->SetDistanceMap(distanceMap<TDimension>(fixed, fixedFilename, mapSpacing, margin, mapCache));
+        const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        std::cout << "Distance map: " << metric->GetDistanceMap()->GetLargestPossibleRegion().GetSize() << " voxels in "
+                  << elapsed.count() << " s" << std::endl;
+    }
     auto transform    = TTransform::New();
     auto optimizer    = itk::LevenbergMarquardtOptimizer::New();
     auto registration = itk::PointSetToPointSetRegistrationMethod<TPointSet, TPointSet>::New();
 
-    // Scale the translation components of the Transform in the Optimizer
-    using TOptimizer = itk::LevenbergMarquardtOptimizer;
-    TOptimizer::ScalesType scales(transform->GetNumberOfParameters());
-    const double rotationScale    = 1.0;
-    const double translationScale = 1000.0;
-    const double scaleScale       = 1.0;
-    scales[0] = 1.0 / rotationScale;
-    scales[1] = 1.0 / rotationScale;
-    scales[2] = 1.0 / rotationScale;
-    scales[3] = 1.0 / translationScale;
-    scales[4] = 1.0 / translationScale;
-    scales[5] = 1.0 / translationScale;
-    scales[6] = 1.0 / scaleScale;
-
     // Next we setup the convergence criteria, and other properties required
     // by the optimizer.
-    const uint64_t numberOfIterations =  1000;
+    const uint64_t numberOfIterations =  correspondence ? polishIterations : 1000;
     const double   gradientTolerance  =  1e-7; // convergence criterion
     const double   valueTolerance     =  1e-7; // convergence criterion
     const double   epsilonFunction    =  1e-10; // convergence criterion
-    optimizer->SetScales(scales);
     optimizer->SetNumberOfIterations(numberOfIterations);
     optimizer->SetValueTolerance(valueTolerance);
     optimizer->SetGradientTolerance(gradientTolerance);
@@ -100,61 +313,103 @@ int main(int argc, char * argv[] )
     optimizer->SetUseCostFunctionGradient(false);
 
     // Set best-guess starting transform
-    TTransform::VectorType axis;
-    axis[0] = 0.0;
-    axis[1] = 0.0;
-    axis[2] = 1.0;
-    const double angle = 0.0;
-    TTransform::VersorType rotation;
-    rotation.Set(axis, angle);
-    transform->SetRotation(rotation);
-
-    // Scaling
-    transform->SetScale(1.0);
-
-    // Translation
-    TTransform::TranslationType translate;
-    translate[0] = 451;
-    translate[1] = 607;
-    translate[2] = 107;
-    std::cout << "Translating " << translate << std::endl;
-    transform->SetTranslation(translate);
-
-    // Hook up initial transform to registration object
-    registration->SetInitialTransformParameters(transform->GetParameters());
-
-    // Finally, connect all the components required for the registration
-    registration->SetMetric(metric);
-    registration->SetOptimizer(optimizer);
-    registration->SetTransform(transform);
-    registration->SetFixedPointSet(fixed);
-    registration->SetMovingPointSet(moving);
-
-    // Connect an observer
-    CommandIterationUpdate::Pointer observer = CommandIterationUpdate::New();
-    optimizer->AddObserver(itk::IterationEvent(), observer);
-
-    // Run registration
-    try {
-        registration->Update();
-    } catch(itk::ExceptionObject& e) {
-        std::cout << e << std::endl;
-        return EXIT_FAILURE;
+    if (closedForm) {
+        transform->SetFixedParameters(closedForm->GetFixedParameters());
+        transform->SetParameters(closedForm->GetParameters());
+    } else {
+        TTransform::VectorType axis;
+        axis[0] = 0.0;
+        axis[1] = 0.0;
+        axis[2] = 1.0;
+        const double angle = 0.0;
+        TTransform::VersorType rotation;
+        rotation.Set(axis, angle);
+        transform->SetRotation(rotation);
+
+        // Scaling
+        transform->SetScale(1.0);
+
+        // Translation: the metric maps moving points into the fixed set, so it is where the moving
+        // point density best matches the fixed one
+        TPoint lower, upper;
+        pointBounds<double, TDimension>(fixed, lower, upper);
+        double extent = 0.0;
+        for (uint32_t d = 0; d < TDimension; ++d) {
+            extent = std::max(extent, upper[d] - lower[d]);
+        }
+        const double cellSize = args.size() > 2 ? std::stod(args[2]) : std::max(extent / 128.0, 1e-6);
+        auto density = [cellSize](const TPointSet::Pointer points) {
+            auto smoother = itk::SmoothingRecursiveGaussianImageFilter<TLocalizerImage, TLocalizerImage>::New();
+            smoother->SetInput(rasterizePoints<double, TDimension>(points, cellSize));
+            smoother->SetSigma(cellSize);
+            smoother->Update();
+            return TLocalizerImage::Pointer(smoother->GetOutput());
+        };
+        double correlation = 0.0;
+        const auto translate = locateTranslation(density(fixed), density(moving), 0.9, correlation);
+        std::cout << "Translating " << translate << " (correlation " << correlation << ")" << std::endl;
+        transform->SetTranslation(translate);
     }
 
-    std::cout << "Stopped because: " << optimizer->GetStopConditionDescription() << std::endl;
+    // Without correspondences, or to polish the closed form, optimize the closest point distances
+    auto finalParameters      = transform->GetParameters();
+    auto finalFixedParameters = transform->GetFixedParameters();
+    if (optimize) {
+        // Scale each parameter by how far it moves the moving points from the starting transform
+        const auto scales = physicalShiftScales<double, TDimension, TTransform>(moving, transform.GetPointer());
+        std::cout << "Scales = " << scales << std::endl;
+        optimizer->SetScales(scales);
+
+        // Hook up initial transform to registration object
+        registration->SetInitialTransformParameters(transform->GetParameters());
+
+        // Finally, connect all the components required for the registration
+        registration->SetMetric(metric);
+        registration->SetOptimizer(optimizer);
+        registration->SetTransform(transform);
+        registration->SetFixedPointSet(fixed);
+        registration->SetMovingPointSet(moving);
+
+        // Connect an observer
+        auto observer = PointTelemetryObserver<TMetric>::New();
+        observer->SetMetric(metric);
+        optimizer->AddObserver(itk::IterationEvent(), observer);
+
+        // Run registration
+        try {
+            registration->Update();
 
-    // Get average difference of optimizer positions for each point
-    double sum = 0.0;
-    auto position = optimizer->GetValue();
-    for (auto i = 0; i < position.GetSize(); ++i) {
-        sum += position.GetElement(i);
+            // Map distances are only good to within a voxel, so finish from where they led with
+            // the exact ones; from there this takes few iterations
+            if (metric->GetDistanceMap()) {
+                std::cout << "Map-guided registration " << optimizer->GetStopConditionDescription()
+                          << "; refining with exact distances" << std::endl;
+                metric->SetDistanceMap(nullptr);
+                registration->SetInitialTransformParameters(registration->GetOutput()->Get()->GetParameters());
+                registration->Modified();
+                registration->Update();
+            }
+        } catch(itk::ExceptionObject& e) {
+            std::cout << e << std::endl;
+            return EXIT_FAILURE;
+        }
+
+        observer->Summary(optimizer);
+
+        // Get average difference of optimizer positions for each point
+        double sum = 0.0;
+        auto position = optimizer->GetValue();
+        for (auto i = 0; i < position.GetSize(); ++i) {
+            sum += position.GetElement(i);
+        }
+        std::cout << "Average difference = " << sum / position.GetSize() << std::endl;
+        std::cout << std::endl;
+
+        finalParameters      = registration->GetOutput()->Get()->GetParameters();
+        finalFixedParameters = registration->GetOutput()->Get()->GetFixedParameters();
     }
-    std::cout << "Average difference = " << sum / position.GetSize() << std::endl;
-    std::cout << std::endl;
 
     // Print out final parameters
-    auto finalParameters = registration->GetOutput()->Get()->GetParameters();
     std::cout << "Result = " << std::endl;
     std::cout << " versor X        = " << finalParameters[0] << std::endl;
     std::cout << " versor Y        = " << finalParameters[1] << std::endl;
@@ -167,19 +422,23 @@ int main(int argc, char * argv[] )
 
     // Print out transformation matrix
     auto finalTransform = TTransform::New();
-    finalTransform->SetFixedParameters(registration->GetOutput()->Get()->GetFixedParameters());
+    finalTransform->SetFixedParameters(finalFixedParameters);
     finalTransform->SetParameters(finalParameters);
     std::cout << "Matrix = " << std::endl << finalTransform->GetMatrix() << std::endl;
     std::cout << "Angle  = " << rad2deg(finalTransform->GetVersor().GetAngle()) << std::endl;
     std::cout << "Offset = " << finalTransform->GetOffset() << std::endl;
     std::cout << "Scale  = " << finalTransform->GetScale() << std::endl;
 
-    // Run through moving PointSet and map back to fixed PointSet, verify they're close
-    for (auto i = 0; i < moving->GetNumberOfPoints(); ++i) {
-        auto transformedMovingPoint = finalTransform->TransformPoint(moving->GetPoint(i));
-        auto pointDifference = transformedMovingPoint - fixed->GetPoint(i);
-        std::cout << pointDifference.GetNorm() << std::endl;
+    // Run through moving PointSet and map back to fixed PointSet, verify they're close. The
+    // moving points aren't needed any more, so they are transformed in place.
+    transformPointsInPlace<double, TDimension>(moving, finalTransform.GetPointer(), threads);
+    const auto& movingPoints = moving->GetPoints()->CastToSTLConstContainer();
+    const auto& fixedPoints  = fixed->GetPoints()->CastToSTLConstContainer();
+    std::ostringstream residuals;
+    for (size_t i = 0; i < std::min(movingPoints.size(), fixedPoints.size()); ++i) {
+        residuals << (movingPoints[i] - fixedPoints[i]).GetNorm() << "\n";
     }
+    std::cout << residuals.str() << std::flush;
 
     return EXIT_SUCCESS;
 }
@@ -1,7 +1,6 @@
 #include <iostream>
 #include "PointSetUtil.h"
 #include "itkSimilarity3DTransform.h"
-#include "itkTransformMeshFilter.h"
 
 
 const uint32_t TDimension = 3;
@@ -47,11 +46,16 @@ void doApplyTransform(std::string infile, std::string outfile, const double rota
     // Read PointSet from file
     auto points = readFromFile<double, TDimension>(infile);
 
-    // Apply transform
-    auto transformedPoints = applyTransform<double, TDimension, TTransform>(points, transform);
+    if (!points) {
+        std::cerr << "[error]: could not read points from " << infile << std::endl;
+        exit(1);
+    }
+
+    // Apply transform, in place
+    transformPointsInPlace<double, TDimension>(points, transform.GetPointer());
 
     // Write back to file
-    writeToFile<double, TDimension>(outfile, transformedPoints);
+    writeToFile<double, TDimension>(outfile, points);
 }
 
 int main(int argc, char** argv)
@@ -59,6 +63,7 @@ int main(int argc, char** argv)
     if (argc < 8) {
         std::cerr << "Usage:" << std::endl;
         std::cerr << "    " << argv[0] << " infile outfile rot tx ty tz scale" << std::endl;
+        std::cerr << "outfile is written as a binary point file if it ends in .bin, as text otherwise" << std::endl;
         exit(1);
     }
 
@@ -0,0 +1,163 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+#include "itkMultiThreader.h"
+#include "itkPointSet.h"
+#include "itkSimilarity3DTransform.h"
+#include "vnl/algo/vnl_determinant.h"
+#include "vnl/algo/vnl_svd.h"
+
+
+// Sums of 'Values' terms over points 0 to 'count': accumulate(i, sums) adds point i's terms to
+// 'sums'. Chunks of points are summed by up to 'threads' threads (0: ITK's default), and the chunk
+// sums are added up in chunk order, so the result doesn't depend on the number of threads.
+template <uint32_t Values, typename TAccumulate>
+std::array<double, Values> parallelSum(const uint64_t count, const uint32_t threads, const TAccumulate& accumulate)
+{
+    const uint64_t chunkSize = 1 << 14;
+    const uint64_t numberOfChunks = (count + chunkSize - 1) / chunkSize;
+    const uint64_t numberOfThreads = std::max<uint64_t>(1, std::min<uint64_t>(
+        threads > 0 ? threads : itk::MultiThreader::GetGlobalDefaultNumberOfThreads(), numberOfChunks));
+    std::vector<std::array<double, Values>> chunkSums(numberOfChunks);
+    std::atomic<uint64_t> next(0);
+    auto worker = [&]() {
+        for (uint64_t chunk = next++; chunk < numberOfChunks; chunk = next++) {
+            auto& sums = chunkSums[chunk];
+            sums.fill(0.0);
+            const uint64_t end = std::min<uint64_t>(count, (chunk + 1) * chunkSize);
+            for (uint64_t i = chunk * chunkSize; i < end; ++i) {
+                accumulate(i, sums);
+            }
+        }
+    };
+    if (numberOfThreads == 1) {
+        worker();
+    } else {
+        std::vector<std::thread> workers;
+        for (uint64_t t = 0; t < numberOfThreads; ++t) {
+            workers.emplace_back(worker);
+        }
+        for (auto& thread : workers) {
+            thread.join();
+        }
+    }
+    std::array<double, Values> total;
+    total.fill(0.0);
+    for (const auto& sums : chunkSums) {
+        for (uint32_t v = 0; v < Values; ++v) {
+            total[v] += sums[v];
+        }
+    }
+    return total;
+}
+
+// The similarity transform (rotation, isotropic scale, translation) that takes each point of
+// 'moving' closest, in the least squares sense, to the point of 'fixed' with the same index. It
+// has a closed form (Umeyama, IEEE PAMI 13(4), 1991): the rotation comes from the SVD of the
+// covariance of the centered point pairs, the scale from its singular values and the spread of
+// the moving points. 'rms' is set to the root mean square distance left between the pairs.
+// Returns null, after saying why, if the point sets don't pair up or are degenerate.
+template <typename TElement>
+itk::Similarity3DTransform<double>::Pointer
+umeyamaSimilarity(const typename itk::PointSet<TElement, 3>::Pointer fixed,
+                  const typename itk::PointSet<TElement, 3>::Pointer moving, const uint32_t threads, double& rms)
+{
+    using TTransform = itk::Similarity3DTransform<double>;
+    const auto& x = moving->GetPoints()->CastToSTLConstContainer();
+    const auto& y = fixed->GetPoints()->CastToSTLConstContainer();
+    if (x.size() != y.size() || x.size() < 3) {
+        std::cerr << "[error]: corresponding point sets need the same number of points, at least 3 ("
+                  << y.size() << " fixed, " << x.size() << " moving)" << std::endl;
+        return nullptr;
+    }
+    const uint64_t n = x.size();
+
+    // Centroids
+    const auto sums = parallelSum<6>(n, threads, [&](const uint64_t i, std::array<double, 6>& s) {
+        for (uint32_t d = 0; d < 3; ++d) {
+            s[d]     += x[i][d];
+            s[d + 3] += y[i][d];
+        }
+    });
+    double meanX[3], meanY[3];
+    for (uint32_t d = 0; d < 3; ++d) {
+        meanX[d] = sums[d] / double(n);
+        meanY[d] = sums[d + 3] / double(n);
+    }
+
+    // Covariance of the centered pairs (row: fixed axis, column: moving axis) and the spreads of
+    // both sets
+    const auto moments = parallelSum<11>(n, threads, [&](const uint64_t i, std::array<double, 11>& s) {
+        double cx[3], cy[3];
+        for (uint32_t d = 0; d < 3; ++d) {
+            cx[d] = x[i][d] - meanX[d];
+            cy[d] = y[i][d] - meanY[d];
+        }
+        for (uint32_t r = 0; r < 3; ++r) {
+            for (uint32_t c = 0; c < 3; ++c) {
+                s[3 * r + c] += cy[r] * cx[c];
+            }
+        }
+        s[9]  += cx[0] * cx[0] + cx[1] * cx[1] + cx[2] * cx[2];
+        s[10] += cy[0] * cy[0] + cy[1] * cy[1] + cy[2] * cy[2];
+    });
+    const double varianceX = moments[9] / double(n);
+    const double varianceY = moments[10] / double(n);
+    if (!(varianceX > 0.0)) {
+        std::cerr << "[error]: the moving points all coincide; no transform fits them" << std::endl;
+        return nullptr;
+    }
+    if (!(varianceY > 0.0)) {
+        std::cerr << "[error]: the fixed points all coincide; only a zero scale would fit them" << std::endl;
+        return nullptr;
+    }
+    vnl_matrix<double> covariance(3, 3);
+    for (uint32_t r = 0; r < 3; ++r) {
+        for (uint32_t c = 0; c < 3; ++c) {
+            covariance(r, c) = moments[3 * r + c] / double(n);
+        }
+    }
+
+    // R = U S V^T, with S flipping the least significant axis if U V^T would be a reflection
+    vnl_svd<double> svd(covariance);
+    const double sign = vnl_determinant(svd.U()) * vnl_determinant(svd.V()) < 0.0 ? -1.0 : 1.0;
+    vnl_matrix<double> s(3, 3, 0.0);
+    s(0, 0) = 1.0;
+    s(1, 1) = 1.0;
+    s(2, 2) = sign;
+    const vnl_matrix<double> rotation = svd.U() * s * svd.V().transpose();
+    const double trace = svd.W(0) + svd.W(1) + sign * svd.W(2);
+    if (!(trace > 0.0)) {
+        std::cerr << "[error]: the point sets don't correlate; no positive scale fits them" << std::endl;
+        return nullptr;
+    }
+    const double scale = trace / varianceX;
+    rms = std::sqrt(std::max(0.0, varianceY - trace * trace / varianceX));
+
+    TTransform::MatrixType matrix;
+    for (uint32_t r = 0; r < 3; ++r) {
+        for (uint32_t c = 0; c < 3; ++c) {
+            matrix[r][c] = rotation(r, c);
+        }
+    }
+    TTransform::VersorType versor;
+    versor.Set(matrix);
+    TTransform::OutputVectorType translation;
+    for (uint32_t r = 0; r < 3; ++r) {
+        translation[r] = meanY[r] - scale * (rotation(r, 0) * meanX[0] + rotation(r, 1) * meanX[1] +
+                                             rotation(r, 2) * meanX[2]);
+    }
+    auto transform = TTransform::New();
+    transform->SetRotation(versor);
+    transform->SetScale(scale);
+    transform->SetTranslation(translation);
+    return transform;
+}